@@ -0,0 +1,279 @@
+/*
+   EN: Host benchmark of reShutter hot paths (virtual time, virtual GPIO)
+   RU: Нагрузочный тест основных операций reShutter на ПК (виртуальное время, виртуальные GPIO)
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+// Сборка (Linux, glibc): нужны заголовочные файлы зависимостей библиотеки (rLog.h, rStrings.h, reEsp32.h, reEvents.h,
+// reMqtt.h, def_consts.h, project_config.h) - из соответствующих библиотек или их заглушки для ПК:
+//
+//   g++ -O2 -std=gnu++17 -I include -I <каталог зависимостей> bench/shutter_bench.cpp src/*.cpp -o shutter_bench
+//   ./shutter_bench [количество приводов] [количество команд]
+//
+// Результаты выводятся построчно в формате "имя: значение", чтобы их было удобно сравнивать между версиями библиотеки.
+// Количество выделений памяти подсчитывается подменой malloc() / free() и доступно только при сборке с glibc.
+// Отладочный вывод библиотеки лучше отключить (CONFIG_RLOG_PROJECT_LEVEL) - иначе он войдет в измеренное время.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include "reShutter.h"
+
+#if defined(__GLIBC__)
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Подсчет выделений памяти ---------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#include <malloc.h>
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void  __libc_free(void* ptr);
+
+static uint64_t _allocs = 0;
+static int64_t  _heap_used = 0;
+static int64_t  _heap_peak = 0;
+
+static void heapAdd(void* ptr)
+{
+  if (ptr) {
+    _allocs++;
+    _heap_used += malloc_usable_size(ptr);
+    if (_heap_used > _heap_peak) _heap_peak = _heap_used;
+  };
+}
+
+static void heapSub(void* ptr)
+{
+  if (ptr) _heap_used -= malloc_usable_size(ptr);
+}
+
+extern "C" void* malloc(size_t size)
+{
+  void* ret = __libc_malloc(size);
+  heapAdd(ret);
+  return ret;
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+  void* ret = __libc_calloc(count, size);
+  heapAdd(ret);
+  return ret;
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+  heapSub(ptr);
+  void* ret = __libc_realloc(ptr, size);
+  heapAdd(ret);
+  return ret;
+}
+
+extern "C" void free(void* ptr)
+{
+  heapSub(ptr);
+  __libc_free(ptr);
+}
+
+#else
+
+static uint64_t _allocs = 0;
+static int64_t  _heap_used = 0;
+static int64_t  _heap_peak = 0;
+
+#endif // __GLIBC__
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Измерения ------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+static inline int64_t benchNowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock_t::now().time_since_epoch()).count();
+}
+
+// Простой генератор псевдослучайных чисел: результаты не зависят от реализации rand()
+static uint32_t _seed = 12345;
+static inline uint32_t benchRandom()
+{
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  return _seed;
+}
+
+static void benchReport(const char* name, uint64_t ops, int64_t elapsed_ns, uint64_t allocs)
+{
+  double seconds = elapsed_ns / 1e9;
+  printf("%s: %.0f ops/s, %.1f ns/op, %.2f allocs/op\n", name,
+    seconds > 0 ? ops / seconds : 0.0, ops > 0 ? (double)elapsed_ns / ops : 0.0, ops > 0 ? (double)allocs / ops : 0.0);
+}
+
+static void benchPercentiles(const char* name, std::vector<uint32_t>& samples)
+{
+  if (samples.empty()) return;
+  std::sort(samples.begin(), samples.end());
+  printf("%s: p50 %u ns, p99 %u ns, max %u ns\n", name,
+    samples[samples.size() / 2], samples[samples.size() * 99 / 100], samples.back());
+}
+
+// Приводы размещаются в std::deque: объекты не перемещаются в памяти и удаляются без delete через указатель
+typedef std::deque<rVirtualShutter> bench_shutters_t;
+
+static rVirtualShutter* benchCreate(bench_shutters_t& shutters, float step_time_adj)
+{
+  shutters.emplace_back(0, true, 1, true, 0, 10, 20000, 1000, step_time_adj, 500, nullptr, nullptr, nullptr);
+  shutters.back().Init();
+  return &shutters.back();
+}
+
+// Вычисление длительности перемещения для разного количества шагов и коэффициентов коррекции
+static void benchMoveTime(uint32_t iterations)
+{
+  const float adj[] = { 1.0f, 1.05f, 1.25f };
+  for (size_t a = 0; a < sizeof(adj) / sizeof(adj[0]); a++) {
+    bench_shutters_t shutters;
+    rVirtualShutter* shutter = benchCreate(shutters, adj[a]);
+    for (int8_t steps = 1; steps <= 10; steps = steps * 2 + (steps == 4 ? 2 : 0)) {
+      volatile uint32_t sink = 0;
+      uint64_t allocs = _allocs;
+      int64_t begin = benchNowNs();
+      for (uint32_t i = 0; i < iterations; i++) {
+        int8_t from = (int8_t)(i % (11 - steps));
+        sink = sink + shutter->calcMoveTime(from, from + steps);
+      };
+      char name[64];
+      snprintf(name, sizeof(name), "calcMoveTime adj=%.2f steps=%d", adj[a], steps);
+      benchReport(name, iterations, benchNowNs() - begin, _allocs - allocs);
+    };
+
+    // Полный путь команды: проверка ограничений, расчет времени, запуск таймера и переключение GPIO
+    uint64_t allocs = _allocs;
+    int64_t begin = benchNowNs();
+    for (uint32_t i = 0; i < iterations / 10; i++) {
+      shutter->Change((i & 1) ? -3 : 3, false);
+      shutter->Break();
+    };
+    char name[64];
+    snprintf(name, sizeof(name), "Change+Break adj=%.2f", adj[a]);
+    benchReport(name, iterations / 10, benchNowNs() - begin, _allocs - allocs);
+  };
+}
+
+static void benchLimits(uint32_t iterations)
+{
+  bench_shutters_t shutters;
+  rVirtualShutter* shutter = benchCreate(shutters, 1.0f);
+  shutter->setMinLimit(2, false);
+  shutter->setMaxLimit(8, false);
+  shutterVirtualTimeAdvance(60000000);
+  volatile int32_t sink = 0;
+  uint64_t allocs = _allocs;
+  int64_t begin = benchNowNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    sink = sink + shutter->checkLimits((int8_t)(i % 21) - 10);
+  };
+  benchReport("checkLimits", iterations, benchNowNs() - begin, _allocs - allocs);
+}
+
+static void benchJSON(uint32_t iterations)
+{
+  bench_shutters_t shutters;
+  rVirtualShutter* shutter = benchCreate(shutters, 1.0f);
+  shutter->Change(4, false);
+  shutterVirtualTimeAdvance(60000000);
+  char buf[CONFIG_SHUTTER_JSON_BUF_SIZE];
+
+  uint64_t allocs = _allocs;
+  int64_t begin = benchNowNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    shutter->getJSON(buf, sizeof(buf));
+  };
+  benchReport("getJSON(buf)", iterations, benchNowNs() - begin, _allocs - allocs);
+
+  allocs = _allocs;
+  begin = benchNowNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    free(shutter->getJSON());
+  };
+  benchReport("getJSON()", iterations, benchNowNs() - begin, _allocs - allocs);
+
+  allocs = _allocs;
+  begin = benchNowNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    free(shutter->getStateJSON(shutter->getState()));
+  };
+  benchReport("getStateJSON()", iterations, benchNowNs() - begin, _allocs - allocs);
+
+  allocs = _allocs;
+  begin = benchNowNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    free(shutter->getTimestampsJSON());
+  };
+  benchReport("getTimestampsJSON()", iterations, benchNowNs() - begin, _allocs - allocs);
+}
+
+// Множество приводов, получающих случайные команды; виртуальное время продвигается между командами
+static void benchMany(uint32_t count, uint32_t commands)
+{
+  int64_t heap_before = _heap_used;
+  bench_shutters_t shutters;
+  for (uint32_t i = 0; i < count; i++) {
+    benchCreate(shutters, 1.0f + (i % 5) * 0.05f);
+  };
+  printf("many: %u drives, %lld bytes of heap (%lld bytes per drive)\n", count,
+    (long long)(_heap_used - heap_before), (long long)((_heap_used - heap_before) / (count > 0 ? count : 1)));
+
+  std::vector<uint32_t> samples;
+  samples.reserve(commands);
+  uint64_t allocs = _allocs;
+  int64_t total = 0;
+  for (uint32_t i = 0; i < commands; i++) {
+    rVirtualShutter* shutter = &shutters[benchRandom() % count];
+    uint32_t op = benchRandom() % 8;
+    int64_t begin = benchNowNs();
+    switch (op) {
+      case 0:  shutter->Break(); break;
+      case 1:  shutter->CloseFull(false, false); break;
+      case 2:  shutter->MoveToPercent((float)(benchRandom() % 101), false); break;
+      default: shutter->Change((int8_t)(benchRandom() % 7) - 3, false); break;
+    };
+    int64_t elapsed = benchNowNs() - begin;
+    total += elapsed;
+    samples.push_back((uint32_t)elapsed);
+    // Срабатывания таймеров также входят в нагрузку, но измеряются отдельно
+    shutterVirtualTimeAdvance(benchRandom() % 50000);
+  };
+  benchReport("many: command", commands, total, _allocs - allocs);
+  benchPercentiles("many: command latency", samples);
+
+  int64_t begin = benchNowNs();
+  uint32_t fired = shutterVirtualTimeAdvance(3600000000ULL);
+  printf("many: drained %u timers in %.3f ms, heap peak %lld bytes\n", fired, (benchNowNs() - begin) / 1e6, (long long)_heap_peak);
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t count = argc > 1 ? (uint32_t)atoi(argv[1]) : 500;
+  uint32_t commands = argc > 2 ? (uint32_t)atoi(argv[2]) : 200000;
+  shutterVirtualTimeReset(1700000000);
+  benchMoveTime(1000000);
+  benchLimits(1000000);
+  benchJSON(100000);
+  benchMany(count, commands);
+  return 0;
+}
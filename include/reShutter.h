@@ -14,17 +14,291 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
-#include <esp_err.h>
-#include <driver/gpio.h>
 #include "project_config.h"
 #include "def_consts.h"
-#include "esp_timer.h"
+#include "reShutterPort.h"
+#include "reShutterTimers.h"
+#ifdef __cplusplus
+#include <atomic>
+#endif // __cplusplus
+#if defined(ESP_PLATFORM)
+#include <esp_err.h>
+#include <driver/gpio.h>
+#endif // ESP_PLATFORM
+
+/**
+ * Размер буфера (в стеке) для формирования JSON- или CBOR-пакета при публикации на MQTT
+ * */
+#ifndef CONFIG_SHUTTER_JSON_BUF_SIZE
+#define CONFIG_SHUTTER_JSON_BUF_SIZE 256
+#endif // CONFIG_SHUTTER_JSON_BUF_SIZE
+
+/**
+ * Ключи полей пакета CBOR (см. rShutter::getCBOR())
+ * */
+#define SHUTTER_CBOR_VALUE        1   // Текущее состояние (шаг)
+#define SHUTTER_CBOR_PERCENT      2   // Текущее положение в процентах (float32)
+#define SHUTTER_CBOR_MAX_VALUE    3   // Максимальное состояние с момента последнего открытия
+#define SHUTTER_CBOR_MAX_PERCENT  4   // Максимальное состояние в процентах (float32)
+#define SHUTTER_CBOR_CHANGED      5   // Время последнего изменения, секунды UNIX (0 - неизвестно)
+#define SHUTTER_CBOR_OPEN         6   // Время последнего открытия, секунды UNIX
+#define SHUTTER_CBOR_CLOSE        7   // Время последнего закрытия, секунды UNIX
+
+/**
+ * Поля состояния для публикации в отдельные подтопики (SHUTTER_FORMAT_FIELDS)
+ * */
+#define SHUTTER_FIELD_VALUE       0x01
+#define SHUTTER_FIELD_PERCENT     0x02
+#define SHUTTER_FIELD_CHANGED     0x04
+#define SHUTTER_FIELD_OPEN        0x08
+#define SHUTTER_FIELD_CLOSE       0x10
+#define SHUTTER_FIELD_MAXIMUM     0x20
+
+/**
+ * Подтопик для входящих команд: mqttTopicGet() + CONFIG_SHUTTER_COMMAND_TOPIC (см. rShutter::mqttCommandHandle())
+ * */
+#ifndef CONFIG_SHUTTER_COMMAND_TOPIC
+#define CONFIG_SHUTTER_COMMAND_TOPIC "/set"
+#endif // CONFIG_SHUTTER_COMMAND_TOPIC
+
+/**
+ * Минимальный интервал между публикациями состояния в миллисекундах (0 - публиковать сразу после каждого изменения)
+ * */
+#ifndef CONFIG_SHUTTER_PUBLISH_INTERVAL
+#define CONFIG_SHUTTER_PUBLISH_INTERVAL 0
+#endif // CONFIG_SHUTTER_PUBLISH_INTERVAL
+
+/**
+ * Интервал повторной попытки после неудачной публикации в миллисекундах (если интервал публикаций не задан)
+ * */
+#ifndef CONFIG_SHUTTER_PUBLISH_RETRY
+#define CONFIG_SHUTTER_PUBLISH_RETRY 5000
+#endif // CONFIG_SHUTTER_PUBLISH_RETRY
+
+/**
+ * Размер очереди команд, поступивших во время работы привода (0 - отклонять такие команды, как раньше)
+ * */
+#ifndef CONFIG_SHUTTER_QUEUE_SIZE
+#define CONFIG_SHUTTER_QUEUE_SIZE 4
+#endif // CONFIG_SHUTTER_QUEUE_SIZE
+
+/**
+ * Количество последних наблюдений (время перемещения до конечного выключателя), хранимых для калибровки привода
+ * */
+#ifndef CONFIG_SHUTTER_CALIBRATION_SIZE
+#define CONFIG_SHUTTER_CALIBRATION_SIZE 8
+#endif // CONFIG_SHUTTER_CALIBRATION_SIZE
+
+/**
+ * Минимальное количество наблюдений, после которого параметры привода начинают уточняться
+ * */
+#ifndef CONFIG_SHUTTER_CALIBRATION_MIN
+#define CONFIG_SHUTTER_CALIBRATION_MIN 3
+#endif // CONFIG_SHUTTER_CALIBRATION_MIN
+
+/**
+ * Запас в процентах: на столько увеличивается время перемещения до крайнего положения в режиме калибровки 
+ * (чтобы привод гарантированно дошел до конечного выключателя) и время полного закрытия full_time после калибровки
+ * */
+#ifndef CONFIG_SHUTTER_CALIBRATION_MARGIN
+#define CONFIG_SHUTTER_CALIBRATION_MARGIN 10
+#endif // CONFIG_SHUTTER_CALIBRATION_MARGIN
+
+/**
+ * Накопленная погрешность положения (в миллисекундах перемещения): добавка за каждое перемещение (инерция при пуске и 
+ * остановке двигателя), процент от времени перемещения, добавка за смену направления и за прерванное перемещение
+ * */
+#ifndef CONFIG_SHUTTER_DRIFT_MOVE
+#define CONFIG_SHUTTER_DRIFT_MOVE 50
+#endif // CONFIG_SHUTTER_DRIFT_MOVE
+#ifndef CONFIG_SHUTTER_DRIFT_RATE
+#define CONFIG_SHUTTER_DRIFT_RATE 2
+#endif // CONFIG_SHUTTER_DRIFT_RATE
+#ifndef CONFIG_SHUTTER_DRIFT_REVERSAL
+#define CONFIG_SHUTTER_DRIFT_REVERSAL 100
+#endif // CONFIG_SHUTTER_DRIFT_REVERSAL
+#ifndef CONFIG_SHUTTER_DRIFT_BREAK
+#define CONFIG_SHUTTER_DRIFT_BREAK 200
+#endif // CONFIG_SHUTTER_DRIFT_BREAK
+
+/**
+ * Пауза в миллисекундах между остановкой двигателя и его включением в обратном направлении при смене цели во время 
+ * перемещения (см. rShutter::setRetarget())
+ * */
+#ifndef CONFIG_SHUTTER_REVERSE_DEAD_TIME
+#define CONFIG_SHUTTER_REVERSE_DEAD_TIME 500
+#endif // CONFIG_SHUTTER_REVERSE_DEAD_TIME
+
+/**
+ * Интервал в секундах между проверками окна простоя, когда привод ожидает установки в начальное положение
+ * */
+#ifndef CONFIG_SHUTTER_REHOME_CHECK
+#define CONFIG_SHUTTER_REHOME_CHECK 600
+#endif // CONFIG_SHUTTER_REHOME_CHECK
+
+/**
+ * Гистограммы задержек на пути переключения GPIO (см. rShutter::getHistogram()): 1 - включить, 0 - отключить
+ * */
+#ifndef CONFIG_SHUTTER_HISTOGRAMS
+#define CONFIG_SHUTTER_HISTOGRAMS 0
+#endif // CONFIG_SHUTTER_HISTOGRAMS
+
+/**
+ * Количество интервалов гистограммы. Интервал i содержит значения от 2^(i-1) до 2^i-1 микросекунд, 
+ * последний интервал - все значения, которые больше
+ * */
+#ifndef CONFIG_SHUTTER_HISTOGRAM_BUCKETS
+#define CONFIG_SHUTTER_HISTOGRAM_BUCKETS 20
+#endif // CONFIG_SHUTTER_HISTOGRAM_BUCKETS
+
+/**
+ * Запись команд и событий таймера в журнал для последующего воспроизведения (см. reShutterRecorder.h): 1 - включить, 0 - отключить
+ * */
+#ifndef CONFIG_SHUTTER_RECORDER
+#define CONFIG_SHUTTER_RECORDER 0
+#endif // CONFIG_SHUTTER_RECORDER
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 class rShutter;
+class rIoExpPort;
+class rShutterJournal;
+class rShutterRecorder;
+class rShutterReplayer;
+
+/**
+ * Отметка времени вместе с её строковым представлением, которое пересчитывается только при изменении значения. 
+ * Кэш читается и обновляется только в критической секции (см. rShutter::getTimestampStr())
+ * */
+typedef struct {
+  time_t value;
+  bool   valid;
+  char   text[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
+} shutter_timestr_t;
+
+/**
+ * Тип команды в очереди привода
+ * */
+typedef enum {
+  SHUTTER_CMD_CHANGE = 0,         // Относительное перемещение на steps шагов
+  SHUTTER_CMD_OPEN_FULL,          // Полное открытие
+  SHUTTER_CMD_CLOSE_FULL,         // Полное закрытие
+  SHUTTER_CMD_MOVE_TO             // Перемещение в заданное положение travel
+} shutter_cmd_type_t;
+
+/**
+ * Состояние двигателя привода. Переходы выполняются атомарно (compare-and-swap): запустить привод может только та задача,
+ * которой удалось перевести его из SHUTTER_MOTION_IDLE, а остановить - та, которая перевела его в SHUTTER_MOTION_STOPPING.
+ * Пока выход не включен и таймер не запущен (SHUTTER_MOTION_STARTING или SHUTTER_MOTION_RETARGETING), остановить 
+ * привод может только захватившая его задача: другие задачи лишь запрашивают остановку (SHUTTER_MOTION_STOP_REQUESTED)
+ * */
+typedef enum {
+  SHUTTER_MOTION_IDLE = 0,        // Двигатель выключен
+  SHUTTER_MOTION_OPENING,         // Привод открывается
+  SHUTTER_MOTION_CLOSING,         // Привод закрывается
+  SHUTTER_MOTION_STOPPING,        // Привод останавливается (по таймеру или по команде)
+  SHUTTER_MOTION_DEAD_TIME,       // Двигатель выключен перед сменой направления, привод ожидает окончания паузы
+  SHUTTER_MOTION_STARTING,        // Привод запускается: выход еще не включен или таймер еще не запущен
+  SHUTTER_MOTION_STOP_REQUESTED,  // Остановка запрошена во время запуска и будет выполнена запускающей задачей
+  SHUTTER_MOTION_RETARGETING      // Цель перемещения изменяется (см. rShutter::setRetarget()), таймер остановлен
+} shutter_motion_t;
+
+/**
+ * Согласованный снимок состояния привода (см. rShutter::getSnapshot())
+ * */
+typedef struct {
+  shutter_motion_t motion;
+  uint8_t state;
+  uint32_t travel;                // Положение в миллисекундах перемещения из min_steps
+  uint8_t max_steps;
+  uint8_t last_max_state;
+  int8_t  limit_min;
+  int8_t  limit_max;
+  bool    homed;
+  time_t  last_changed;
+  time_t  last_open;
+  time_t  last_close;
+} shutter_snapshot_t;
+
+/**
+ * Счетчики работы привода (см. rShutter::getStats())
+ * */
+typedef enum {
+  SHUTTER_STAT_MOVES = 0,         // Количество включений двигателя
+  SHUTTER_STAT_REVERSALS,         // Количество включений в направлении, противоположном предыдущему
+  SHUTTER_STAT_MOTOR_MS,          // Суммарное время работы двигателя, мс
+  SHUTTER_STAT_HOMINGS,           // Количество установок в начальное положение (полное закрытие или конечный выключатель)
+  SHUTTER_STAT_QUEUED,            // Команды, поставленные в очередь, так как привод был занят
+  SHUTTER_STAT_BUSY,              // Команды, отклоненные, так как привод был занят (очередь заполнена или отключена)
+  SHUTTER_STAT_TIMER_ERRORS,      // Ошибки запуска таймера
+  SHUTTER_STAT_GPIO_ERRORS,       // Ошибки изменения уровня GPIO
+  SHUTTER_STAT_RETARGETS,         // Смены цели во время перемещения без остановки двигателя
+  SHUTTER_STAT_MAX
+} shutter_stat_t;
+
+typedef struct {
+  uint32_t value[SHUTTER_STAT_MAX];
+} shutter_stats_t;
+
+/**
+ * Формат пакета для публикации состояния на MQTT
+ * */
+typedef enum {
+  SHUTTER_FORMAT_JSON = 0,        // JSON-пакет (getJSON())
+  SHUTTER_FORMAT_CBOR,            // Двоичный пакет CBOR с целочисленными ключами (getCBOR())
+  SHUTTER_FORMAT_FIELDS           // Отдельные подтопики для каждого поля, публикуются только изменившиеся поля
+} shutter_format_t;
+
+/**
+ * Последние успешно опубликованные значения полей (для SHUTTER_FORMAT_FIELDS)
+ * */
+typedef struct {
+  uint8_t mask;                   // Биты SHUTTER_FIELD_*: значение поля было опубликовано
+  uint8_t state;
+  int32_t percent;                // Проценты * 10, как в опубликованной строке
+  uint8_t last_max_state;
+  time_t  last_changed;
+  time_t  last_open;
+  time_t  last_close;
+} shutter_published_t;
+
+/**
+ * Гистограммы задержек (при CONFIG_SHUTTER_HISTOGRAMS = 1)
+ * */
+typedef enum {
+  SHUTTER_HIST_COMMAND = 0,       // От начала выполнения команды до включения выхода
+  SHUTTER_HIST_GPIO,              // Длительность gpioSetLevel() (для расширителей GPIO - транзакция на шине)
+  SHUTTER_HIST_CALLBACK,          // Длительность каждого вызова _on_before, _on_after и _on_timer
+  SHUTTER_HIST_TIMER,             // От расчетного срабатывания таймера до отключения выхода
+  SHUTTER_HIST_MAX
+} shutter_hist_t;
+
+typedef struct {
+  uint32_t bucket[CONFIG_SHUTTER_HISTOGRAM_BUCKETS];
+  uint32_t count;
+  uint32_t max_us;
+} shutter_histogram_t;
+
+/**
+ * Наблюдение для калибровки: фактическое время хода от положения "полностью закрыто" до выключателя "полностью открыто"
+ * */
+typedef struct {
+  uint32_t time;
+} shutter_calib_obs_t;
+
+/**
+ * Команда, ожидающая выполнения в очереди привода
+ * */
+typedef struct {
+  shutter_cmd_type_t type;
+  int8_t steps;
+  uint32_t travel;
+  bool call_cb;
+  bool publish;
+  bool forced;                    // SHUTTER_CMD_CLOSE_FULL: закрывать, даже если привод уже в положении "закрыто"
+} shutter_cmd_t;
 
 // -----------------------------------------------------------------------------------------------------------------------
 // ---------------------------------------------- Функции обратного вызова -----------------------------------------------
@@ -42,6 +316,18 @@ class rShutter;
  * */
 typedef bool (*cb_shutter_publish_t) (rShutter *shutter, char* topic, char* payload, bool free_topic, bool free_payload);
 
+/**
+ * Функция обратного вызова для публикации двоичного пакета (CBOR) на MQTT брокере. Пакет может содержать нулевые байты, 
+ * поэтому передается вместе с длиной; он размещен в стеке вызывающей задачи и действителен только во время вызова
+ * @brief Функция обратного вызова для публикации двоичного пакета на MQTT брокере
+ * @param shutter Указатель на экземпляр класса
+ * @param topic MQTT-топик
+ * @param payload Двоичный пакет
+ * @param size Длина пакета в байтах
+ * @return Вернется true, если данные удалось отправить
+ * */
+typedef bool (*cb_shutter_publish_bin_t) (rShutter *shutter, char* topic, const uint8_t* payload, size_t size);
+
 /**
  * Функция обратного вызова после изменения состояния привода
  * @brief Функция обратного вызова после изменения состояния привода
@@ -52,6 +338,15 @@ typedef bool (*cb_shutter_publish_t) (rShutter *shutter, char* topic, char* payl
  * */
 typedef void (*cb_shutter_change_t) (rShutter *shutter, uint8_t from_step, uint8_t to_step, uint8_t max_steps);
 
+/**
+ * Функция обратного вызова при переходе привода в режим ожидания: перемещение завершено и очередь команд пуста, либо 
+ * операция прервана с помощью Break()
+ * @brief Функция обратного вызова при переходе привода в режим ожидания
+ * @param shutter Указатель на экземпляр класса
+ * @param arg Произвольный указатель, переданный в setIdleCallback()
+ * */
+typedef void (*cb_shutter_idle_t) (rShutter *shutter, void* arg);
+
 /**
  * Функция обратного вызова при активации и деактивации таймера (то есть она вызывается при включении и выключении привода)
  * @brief Функция обратного вызова при активации и деактивации таймера (то есть включения и выключения привода)
@@ -87,6 +382,15 @@ typedef bool (*cb_shutter_gpio_init_t) (rShutter *shutter, uint8_t pin, bool lev
  * */
 typedef bool (*cb_shutter_gpio_change_t) (rShutter *shutter, uint8_t pin, bool physical_level);
 
+/**
+ * Функция обратного вызова для записи всего порта расширителя GPIO одной транзакцией
+ * @brief Функция обратного вызова для записи всего порта расширителя GPIO одной транзакцией
+ * @param port Указатель на экземпляр порта
+ * @param value Физические уровни всех выводов порта (бит N - вывод N)
+ * @return Вернет true, если данные удалось записать
+ * */
+typedef bool (*cb_shutter_port_write_t) (rIoExpPort *port, uint32_t value);
+
 // -----------------------------------------------------------------------------------------------------------------------
 // ------------------------------------------ Базовый абстрактный класс rShutter -----------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
@@ -150,6 +454,28 @@ class rShutter {
      * */
     uint8_t getMaxSteps();
 
+    /**
+     * Получить минимальное количество шагов привода (состояние "полностью закрыто")
+     * @brief Получить минимальное количество шагов привода
+     * @return Минимальное количество шагов привода
+     * */
+    int8_t getMinSteps();
+
+    /**
+     * Получить время полного закрытия привода (без учета шагов)
+     * @brief Получить время полного закрытия привода
+     * @return Время в миллисекундах
+     * */
+    uint32_t getFullTime();
+
+    /**
+     * Проверить, известно ли положение привода достоверно, то есть было ли после Init() выполнено полное закрытие 
+     * CloseFullEx() на время full_time без прерывания
+     * @brief Проверить, выполнено ли полное закрытие после инициализации
+     * @return Вернет true, если положение привода достоверно известно
+     * */
+    bool isHomed();
+
     /**
      * Получить время последнего изменения состояния привода
      * @brief Получить время последнего изменения состояния привода
@@ -177,6 +503,173 @@ class rShutter {
      * */
     bool isFullClose();
 
+    /**
+     * Получить фактическое положение привода в данный момент. Во время работы привода положение интерполируется по 
+     * времени, прошедшему с начала перемещения. Внутри положение хранится в миллисекундах перемещения из min_steps, 
+     * поэтому после MoveTo() оно может находиться между шагами, а getState() возвращает ближайший шаг
+     * @brief Получить фактическое положение привода в данный момент
+     * @return Положение привода в шагах (с дробной частью)
+     * */
+    float getPositionNow();
+
+    /**
+     * Получить текущее состояние двигателя привода (без блокировок, можно вызывать из любой задачи)
+     * @brief Получить текущее состояние двигателя привода
+     * @return Состояние двигателя: ожидание, открытие, закрытие или остановка
+     * */
+    shutter_motion_t getMotion();
+
+    /**
+     * Получить согласованный снимок состояния, ограничений и отметок времени привода. Снимок защищен счетчиком 
+     * последовательности (seqlock): чтение не блокирует задачи, управляющие приводом, и повторяется, только если 
+     * во время копирования снимок был изменен
+     * @brief Получить согласованный снимок состояния привода
+     * @param snapshot Указатель на структуру, в которую будет скопирован снимок
+     * */
+    void getSnapshot(shutter_snapshot_t* snapshot);
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Временные параметры
+    // -------------------------------------------------------------------------------------------------------------------
+
+    /**
+     * Рассчитать время работы привода для перемещения между двумя состояниями (по заранее вычисленной таблице)
+     * @brief Рассчитать время работы привода для перемещения между двумя состояниями
+     * @param from Начальное состояние привода в шагах
+     * @param to Конечное состояние привода в шагах
+     * @return Время работы привода в миллисекундах, с учетом step_time_fin при закрытии до _min_steps
+     * */
+    uint32_t calcMoveTime(int8_t from, int8_t to);
+
+    /**
+     * Изменить временные параметры привода и пересчитать таблицу длительности шагов
+     * @brief Изменить временные параметры привода
+     * @param full_time Время в миллисекундах, которое требуется для перехода из "полностью закрыто" в "полностью открыто" и наоборот
+     * @param step_time Время одного шага в миллисекундах
+     * @param step_time_adj Коэффициент коррекции длительности каждого следующего шага
+     * @param step_time_fin Добавочное время к последнему шагу при закрытии
+     * */
+    void setTiming(uint32_t full_time, uint32_t step_time, float step_time_adj, uint32_t step_time_fin);
+
+    /**
+     * Получить время первого шага
+     * @brief Получить время первого шага
+     * @return Время в миллисекундах
+     * */
+    uint32_t getStepTime();
+
+    /**
+     * Получить коэффициент коррекции длительности каждого следующего шага
+     * @brief Получить коэффициент коррекции длительности шагов
+     * */
+    float getStepTimeAdj();
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Журнал положения
+    // -------------------------------------------------------------------------------------------------------------------
+
+    /**
+     * Подключить журнал положения в энергонезависимой памяти (см. reShutterJournal.h). Журнал нужно подключить до Init():
+     * если последняя запись журнала сделана в состоянии покоя, Init() восстанавливает положение, ограничения и отметки 
+     * времени без установки привода в начальное положение. Новая запись добавляется только при изменении состояния 
+     * (не чаще двух раз за перемещение: при запуске и при остановке двигателя) и выполняется в фоновой задаче
+     * @brief Подключить журнал положения
+     * @param journal Указатель на журнал (объект должен существовать все время работы привода) или nullptr
+     * */
+    void setJournal(rShutterJournal* journal);
+
+    /**
+     * Подключить журнал команд (см. reShutterRecorder.h) и начать запись: в заголовок журнала записываются параметры 
+     * и текущее состояние привода. После setTiming() запись нужно начать заново. Доступно при CONFIG_SHUTTER_RECORDER = 1
+     * @brief Подключить журнал команд
+     * @param recorder Указатель на журнал команд или nullptr, чтобы остановить запись
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool setRecorder(rShutterRecorder* recorder);
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Конечные выключатели и калибровка
+    // -------------------------------------------------------------------------------------------------------------------
+
+    /**
+     * Сообщить библиотеке, что привод достиг крайнего положения (по внешнему конечному выключателю или по росту тока 
+     * двигателя). Если привод двигался в эту сторону, двигатель сразу отключается, а положение привода становится 
+     * достоверно известным (см. isHomed()). В режиме калибровки фактическое время перемещения запоминается
+     * @brief Сообщить о достижении крайнего положения
+     * @param open true - достигнуто положение "полностью открыто", false - "полностью закрыто"
+     * @return Вернет true, если положение привода было уточнено
+     * */
+    bool limitReached(bool open);
+
+    /**
+     * Включить режим калибровки: время полного открытия от достоверно известного положения "полностью закрыто" до 
+     * конечного выключателя запоминается (не более CONFIG_SHUTTER_CALIBRATION_SIZE последних наблюдений), а step_time и 
+     * full_time уточняются методом наименьших квадратов после каждого нового наблюдения. Перемещения из промежуточных 
+     * положений не учитываются: их начальное положение само вычислено по модели, которую нужно уточнить. Форма модели 
+     * (step_time_adj) сохраняется: по конечным выключателям наблюдается только общий масштаб времени. Перемещения в крайние положения 
+     * в этом режиме удлиняются на CONFIG_SHUTTER_CALIBRATION_MARGIN процентов (но не менее full_time, поэтому на время 
+     * калибровки full_time следует задать с запасом) и прерываются событием limitReached()
+     * @brief Включить режим калибровки
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool calibrationStart();
+
+    /**
+     * Выключить режим калибровки и освободить память наблюдений (найденные параметры сохраняются)
+     * @brief Выключить режим калибровки
+     * */
+    void calibrationStop();
+
+    /**
+     * Получить количество накопленных наблюдений
+     * @brief Получить количество накопленных наблюдений
+     * */
+    uint8_t calibrationCount();
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Накопленная погрешность и повторная установка в начальное положение
+    // -------------------------------------------------------------------------------------------------------------------
+
+    /**
+     * Получить оценку накопленной погрешности положения с момента последней установки в начальное положение (полного 
+     * закрытия на время full_time или срабатывания конечного выключателя). Погрешность растет с каждым перемещением, 
+     * сменой направления и прерыванием перемещения (см. CONFIG_SHUTTER_DRIFT_*)
+     * @brief Получить оценку накопленной погрешности положения
+     * @return Погрешность в миллисекундах перемещения
+     * */
+    uint32_t getDrift();
+
+    /**
+     * Включить повторную установку в начальное положение по накопленной погрешности. Когда погрешность превышает порог, 
+     * ближайшее перемещение в положение min_steps выполняется как полное закрытие на время full_time (привод и так 
+     * движется туда, поэтому дополнительное время работы двигателя минимально)
+     * @brief Включить повторную установку в начальное положение по накопленной погрешности
+     * @param threshold_ms Порог погрешности в миллисекундах перемещения, 0 - отключить
+     * */
+    void setRehome(uint32_t threshold_ms);
+
+    /**
+     * Задать ежедневное окно простоя: если погрешность превысила порог, а закрытия так и не потребовалось, привод 
+     * в это время закрывается на время full_time и возвращается в прежнее положение
+     * @brief Задать ежедневное окно простоя для повторной установки в начальное положение
+     * @param begin Начало окна в минутах от полуночи (местное время)
+     * @param end Окончание окна в минутах от полуночи; окно может переходить через полночь; begin == end - отключить
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool setRehomeWindow(uint16_t begin, uint16_t end);
+
+    /**
+     * Разрешить смену цели во время перемещения. Если новая цель находится в том же направлении, оставшееся время работы 
+     * двигателя изменяется без его остановки; если в обратном - двигатель останавливается, после паузы dead_time_ms 
+     * перемещение выполняется из фактически достигнутого положения. Без этого режима команды, полученные во время 
+     * перемещения, выполняются после его завершения. Полное закрытие, калибровка и непустая очередь команд отключают 
+     * смену цели для текущего перемещения
+     * @brief Разрешить смену цели во время перемещения
+     * @param enabled true - разрешить, false - ставить команды в очередь
+     * @param dead_time_ms Пауза перед сменой направления в миллисекундах
+     * */
+    void setRetarget(bool enabled, uint32_t dead_time_ms);
+
     // -------------------------------------------------------------------------------------------------------------------
     // Генерация JSON-пакета
     // -------------------------------------------------------------------------------------------------------------------
@@ -203,6 +696,83 @@ class rShutter {
      * */
     char* getJSON();
 
+    /**
+     * Генерация полного JSON-пакета в буфер вызывающей стороны за один проход, без выделения динамической памяти
+     * @brief Генерация полного JSON-пакета в буфер вызывающей стороны
+     * @param buf Буфер для JSON-пакета
+     * @param size Размер буфера
+     * @return Длина сформированной строки или 0, если буфер слишком мал
+     * */
+    size_t getJSON(char* buf, size_t size);
+
+    /**
+     * Генерация двоичного пакета CBOR с теми же данными, что и getJSON(): map с целочисленными ключами SHUTTER_CBOR_*,
+     * проценты в формате float32, отметки времени - секунды UNIX. Пакет формируется без выделения динамической памяти
+     * и обычно в несколько раз короче JSON
+     * @brief Генерация двоичного пакета CBOR в буфер вызывающей стороны
+     * @param buf Буфер для пакета
+     * @param size Размер буфера
+     * @return Длина пакета или 0, если буфер слишком мал
+     * */
+    size_t getCBOR(uint8_t* buf, size_t size);
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Статистика работы привода
+    // -------------------------------------------------------------------------------------------------------------------
+
+    /**
+     * Получить копию счетчиков работы привода. Счетчики атомарные и изменяются без блокировок, поэтому функцию можно 
+     * вызывать из любой задачи
+     * @brief Получить счетчики работы привода
+     * @param stats Указатель на структуру для копии счетчиков
+     * */
+    void getStats(shutter_stats_t* stats);
+
+    /**
+     * Получить значение одного счетчика
+     * @brief Получить значение одного счетчика
+     * @param stat Счетчик
+     * */
+    uint32_t getStat(shutter_stat_t stat);
+
+    /**
+     * Сбросить счетчики работы привода. Если передан указатель, в него копируются значения перед сбросом
+     * @brief Сбросить счетчики работы привода
+     * @param stats Указатель на структуру для копии счетчиков или nullptr
+     * */
+    void resetStats(shutter_stats_t* stats = nullptr);
+
+    /**
+     * Генерация JSON-пакета со счетчиками работы привода в буфер вызывающей стороны
+     * @brief Генерация JSON-пакета со счетчиками работы привода
+     * @param buf Буфер для JSON-пакета
+     * @param size Размер буфера
+     * @return Длина сформированной строки или 0, если буфер слишком мал
+     * */
+    size_t getStatsJSON(char* buf, size_t size);
+
+    /**
+     * Генерация JSON-пакета со счетчиками работы привода
+     * @brief Генерация JSON-пакета со счетчиками работы привода
+     * @return Строка, размещенная в динамической памяти
+     * */
+    char* getStatsJSON();
+
+    /**
+     * Получить копию гистограммы задержек. Гистограммы собираются только при CONFIG_SHUTTER_HISTOGRAMS = 1
+     * @brief Получить копию гистограммы задержек
+     * @param hist Гистограмма
+     * @param histogram Указатель на структуру для копии
+     * @return Вернет false, если гистограммы отключены
+     * */
+    bool getHistogram(shutter_hist_t hist, shutter_histogram_t* histogram);
+
+    /**
+     * Сбросить все гистограммы задержек
+     * @brief Сбросить все гистограммы задержек
+     * */
+    void resetHistograms();
+
     // -------------------------------------------------------------------------------------------------------------------
     // Управление приводом
     // -------------------------------------------------------------------------------------------------------------------
@@ -217,19 +787,49 @@ class rShutter {
     bool Change(int8_t steps, bool publish);
 
     /**
-     * Проверить, занят ли привод в текущее время (то есть выполняется изменение состояния)
+     * Открыть или закрыть привод на заданное количество шагов - расширенная версия
+     * @brief Открыть или закрыть привод на заданное количество шагов - расширенная версия
+     * @param steps Количество шагов, на которое необходимо изменить состояние привода: положительное - открыть, отрицательное - закрыть
+     * @param call_cb Вызывать функции обратного вызова при изменении состояния
+     * @param publish Опубликовать состояние сразу после успешного выполнения запрошенной операции
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool ChangeEx(int8_t steps, bool call_cb, bool publish);
+
+    /**
+     * Проверить, занят ли привод в текущее время (то есть выполняется изменение состояния). Функции управления приводом 
+     * можно вызывать из разных задач одновременно: запуск и остановка двигателя защищены атомарным состоянием, 
+     * а очередь команд - короткой критической секцией
      * @brief Проверить, занят ли привод в текущее время (то есть выполняется изменение состояния)
      * @return Вернет true, если привод работает в текущее время и не может выполнить другую операцию
      * */
     bool isBusy();
 
     /**
-     * Прервать текущую операцию
+     * Прервать текущую операцию и отменить все команды в очереди. Состояние привода пересчитывается по фактически 
+     * отработанному времени (с округлением до ближайшего шага)
      * @brief Прервать текущую операцию
      * @return Вернет true в случае успешного выполнения операции
      * */
     bool Break();
 
+    /**
+     * Получить количество команд, ожидающих выполнения в очереди. Команды Change() и OpenFull(), поступившие во время работы 
+     * привода, ставятся в очередь (последовательные Change() объединяются в одно перемещение) и выполняются после его остановки.
+     * CloseFull() отменяет все команды в очереди
+     * @brief Получить количество команд, ожидающих выполнения в очереди
+     * @return Количество команд в очереди
+     * */
+    uint8_t getQueued();
+
+    /**
+     * Установить функцию обратного вызова при переходе привода в режим ожидания (используется в rShutterGroup)
+     * @brief Установить функцию обратного вызова при переходе привода в режим ожидания
+     * @param cb_idle Callback, вызываемый после завершения перемещения и всех команд в очереди
+     * @param arg Произвольный указатель, передаваемый в callback
+     * */
+    void setIdleCallback(cb_shutter_idle_t cb_idle, void* arg);
+
     /**
      * Перевести привод в состояние "полностью открыто"
      * @brief Перевести привод в состояние "полностью открыто"
@@ -238,6 +838,26 @@ class rShutter {
      * */
     bool OpenFull(bool publish);
 
+    /**
+     * Перевести привод в заданное абсолютное положение. Положение может быть дробным: время работы двигателя вычисляется 
+     * по таблице длительности шагов с интерполяцией внутри шага, что позволяет точно регулировать привод, не увеличивая 
+     * количество шагов
+     * @brief Перевести привод в заданное положение
+     * @param step Положение в шагах (с дробной частью) в пределах установленных ограничений
+     * @param publish Опубликовать состояние сразу после успешного выполнения запрошенной операции
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool MoveTo(float step, bool publish);
+
+    /**
+     * Перевести привод в заданное положение в процентах (так же, как getPercent(), от max_steps)
+     * @brief Перевести привод в заданное положение в процентах
+     * @param percent Положение в процентах
+     * @param publish Опубликовать состояние сразу после успешного выполнения запрошенной операции
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool MoveToPercent(float percent, bool publish);
+
     /**
      * Перевести привод в состояние "полностью закрыто" - расширенная версия
      * @brief Перевести привод в состояние "полностью закрыто" - расширенная версия
@@ -268,6 +888,14 @@ class rShutter {
      * */
     int8_t checkLimits(int8_t steps);
 
+    /**
+     * Корректировать целевое положение с учетом постоянных и временных ограничений
+     * @brief Корректировать целевое положение с учетом ограничений
+     * @param step Целевое положение в шагах
+     * @return Ближайшее допустимое положение в шагах
+     * */
+    int8_t checkTarget(int8_t step);
+
     /**
      * Установить минимальное ограничение (то есть "нельзя закрыть полностью")
      * @brief Установить минимальное ограничение (то есть "нельзя закрыть полностью")
@@ -311,6 +939,19 @@ class rShutter {
      * */
     void mqttSetCallback(cb_shutter_publish_t cb_publish);
 
+    /**
+     * Выбрать формат пакета для публикации состояния. Для SHUTTER_FORMAT_CBOR нужна функция публикации двоичных данных, 
+     * так как cb_shutter_publish_t принимает строку, которая не может содержать нулевые байты. В формате 
+     * SHUTTER_FORMAT_FIELDS каждое поле публикуется в свой подтопик mqttTopicGet()/<поле> (value, percent, changed, open, 
+     * close, maximum), причем только если его значение отличается от последнего успешно опубликованного (callback 
+     * должен публиковать такие топики с флагом retained). Смена формата или топика приводит к публикации всех полей
+     * @brief Выбрать формат пакета для публикации состояния
+     * @param format Формат пакета
+     * @param cb_publish_bin Callback для публикации двоичного пакета (обязателен для SHUTTER_FORMAT_CBOR)
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool mqttSetFormat(shutter_format_t format, cb_shutter_publish_bin_t cb_publish_bin = nullptr);
+
     /**
      * Получить текущий MQTT топик
      * @brief Получить текущий MQTT топик
@@ -345,17 +986,64 @@ class rShutter {
     void mqttTopicFree();
     
     /**
-     * Публиковать данные на MQTT сервере
+     * Публиковать данные на MQTT сервере. Если отправить данные не удалось, публикация будет повторена через интервал 
+     * публикаций (или через CONFIG_SHUTTER_PUBLISH_RETRY, если интервал не задан)
      * @brief Публиковать данные на MQTT сервере
      * @return Вернет true в случае успешного выполнения операции
      * */
     bool mqttPublish();
 
+    /**
+     * Включить объединение публикаций: изменения помечаются и отправляются не чаще одного раза в заданный интервал
+     * (и сразу после остановки привода), всегда с последним состоянием
+     * @brief Задать минимальный интервал между публикациями состояния
+     * @param interval_ms Интервал в миллисекундах, 0 - публиковать сразу после каждого изменения
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool mqttSetInterval(uint32_t interval_ms);
+
+    /**
+     * Немедленно опубликовать отложенные изменения, если они есть
+     * @brief Немедленно опубликовать отложенные изменения, если они есть
+     * @return Вернет true, если данные были отправлены
+     * */
+    bool mqttFlush();
+
+    /**
+     * Обработать входящее сообщение MQTT. Команды принимаются из топика mqttTopicGet() + CONFIG_SHUTTER_COMMAND_TOPIC 
+     * и разбираются прямо в полученном буфере, без копирования и выделения памяти:
+     *   "5" или "2.5" - переместить в положение (шаг), "50%" - переместить в положение в процентах,
+     *   "+2" / "-1" - изменить положение на заданное количество шагов,
+     *   "open", "close", "stop" - открыть полностью, закрыть полностью, прервать,
+     *   "min=3", "max=7" - задать ограничения, "min=" и "max=" - снять ограничения.
+     * Повторно доставленное после переподключения сохраненное (retained) сообщение игнорируется, если совпадает с 
+     * последней выполненной абсолютной командой; относительные команды и "stop" из сохраненных сообщений не выполняются никогда
+     * @brief Обработать входящее сообщение MQTT
+     * @param topic Топик (может быть без завершающего нуля)
+     * @param topic_len Длина топика
+     * @param data Данные (может быть без завершающего нуля)
+     * @param data_len Длина данных
+     * @param retained Сообщение доставлено брокером как сохраненное
+     * @return Вернет true, если команда адресована этому приводу и выполнена
+     * */
+    bool mqttCommandHandle(const char* topic, size_t topic_len, const char* data, size_t data_len, bool retained);
+
     // -------------------------------------------------------------------------------------------------------------------
     // Прервать всё !!! Не вызывайте напрямую - эта функция только для обработчика таймера
     // -------------------------------------------------------------------------------------------------------------------
     bool StopAll();
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Завершение перемещения по таймеру !!! Не вызывайте напрямую - эта функция только для обработчика таймера
+    // -------------------------------------------------------------------------------------------------------------------
+    bool DoTimerEnd();
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Проверка окна простоя !!! Не вызывайте напрямую - эта функция только для обработчика таймера
+    // -------------------------------------------------------------------------------------------------------------------
+    void DoRehomeCheck();
   protected:
+
     uint8_t     _pin_open = 0;
     bool        _level_open = true;
     uint8_t     _pin_close = 0;
@@ -363,7 +1051,12 @@ class rShutter {
 
     virtual bool gpioInit() = 0;
     virtual bool gpioSetLevel(uint8_t pin, bool physical_level) = 0; 
+    virtual void gpioBatchBegin() {};
+    virtual bool gpioBatchEnd() { return true; };
   private:
+    // Воспроизведение журнала команд восстанавливает внутреннее состояние модели привода
+    friend class rShutterReplayer;
+
     uint32_t                _full_time = 15000;
     int8_t                  _min_steps = 0;
     int8_t                  _max_steps = 10;
@@ -371,6 +1064,8 @@ class rShutter {
     float                   _step_time_adj = 1.00;
     uint32_t                _step_time_fin = 0;
     int8_t                  _state = 0;
+    uint32_t                _travel = 0;
+    bool                    _homed = false;
     uint8_t                 _pin_open_state = 0;
     uint8_t                 _pin_close_state = 0;
     int8_t                  _limit_min = INT8_MIN;
@@ -379,18 +1074,123 @@ class rShutter {
     time_t                  _last_open = 0;
     time_t                  _last_close = 0;
     int8_t                  _last_max_state = 0;
-    esp_timer_handle_t      _timer = nullptr;
+    shutter_timer_handle_t  _timer = nullptr;
     char*                   _mqtt_topic = nullptr;
+    uint32_t*               _time_table = nullptr;
+    shutter_timestr_t       _time_str_changed;
+    shutter_timestr_t       _time_str_open;
+    shutter_timestr_t       _time_str_close;
+    shutter_timer_handle_t  _publish_timer = nullptr;
+    uint32_t                _publish_interval = 0;
+    int64_t                 _publish_last = 0;
+    bool                    _publish_dirty = false;
+    #if CONFIG_SHUTTER_QUEUE_SIZE > 0
+    shutter_cmd_t           _queue[CONFIG_SHUTTER_QUEUE_SIZE];
+    #endif // CONFIG_SHUTTER_QUEUE_SIZE
+    uint8_t                 _queue_head = 0;
+    uint8_t                 _queue_count = 0;
+    bool                    _move_active = false;
+    bool                    _move_homing = false;
+    uint32_t                _move_base = 0;
+    uint32_t                _move_target = 0;
+    int8_t                  _move_to = 0;
+    int8_t                  _move_max_state = 0;
+    int64_t                 _move_start = 0;
+    uint32_t                _move_duration = 0;
+    bool                    _move_known = false;
+    uint32_t*               _time_spare = nullptr;
+    shutter_calib_obs_t*    _calib = nullptr;
+    uint8_t                 _calib_head = 0;
+    uint8_t                 _calib_count = 0;
+    uint32_t                _drift = 0;
+    int8_t                  _drift_dir = 0;
+    uint32_t                _rehome_threshold = 0;
+    uint16_t                _rehome_begin = 0;
+    uint16_t                _rehome_end = 0;
+    shutter_timer_handle_t  _rehome_timer = nullptr;
+    bool                    _retarget = false;
+    uint32_t                _dead_time = CONFIG_SHUTTER_REVERSE_DEAD_TIME;
+    uint32_t                _reverse_travel = 0;
+    bool                    _reverse_pending = false;
+    bool                    _reverse_cb = false;
+    bool                    _reverse_publish = false;
+    std::atomic<uint8_t>    _motion{SHUTTER_MOTION_IDLE};
+    std::atomic<uint32_t>   _snap_seq{0};
+    shutter_snapshot_t      _snap;
+    rShutterJournal*        _journal = nullptr;
+    rShutterRecorder*       _recorder = nullptr;
+    std::atomic<uint32_t>   _stats[SHUTTER_STAT_MAX];
+    int64_t                 _stat_on = -1;
+    int8_t                  _stat_dir = 0;
+    #if CONFIG_SHUTTER_HISTOGRAMS
+    std::atomic<uint32_t>   _hist[SHUTTER_HIST_MAX][CONFIG_SHUTTER_HISTOGRAM_BUCKETS];
+    std::atomic<uint32_t>   _hist_count[SHUTTER_HIST_MAX];
+    std::atomic<uint32_t>   _hist_max[SHUTTER_HIST_MAX];
+    int64_t                 _hist_command = -1;
+    int64_t                 _hist_deadline = -1;
+    #endif // CONFIG_SHUTTER_HISTOGRAMS
 
     cb_shutter_change_t     _on_changed = nullptr;
     cb_shutter_gpio_wrap_t  _on_before = nullptr;
     cb_shutter_gpio_wrap_t  _on_after = nullptr;
     cb_shutter_timer_t      _on_timer = nullptr;
     cb_shutter_publish_t    _mqtt_publish = nullptr;
+    cb_shutter_publish_bin_t _mqtt_publish_bin = nullptr;
+    shutter_format_t        _mqtt_format = SHUTTER_FORMAT_JSON;
+    shutter_published_t     _mqtt_published;
+    uint32_t                _mqtt_cmd_hash = 0;
+    cb_shutter_idle_t       _on_idle = nullptr;
+    void*                   _on_idle_arg = nullptr;
+
+    bool calcTimeTable();
+    const char* getTimestampStr(shutter_timestr_t* cache, time_t value, char* buf, size_t size);
+    bool publishState();
+    bool publishFields();
+    void publishRetry();
+    bool publishField(const char* field, const char* payload);
+
+    void queueClear();
+    bool queuePush(shutter_cmd_type_t type, int8_t steps, uint32_t travel, bool call_cb, bool publish, bool forced, bool priority);
+    bool queueProcess();
+    bool queueCommand(shutter_cmd_type_t type, int8_t steps, uint32_t travel, bool call_cb, bool publish, bool forced, bool priority);
+
+    bool motionBegin();
+    bool motionRun(shutter_motion_t motion);
+    bool motionStop();
+    void motionAbort(bool call_cb);
+    void motionEnd();
+    void snapshotUpdate();
+    bool journalRestore();
+    void statInc(shutter_stat_t stat, uint32_t value = 1);
+    #if CONFIG_SHUTTER_HISTOGRAMS
+    void histAdd(shutter_hist_t hist, int64_t begin);
+    #endif // CONFIG_SHUTTER_HISTOGRAMS
+
+    void calibrationAdd(uint32_t time);
+    float calibrationUnits();
+    float calibrationFitStep();
+    void calibrationFit();
 
-    uint32_t calcStepTimeout(int8_t step);
+    void driftAdd(uint32_t drift);
+    void driftReset();
+    bool rehomeNeeded();
+    bool rehomeInWindow();
+    void rehomeNow();
+
+    void moveStart(int8_t target, uint32_t travel, uint32_t duration, bool homing);
+    bool moveBreak(bool call_cb);
+    bool moveHalt(bool call_cb);
+    bool moveRetarget(uint32_t travel, bool call_cb, bool publish);
+    bool moveReverse();
+    float calcPosition(uint32_t travel);
+    uint32_t calcTravel(float position);
+    uint32_t calcChangeTravel(int8_t steps);
+    uint32_t calcTravelNow();
+    float calcPositionNow();
     bool gpioSetLevelPriv(uint8_t pin, bool physical_level);
     bool DoChange(int8_t steps, bool call_cb, bool publish);
+    bool DoMove(uint32_t travel, bool call_cb, bool publish);
+    bool DoCloseFull(bool forced, bool call_cb, bool publish);
 
     bool timerCreate();
     bool timerFree();
@@ -399,6 +1199,8 @@ class rShutter {
     bool timerStop();
 };
 
+#if defined(ESP_PLATFORM)
+
 // -----------------------------------------------------------------------------------------------------------------------
 // --------------------------------- Класс rGpioShutter для работы через встроенные GPIO ---------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
@@ -444,6 +1246,90 @@ class rGpioShutter: public rShutter {
     bool gpioSetLevel(uint8_t pin, bool physical_level) override; 
 };
 
+#endif // ESP_PLATFORM
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------ Класс rIoExpPort - теневой регистр порта расширителя GPIO ------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+class rIoExpPort {
+  public:
+    /**
+     * Теневой регистр порта расширителя GPIO (PCF8574 и аналогичных). Изменения выводов накапливаются в памяти и 
+     * записываются в расширитель одной транзакцией, в том числе если выводами порта управляют несколько приводов
+     * @brief Теневой регистр порта расширителя GPIO
+     * @param init_value Начальные физические уровни всех выводов порта
+     * @param cb_write Callback для записи всего порта в расширитель
+     * */
+    rIoExpPort(uint32_t init_value, cb_shutter_port_write_t cb_write);
+    ~rIoExpPort();
+
+    /**
+     * Записать начальное значение порта в расширитель
+     * @brief Записать начальное значение порта в расширитель
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool Init();
+
+    /**
+     * Изменить уровень вывода в теневом регистре. Вне пакета изменение сразу записывается в расширитель
+     * @brief Изменить уровень вывода в теневом регистре
+     * @param pin Номер вывода порта (0..31)
+     * @param physical_level Физический уровень
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool setLevel(uint8_t pin, bool physical_level);
+
+    /**
+     * Получить уровень вывода из теневого регистра
+     * @brief Получить уровень вывода из теневого регистра
+     * @param pin Номер вывода порта (0..31)
+     * @return Физический уровень
+     * */
+    bool getLevel(uint8_t pin);
+
+    /**
+     * Начать пакет изменений: до парного вызова endUpdate() изменения только накапливаются. Пакеты могут быть вложенными
+     * @brief Начать пакет изменений
+     * */
+    void beginUpdate();
+
+    /**
+     * Завершить пакет изменений; при завершении внешнего пакета накопленные изменения записываются одной транзакцией
+     * @brief Завершить пакет изменений
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool endUpdate();
+
+    /**
+     * Записать изменения теневого регистра в расширитель, если они есть. Если запись уже выполняет другая задача,
+     * функция сразу возвращает true - эта задача запишет и новые изменения
+     * @brief Записать изменения теневого регистра в расширитель
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool Commit();
+
+    /**
+     * Начать пакет изменений сразу для всех портов (подходит для shutterTimerSetBatchHooks())
+     * @brief Начать пакет изменений сразу для всех портов
+     * */
+    static void BeginAll(void* arg);
+
+    /**
+     * Завершить пакет изменений сразу для всех портов (подходит для shutterTimerSetBatchHooks())
+     * @brief Завершить пакет изменений сразу для всех портов
+     * */
+    static void EndAll(void* arg);
+  private:
+    uint32_t                _value = 0;
+    uint32_t                _written = 0;
+    bool                    _synced = false;
+    bool                    _writing = false;
+    uint8_t                 _batch = 0;
+    cb_shutter_port_write_t _write = nullptr;
+    rIoExpPort*             _next = nullptr;
+};
+
 // -----------------------------------------------------------------------------------------------------------------------
 // -------------------------------- Класс rIoExpShutter для работы через расширители GPIO --------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
@@ -476,6 +1362,19 @@ class rIoExpShutter: public rShutter {
       cb_shutter_gpio_init_t cb_gpio_init, cb_shutter_gpio_change_t cb_gpio_change,
       cb_shutter_gpio_wrap_t cb_gpio_before, cb_shutter_gpio_wrap_t cb_gpio_after, cb_shutter_timer_t cb_timer, 
       cb_shutter_change_t cb_state_changed, cb_shutter_publish_t cb_mqtt_publish);
+
+    /**
+     * Инициализация экземпляра класса, работающего через теневой регистр порта расширителя. Оба вывода привода при 
+     * остановке (и выводы нескольких приводов при пакетной обработке таймеров) записываются одной транзакцией
+     * @brief Инициализация экземпляра класса, работающего через теневой регистр порта расширителя
+     * @param port Теневой регистр порта расширителя, к которому подключен привод
+     * Остальные параметры - как в предыдущем конструкторе
+     * */
+    rIoExpShutter(uint8_t pin_open, bool level_open, uint8_t pin_close, bool level_close, 
+      int8_t min_steps, int8_t max_steps, uint32_t full_time, uint32_t step_time, float step_time_adj, uint32_t step_time_fin,
+      rIoExpPort* port,
+      cb_shutter_gpio_wrap_t cb_gpio_before, cb_shutter_gpio_wrap_t cb_gpio_after, cb_shutter_timer_t cb_timer, 
+      cb_shutter_change_t cb_state_changed, cb_shutter_publish_t cb_mqtt_publish);
   protected:
     /**
      * Инициализация GPIO перед началом работы
@@ -490,9 +1389,55 @@ class rIoExpShutter: public rShutter {
      * @return Вернет true в случае успешного выполнения операции
      * */
     bool gpioSetLevel(uint8_t pin, bool physical_level) override; 
+    void gpioBatchBegin() override;
+    bool gpioBatchEnd() override;
   private:
     cb_shutter_gpio_init_t _gpio_init = nullptr;
     cb_shutter_gpio_change_t _gpio_change = nullptr;
+    rIoExpPort* _port = nullptr;
+};
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------ Класс rVirtualShutter для работы с виртуальными GPIO -----------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+class rVirtualShutter: public rShutter {
+  public:
+    /**
+     * Инициализация экземпляра класса с виртуальными GPIO - для отладки, моделирования и нагрузочных тестов на ПК.
+     * Физические уровни выходов хранятся в памяти и доступны через gpioGetLevel()
+     * @brief Инициализация экземпляра класса с виртуальными GPIO
+     * @param pin_open Номер GPIO для открытия привода
+     * @param level_open Логический уровень, используемый для активации привода на открытие
+     * @param pin_close Номер GPIO для закрытия привода
+     * @param level_close Логический уровень, используемый для активации привода на закрытие
+     * @param min_steps Количество шагов в режиме "полностью закрыто"
+     * @param max_steps Количество шагов в режиме "полностью открыто"
+     * @param full_time Время в миллисекундах, которое требуется для перехода из "полностью закрыто" в "полностью открыто" и наоборот
+     * @param step_time Время одного шага в миллисекундах
+     * @param step_time_adj Коэффициент коррекции длительности каждого следующего шага, по умолчанию 1.0
+     * @param step_time_fin Добавочное время к последнему шагу при закрытии, для гарантированной доводки привода до состояния "полностью закрыто"
+     * @param cb_timer Callback, вызываемый при запуске изменения состояния привода и сразу после его завершения
+     * @param cb_state_changed Callback, вызываемый при изменении состояния привода
+     * @param cb_mqtt_publish Callback, вызываемый при публикации данных на MQTT
+     * */
+    rVirtualShutter(uint8_t pin_open, bool level_open, uint8_t pin_close, bool level_close, 
+      int8_t min_steps, int8_t max_steps, uint32_t full_time, uint32_t step_time, float step_time_adj, uint32_t step_time_fin,
+      cb_shutter_timer_t cb_timer, cb_shutter_change_t cb_state_changed, cb_shutter_publish_t cb_mqtt_publish);
+
+    /**
+     * Получить текущий физический уровень виртуального GPIO
+     * @brief Получить текущий физический уровень виртуального GPIO
+     * @param pin Номер вывода
+     * @return Физический уровень на выводе
+     * */
+    bool gpioGetLevel(uint8_t pin);
+  protected:
+    bool gpioInit() override;
+    bool gpioSetLevel(uint8_t pin, bool physical_level) override; 
+  private:
+    bool _gpio_open = false;
+    bool _gpio_close = false;
 };
 
 #ifdef __cplusplus
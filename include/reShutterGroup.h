@@ -0,0 +1,194 @@
+/*
+   EN: Group of drives moved to a common target with a limit on simultaneously running motors
+   RU: Группа приводов, перемещаемых в общее положение с ограничением количества одновременно работающих двигателей
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+#ifndef __RE_SHUTTER_GROUP_H__
+#define __RE_SHUTTER_GROUP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "reShutter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+class rShutterGroup;
+
+/**
+ * Функция обратного вызова после завершения групповой операции (всеми приводами группы)
+ * @brief Функция обратного вызова после завершения групповой операции
+ * @param group Указатель на экземпляр группы
+ * */
+typedef void (*cb_shutter_group_done_t) (rShutterGroup *group);
+
+/**
+ * Функция обратного вызова после завершения групповой операции отдельным приводом (например, после завершения 
+ * начального закрытия привод уже можно использовать, не дожидаясь остальных)
+ * @brief Функция обратного вызова после завершения групповой операции отдельным приводом
+ * @param group Указатель на экземпляр группы
+ * @param shutter Указатель на привод
+ * */
+typedef void (*cb_shutter_group_item_t) (rShutterGroup *group, rShutter *shutter);
+
+/**
+ * Вид групповой операции
+ * */
+typedef enum {
+  SHUTTER_GROUP_MOVE = 0,         // Перемещение в заданное положение
+  SHUTTER_GROUP_HOME              // Полное закрытие на время full_time (установка в начальное положение)
+} shutter_group_action_t;
+
+/**
+ * Состояние привода в рамках текущей групповой операции
+ * */
+typedef enum {
+  SHUTTER_GROUP_IDLE = 0,         // Привод не участвует в операции или уже завершил её
+  SHUTTER_GROUP_PENDING,          // Привод ожидает своей очереди
+  SHUTTER_GROUP_ACTIVE            // Двигатель привода включен
+} shutter_group_state_t;
+
+typedef struct {
+  rShutter* shutter;
+  int8_t target;
+  uint32_t duration;
+  shutter_group_state_t state;
+} shutter_group_item_t;
+
+class rShutterGroup {
+  public:
+    /**
+     * Создание группы приводов
+     * @brief Создание группы приводов
+     * @param capacity Максимальное количество приводов в группе
+     * @param max_active Максимальное количество одновременно работающих двигателей (0 - без ограничений)
+     * @param cb_done Callback, вызываемый один раз после завершения групповой операции всеми приводами
+     * */
+    rShutterGroup(uint8_t capacity, uint8_t max_active, cb_shutter_group_done_t cb_done);
+
+    /**
+     * Уничтожение группы
+     * @brief Уничтожение группы
+     * */
+    ~rShutterGroup();
+
+    /**
+     * Добавить привод в группу. Группа использует setIdleCallback() привода, поэтому привод может входить только в одну группу
+     * @brief Добавить привод в группу
+     * @param shutter Указатель на привод
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool add(rShutter* shutter);
+
+    /**
+     * Получить количество приводов в группе
+     * @brief Получить количество приводов в группе
+     * */
+    uint8_t getCount();
+
+    /**
+     * Изменить максимальное количество одновременно работающих двигателей
+     * @brief Изменить максимальное количество одновременно работающих двигателей
+     * @param max_active Максимальное количество одновременно работающих двигателей (0 - без ограничений)
+     * */
+    void setMaxActive(uint8_t max_active);
+
+    /**
+     * Задать минимальный интервал между включениями двигателей, чтобы пусковые токи не складывались
+     * @brief Задать минимальный интервал между включениями двигателей
+     * @param stagger_ms Интервал в миллисекундах (0 - без задержки)
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool setStagger(uint32_t stagger_ms);
+
+    /**
+     * Установить функцию обратного вызова, вызываемую при завершении операции каждым отдельным приводом
+     * @brief Установить функцию обратного вызова для отдельных приводов
+     * @param cb_item Callback, вызываемый для каждого привода
+     * */
+    void setItemCallback(cb_shutter_group_item_t cb_item);
+
+    /**
+     * Перевести все приводы группы в заданное положение. Перемещения запускаются начиная с самых длительных (LPT),
+     * так что при ограничении количества двигателей вся группа завершает работу за минимальное время.
+     * Callback-и изменения состояния отдельных приводов не вызываются, вместо них один раз вызывается cb_done
+     * @brief Перевести все приводы группы в заданное положение
+     * @param step Положение в шагах
+     * @param publish Опубликовать состояние каждого привода после запуска его перемещения
+     * @return Вернет true, если операция запущена
+     * */
+    bool MoveTo(int8_t step, bool publish);
+
+    /**
+     * Перевести все приводы группы в заданное положение в процентах (для приводов с разным количеством шагов)
+     * @brief Перевести все приводы группы в заданное положение в процентах
+     * @param percent Положение в процентах
+     * @param publish Опубликовать состояние каждого привода после запуска его перемещения
+     * @return Вернет true, если операция запущена
+     * */
+    bool MoveToPercent(float percent, bool publish);
+
+    /**
+     * Установить все приводы группы в начальное положение (полное закрытие на время full_time), например после 
+     * включения питания. Приводы закрываются параллельно, не более max_active одновременно и с интервалом stagger 
+     * между включениями. Каждый привод становится доступен сразу после своего закрытия (см. setItemCallback() и 
+     * rShutter::isHomed()), не дожидаясь остальных
+     * @brief Установить все приводы группы в начальное положение
+     * @param publish Опубликовать состояние каждого привода после запуска
+     * @return Вернет true, если операция запущена
+     * */
+    bool Home(bool publish);
+
+    /**
+     * Прервать групповую операцию: ожидающие приводы не будут запущены, работающие будут остановлены
+     * @brief Прервать групповую операцию
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool Break();
+
+    /**
+     * Проверить, выполняется ли групповая операция
+     * @brief Проверить, выполняется ли групповая операция
+     * */
+    bool isBusy();
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Обработка остановки привода и таймера группы !!! Не вызывайте напрямую - эти функции только для callback-ов
+    // -------------------------------------------------------------------------------------------------------------------
+    void DoIdle(rShutter* shutter);
+    void DoTimer();
+  protected:
+    shutter_group_item_t*   _items = nullptr;
+    uint8_t*                _order = nullptr;
+    uint8_t                 _capacity = 0;
+    uint8_t                 _count = 0;
+    uint8_t                 _max_active = 0;
+    uint8_t                 _active = 0;
+    uint8_t                 _pending = 0;
+    bool                    _running = false;
+    bool                    _publish = false;
+    shutter_group_action_t  _action = SHUTTER_GROUP_MOVE;
+    uint32_t                _stagger = 0;
+    int64_t                 _last_start = 0;
+    shutter_timer_handle_t  _timer = nullptr;
+    cb_shutter_group_done_t _on_done = nullptr;
+    cb_shutter_group_item_t _on_item = nullptr;
+
+    bool Start();
+    void startNext();
+    bool canStart();
+    bool startItem(shutter_group_item_t* item);
+    void sortByDuration();
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RE_SHUTTER_GROUP_H__
@@ -0,0 +1,184 @@
+/*
+   EN: Persistent journal of shutter position: append-only ring of records in NVS (ESP-IDF) or in a file (host builds)
+   RU: Журнал положения привода в энергонезависимой памяти: кольцо записей в NVS (ESP-IDF) или в файле (сборка на ПК)
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+#ifndef __RE_SHUTTER_JOURNAL_H__
+#define __RE_SHUTTER_JOURNAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "project_config.h"
+#include "reShutterPort.h"
+#if defined(ESP_PLATFORM)
+#include "nvs.h"
+#endif // ESP_PLATFORM
+
+/**
+ * Количество записей в кольце журнала по умолчанию. Каждая следующая запись пишется в следующую ячейку,
+ * поэтому износ распределяется по всем ячейкам
+ * */
+#ifndef CONFIG_SHUTTER_JOURNAL_SLOTS
+#define CONFIG_SHUTTER_JOURNAL_SLOTS 8
+#endif // CONFIG_SHUTTER_JOURNAL_SLOTS
+
+#define SHUTTER_JOURNAL_MOVING 0x01     // В момент записи привод работал - положение после перезапуска неизвестно
+#define SHUTTER_JOURNAL_HOMED  0x02     // Положение привода было достоверно известно
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Запись журнала: положение, ограничения и отметки времени привода
+ * */
+typedef struct __attribute__((packed)) {
+  uint32_t seq;                         // Порядковый номер записи, последняя запись имеет наибольший номер
+  uint32_t travel;                      // Положение в миллисекундах перемещения из min_steps
+  int64_t  last_changed;
+  int64_t  last_open;
+  int64_t  last_close;
+  uint32_t drift;                       // Накопленная погрешность положения
+  int8_t   state;
+  int8_t   last_max_state;
+  int8_t   limit_min;
+  int8_t   limit_max;
+  uint8_t  flags;                       // SHUTTER_JOURNAL_MOVING | SHUTTER_JOURNAL_HOMED
+  uint8_t  reserved;
+  uint16_t crc;                         // CRC16 всех предыдущих полей
+} shutter_journal_rec_t;
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------- Базовый абстрактный класс журнала -----------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+class rShutterJournal {
+  public:
+    /**
+     * Инициализация журнала
+     * @brief Инициализация журнала
+     * @param slots Количество записей в кольце
+     * */
+    rShutterJournal(uint8_t slots);
+    virtual ~rShutterJournal() {};
+
+    /**
+     * Найти последнюю целую запись журнала (с наибольшим номером и правильной контрольной суммой)
+     * @brief Прочитать последнюю запись журнала
+     * @param rec Указатель на структуру, в которую будет скопирована запись
+     * @return Вернет true, если запись найдена
+     * */
+    bool load(shutter_journal_rec_t* rec);
+
+    /**
+     * Добавить запись в журнал. Запись не выполняется, если данные не изменились или если привод по-прежнему работает
+     * (для восстановления после перезапуска достаточно знать, что перемещение было начато)
+     * @brief Добавить запись в журнал
+     * @param rec Указатель на запись; поля seq и crc заполняются журналом
+     * @return Вернет true в случае успешного выполнения операции (в том числе, если запись не потребовалась)
+     * */
+    bool append(shutter_journal_rec_t* rec);
+
+    /**
+     * Передать запись для отложенной записи в фоновой задаче (см. shutterPortDefer()). Функция не блокирует вызывающую
+     * задачу и может вызываться из callback-ов таймеров; из нескольких записей, переданных до записи в журнал,
+     * записывается только последняя
+     * @brief Добавить запись в журнал в фоновой задаче
+     * @param rec Указатель на запись (копируется)
+     * */
+    void post(const shutter_journal_rec_t* rec);
+
+    /**
+     * Записать запись, переданную через post(). Вызывается в фоновой задаче
+     * @brief Записать отложенную запись
+     * */
+    void flush();
+
+    /**
+     * Получить количество выполненных записей с момента запуска
+     * @brief Получить количество выполненных записей
+     * */
+    uint32_t getWrites();
+  protected:
+    uint8_t _slots = CONFIG_SHUTTER_JOURNAL_SLOTS;
+
+    virtual bool slotRead(uint8_t index, shutter_journal_rec_t* rec) = 0;
+    virtual bool slotWrite(uint8_t index, const shutter_journal_rec_t* rec) = 0;
+  private:
+    uint8_t               _next = 0;
+    uint32_t              _seq = 0;
+    uint32_t              _writes = 0;
+    bool                  _loaded = false;
+    bool                  _last_valid = false;
+    shutter_journal_rec_t _last;
+    bool                  _pending_valid = false;
+    bool                  _flush_queued = false;
+    shutter_journal_rec_t _pending;
+
+    bool isSame(const shutter_journal_rec_t* rec);
+};
+
+#if defined(ESP_PLATFORM)
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Журнал в разделе NVS -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+class rShutterJournalNvs: public rShutterJournal {
+  public:
+    /**
+     * Журнал в NVS: каждая ячейка кольца хранится в отдельном ключе "j0".."jN" заданного пространства имен
+     * @brief Журнал в NVS
+     * @param nvs_space Пространство имен NVS (отдельное для каждого привода, не длиннее 15 символов)
+     * @param slots Количество записей в кольце
+     * */
+    rShutterJournalNvs(const char* nvs_space, uint8_t slots);
+    ~rShutterJournalNvs();
+  protected:
+    bool slotRead(uint8_t index, shutter_journal_rec_t* rec) override;
+    bool slotWrite(uint8_t index, const shutter_journal_rec_t* rec) override;
+  private:
+    const char* _nvs_space = nullptr;
+    nvs_handle_t _nvs_handle = 0;
+    bool _nvs_opened = false;
+
+    bool nvsOpen();
+};
+
+#endif // ESP_PLATFORM
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Журнал в файле --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+class rShutterJournalFile: public rShutterJournal {
+  public:
+    /**
+     * Журнал в файле с ячейками фиксированного размера - для сборки на ПК или для файловой системы на flash
+     * @brief Журнал в файле
+     * @param filename Имя файла (отдельного для каждого привода)
+     * @param slots Количество записей в кольце
+     * */
+    rShutterJournalFile(const char* filename, uint8_t slots);
+    ~rShutterJournalFile();
+  protected:
+    bool slotRead(uint8_t index, shutter_journal_rec_t* rec) override;
+    bool slotWrite(uint8_t index, const shutter_journal_rec_t* rec) override;
+  private:
+    const char* _filename = nullptr;
+    FILE* _file = nullptr;
+
+    bool fileOpen();
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RE_SHUTTER_JOURNAL_H__
@@ -0,0 +1,178 @@
+/*
+   EN: Platform layer for reShutter: one-shot timers and clock (ESP-IDF or virtual time for host builds)
+   RU: Платформенный слой для reShutter: однократные таймеры и часы (ESP-IDF или виртуальное время для сборки на ПК)
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+#ifndef __RE_SHUTTER_PORT_H__
+#define __RE_SHUTTER_PORT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "project_config.h"
+
+/**
+ * Использовать виртуальное время вместо esp_timer. По умолчанию включается автоматически при сборке вне ESP-IDF.
+ * В этом режиме таймеры срабатывают только при вызове shutterVirtualTimeAdvance() - строго детерминированно и
+ * в одном потоке, что позволяет прогонять тысячи приводов быстрее реального времени
+ * */
+#ifndef CONFIG_SHUTTER_PORT_VIRTUAL
+  #if defined(ESP_PLATFORM)
+    #define CONFIG_SHUTTER_PORT_VIRTUAL 0
+  #else
+    #define CONFIG_SHUTTER_PORT_VIRTUAL 1
+  #endif
+#endif // CONFIG_SHUTTER_PORT_VIRTUAL
+
+#if !CONFIG_SHUTTER_PORT_VIRTUAL
+#include "esp_timer.h"
+#endif // CONFIG_SHUTTER_PORT_VIRTUAL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Функция обратного вызова при срабатывании таймера
+ * @brief Функция обратного вызова при срабатывании таймера
+ * @param arg Произвольный указатель, переданный при создании таймера
+ * */
+typedef void (*cb_shutter_port_timer_t) (void* arg);
+
+#if CONFIG_SHUTTER_PORT_VIRTUAL
+typedef struct shutter_vtimer_t* shutter_port_timer_t;
+#else
+typedef esp_timer_handle_t shutter_port_timer_t;
+#endif // CONFIG_SHUTTER_PORT_VIRTUAL
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- Таймеры -------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Создать однократный таймер
+ * @brief Создать однократный таймер
+ * @param timer Указатель на переменную, в которую будет записан дескриптор таймера
+ * @param name Имя таймера (для отладки)
+ * @param cb Callback, вызываемый при срабатывании таймера
+ * @param arg Аргумент, передаваемый в callback
+ * @return Вернет true в случае успешного выполнения операции
+ * */
+bool shutterPortTimerCreate(shutter_port_timer_t* timer, const char* name, cb_shutter_port_timer_t cb, void* arg);
+
+/**
+ * Удалить таймер
+ * @brief Удалить таймер
+ * @param timer Дескриптор таймера
+ * @return Вернет true в случае успешного выполнения операции
+ * */
+bool shutterPortTimerDelete(shutter_port_timer_t timer);
+
+/**
+ * Запустить таймер однократно
+ * @brief Запустить таймер однократно
+ * @param timer Дескриптор таймера
+ * @param timeout_us Время до срабатывания в микросекундах
+ * @return Вернет true в случае успешного выполнения операции
+ * */
+bool shutterPortTimerStart(shutter_port_timer_t timer, uint64_t timeout_us);
+
+/**
+ * Остановить таймер
+ * @brief Остановить таймер
+ * @param timer Дескриптор таймера
+ * @return Вернет true в случае успешного выполнения операции
+ * */
+bool shutterPortTimerStop(shutter_port_timer_t timer);
+
+/**
+ * Проверить, запущен ли таймер
+ * @brief Проверить, запущен ли таймер
+ * @param timer Дескриптор таймера
+ * @return Вернет true, если таймер запущен и еще не сработал
+ * */
+bool shutterPortTimerIsActive(shutter_port_timer_t timer);
+
+/**
+ * Выполнить функцию позже в фоновой задаче (служебная задача таймеров FreeRTOS, а не задача esp_timer) - для медленных
+ * операций, например записи во flash. В режиме виртуального времени функция вызывается сразу
+ * @brief Выполнить функцию в фоновой задаче
+ * @param cb Функция
+ * @param arg Аргумент, передаваемый в функцию
+ * @return Вернет true, если вызов поставлен в очередь (или выполнен)
+ * */
+bool shutterPortDefer(cb_shutter_port_timer_t cb, void* arg);
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------------- Часы ---------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Монотонное время с момента запуска в микросекундах
+ * @brief Монотонное время с момента запуска в микросекундах
+ * */
+int64_t shutterPortTimeUs();
+
+/**
+ * Текущее системное (календарное) время
+ * @brief Текущее системное (календарное) время
+ * */
+time_t shutterPortTime();
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Критическая секция -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Войти в короткую критическую секцию (спин-блокировка на ESP-IDF, пустая операция в режиме виртуального времени). 
+ * Внутри секции нельзя вызывать блокирующие функции, в том числе функции таймеров
+ * @brief Войти в короткую критическую секцию
+ * */
+void shutterPortEnterCritical();
+
+/**
+ * Выйти из критической секции
+ * @brief Выйти из критической секции
+ * */
+void shutterPortExitCritical();
+
+#if CONFIG_SHUTTER_PORT_VIRTUAL
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Виртуальное время --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Сбросить виртуальные часы: монотонное время становится равным 0, календарное - wall_time. Запущенные таймеры останавливаются
+ * @brief Сбросить виртуальные часы
+ * @param wall_time Календарное время, соответствующее нулевому моменту виртуальных часов
+ * */
+void shutterVirtualTimeReset(time_t wall_time);
+
+/**
+ * Получить момент срабатывания ближайшего таймера
+ * @brief Получить момент срабатывания ближайшего таймера
+ * @return Время в микросекундах по виртуальным часам или -1, если активных таймеров нет
+ * */
+int64_t shutterVirtualTimeNext();
+
+/**
+ * Продвинуть виртуальные часы вперед, последовательно вызывая callback-и всех таймеров, срок которых наступил
+ * @brief Продвинуть виртуальные часы вперед
+ * @param delta_us Интервал в микросекундах
+ * @return Количество сработавших таймеров
+ * */
+uint32_t shutterVirtualTimeAdvance(uint64_t delta_us);
+
+#endif // CONFIG_SHUTTER_PORT_VIRTUAL
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RE_SHUTTER_PORT_H__
@@ -0,0 +1,248 @@
+/*
+   EN: Recording of shutter commands and timer events into a compact binary log and replay in virtual time
+   RU: Запись команд и событий таймера привода в компактный двоичный журнал и воспроизведение в виртуальном времени
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+#ifndef __RE_SHUTTER_RECORDER_H__
+#define __RE_SHUTTER_RECORDER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "project_config.h"
+#include "reShutter.h"
+
+#define SHUTTER_REC_MAGIC      0x4C524853   // "SHRL"
+#define SHUTTER_REC_VERSION    2
+
+#define SHUTTER_REC_CALL_CB    0x01         // Команда вызвана с call_cb = true
+#define SHUTTER_REC_PUBLISH    0x02         // Команда вызвана с publish = true
+#define SHUTTER_REC_ARG        0x04         // Дополнительный аргумент: forced для CloseFullEx(), open для limitReached()
+#define SHUTTER_REC_CALIBRATE  0x08         // В заголовке: был включен режим калибровки
+#define SHUTTER_REC_RETARGET   0x10         // В заголовке: была разрешена смена цели во время перемещения
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Типы событий журнала
+ * */
+typedef enum {
+  SHUTTER_REC_GAP = 0,            // Пауза дольше, чем помещается в поле dt_us: value - количество полных секунд
+  SHUTTER_REC_CHANGE,             // ChangeEx(steps)
+  SHUTTER_REC_MOVE_TO,            // MoveTo(step): value - значение float
+  SHUTTER_REC_OPEN_FULL,          // OpenFull()
+  SHUTTER_REC_CLOSE_FULL,         // CloseFullEx(forced)
+  SHUTTER_REC_BREAK,              // Break()
+  SHUTTER_REC_LIMIT,              // limitReached(open)
+  SHUTTER_REC_MIN_LIMIT,          // setMinLimit(value)
+  SHUTTER_REC_MAX_LIMIT,          // setMaxLimit(value)
+  SHUTTER_REC_CALIB_START,        // calibrationStart()
+  SHUTTER_REC_CALIB_STOP,         // calibrationStop()
+  SHUTTER_REC_REHOME,             // Установка в начальное положение в окне простоя
+  SHUTTER_REC_TIMER               // Срабатывание таймера привода
+} shutter_rec_type_t;
+
+/**
+ * Заголовок журнала: параметры и состояние привода в момент начала записи
+ * */
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint8_t  version;
+  int8_t   min_steps;
+  int8_t   max_steps;
+  int8_t   state;
+  uint32_t full_time;
+  uint32_t step_time;
+  float    step_time_adj;
+  uint32_t step_time_fin;
+  uint32_t travel;
+  int8_t   limit_min;
+  int8_t   limit_max;
+  uint8_t  homed;
+  uint8_t  flags;
+  uint32_t drift;
+  uint32_t rehome_threshold;
+  uint32_t dead_time;
+} shutter_rec_header_t;
+
+/**
+ * Событие журнала (12 байт)
+ * */
+typedef struct __attribute__((packed)) {
+  uint32_t dt_us;                 // Время с предыдущего события (или с начала записи) в микросекундах
+  uint8_t  type;                  // shutter_rec_type_t
+  uint8_t  flags;                 // SHUTTER_REC_CALL_CB | SHUTTER_REC_PUBLISH | SHUTTER_REC_ARG
+  int8_t   steps;                 // Количество шагов для SHUTTER_REC_CHANGE
+  uint8_t  state;                 // Состояние привода (шаг) в момент события - для сверки при воспроизведении
+  uint32_t value;
+} shutter_rec_event_t;
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- Запись --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+class rShutterRecorder {
+  public:
+    /**
+     * Журнал команд привода в динамической памяти. Журнал подключается к приводу с помощью rShutter::setRecorder()
+     * (при CONFIG_SHUTTER_RECORDER = 1), при этом в заголовок записываются параметры и текущее состояние привода.
+     * Записываются только команды, вызванные извне: вложенные вызовы (например, MoveTo() из OpenFull() или команды
+     * из очереди) воспроизводятся самим приводом
+     * @brief Журнал команд привода
+     * @param capacity Максимальное количество событий; после заполнения журнала новые события отбрасываются
+     * */
+    rShutterRecorder(uint32_t capacity);
+    ~rShutterRecorder();
+
+    /**
+     * Начать запись заново с заданным заголовком (вызывается из rShutter::setRecorder())
+     * @brief Начать запись
+     * @param header Заголовок журнала
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool begin(const shutter_rec_header_t* header);
+
+    /**
+     * Добавить событие в журнал. Можно вызывать из разных задач
+     * @brief Добавить событие в журнал
+     * @return Вернет false, если журнал заполнен или не начат
+     * */
+    bool add(shutter_rec_type_t type, uint8_t flags, int8_t steps, uint8_t state, uint32_t value);
+
+    /**
+     * Получить указатель на журнал: заголовок, за которым следуют события
+     * @brief Получить указатель на журнал
+     * */
+    const uint8_t* getData();
+
+    /**
+     * Получить размер журнала в байтах
+     * @brief Получить размер журнала в байтах
+     * */
+    size_t getSize();
+
+    /**
+     * Получить количество событий в журнале
+     * @brief Получить количество событий в журнале
+     * */
+    uint32_t getCount();
+
+    /**
+     * Получить количество событий, отброшенных из-за переполнения журнала
+     * @brief Получить количество отброшенных событий
+     * */
+    uint32_t getDropped();
+  private:
+    uint8_t*              _data = nullptr;
+    uint32_t              _capacity = 0;
+    uint32_t              _count = 0;
+    uint32_t              _dropped = 0;
+    int64_t               _last_us = 0;
+    bool                  _started = false;
+};
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------- Защита от вложенных вызовов -------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+class rShutterRecordScope {
+  public:
+    /**
+     * Область записи команды: объект создается в начале каждой записываемой функции. Области образуют стек в пределах
+     * задачи, поэтому вложенный вызов для того же привода распознается, а вызов для другого привода - нет
+     * @brief Область записи команды
+     * @param owner Привод, для которого выполняется команда
+     * */
+    rShutterRecordScope(const void* owner);
+    ~rShutterRecordScope();
+
+    /**
+     * Проверить, выполняется ли команда внутри другой команды того же привода
+     * @brief Проверить, является ли вызов вложенным
+     * */
+    bool isNested();
+  private:
+    const void* _owner = nullptr;
+    rShutterRecordScope* _prev = nullptr;
+    static thread_local rShutterRecordScope* _top;
+};
+
+#if CONFIG_SHUTTER_PORT_VIRTUAL
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Воспроизведение ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Функция обратного вызова для каждого воспроизведенного события
+ * @brief Функция обратного вызова для каждого воспроизведенного события
+ * @param shutter Модель привода; положение можно получить, например, с помощью getPositionNow()
+ * @param event Событие журнала
+ * @param time_us Время события от начала записи в микросекундах
+ * @param diverged true, если состояние модели не совпало с записанным состоянием привода
+ * @param arg Произвольный указатель, переданный в rShutterReplayer
+ * */
+typedef void (*cb_shutter_replay_t) (rShutter* shutter, const shutter_rec_event_t* event, int64_t time_us, bool diverged, void* arg);
+
+class rShutterReplayer {
+  public:
+    /**
+     * Воспроизведение журнала на модели привода (rVirtualShutter) в виртуальном времени - настолько быстро, насколько
+     * это позволяет процессор. Доступно только при CONFIG_SHUTTER_PORT_VIRTUAL = 1
+     * @brief Воспроизведение журнала
+     * @param cb_event Callback, вызываемый после каждого события
+     * @param arg Произвольный указатель, передаваемый в callback
+     * */
+    rShutterReplayer(cb_shutter_replay_t cb_event, void* arg);
+
+    /**
+     * Воспроизвести журнал
+     * @brief Воспроизвести журнал
+     * @param data Указатель на журнал (см. rShutterRecorder::getData())
+     * @param size Размер журнала в байтах
+     * @return Вернет false, если журнал поврежден
+     * */
+    bool run(const uint8_t* data, size_t size);
+
+    /**
+     * Получить количество воспроизведенных событий
+     * @brief Получить количество воспроизведенных событий
+     * */
+    uint32_t getEvents();
+
+    /**
+     * Получить количество событий, на которых состояние модели не совпало с записанным
+     * @brief Получить количество расхождений
+     * */
+    uint32_t getDivergences();
+
+    /**
+     * Получить итоговое положение модели после воспроизведения
+     * @brief Получить итоговое положение модели
+     * @return Положение в шагах (с дробной частью)
+     * */
+    float getPosition();
+  private:
+    cb_shutter_replay_t   _on_event = nullptr;
+    void*                 _on_event_arg = nullptr;
+    uint32_t              _events = 0;
+    uint32_t              _divergences = 0;
+    float                 _position = 0.0;
+
+    void execute(rShutter* shutter, const shutter_rec_event_t* event);
+};
+
+#endif // CONFIG_SHUTTER_PORT_VIRTUAL
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RE_SHUTTER_RECORDER_H__
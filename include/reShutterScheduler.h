@@ -0,0 +1,220 @@
+/*
+   EN: Calendar scheduler of shutter moves: entries of any number of drives in one min-heap serviced by a single timer
+   RU: Календарное расписание перемещений приводов: задания любого количества приводов в одной куче и один таймер
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+#ifndef __RE_SHUTTER_SCHEDULER_H__
+#define __RE_SHUTTER_SCHEDULER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "project_config.h"
+#include "reShutter.h"
+
+/**
+ * Максимальный интервал между пробуждениями расписания в секундах. Таймер отсчитывает монотонное время, а задания
+ * заданы по календарю, поэтому после синхронизации или перевода часов срок будет уточнен не позже этого интервала
+ * */
+#ifndef CONFIG_SHUTTER_SCHEDULER_MAX_SLEEP
+#define CONFIG_SHUTTER_SCHEDULER_MAX_SLEEP 3600
+#endif // CONFIG_SHUTTER_SCHEDULER_MAX_SLEEP
+
+/**
+ * Допустимое опоздание ежедневного задания в секундах: если часы были переведены вперед или устройство было занято
+ * дольше, пропущенное задание не выполняется, а переносится на следующий день
+ * */
+#ifndef CONFIG_SHUTTER_SCHEDULER_GRACE
+#define CONFIG_SHUTTER_SCHEDULER_GRACE 300
+#endif // CONFIG_SHUTTER_SCHEDULER_GRACE
+
+/**
+ * Календарное время считается установленным, если оно больше этого значения (до синхронизации часы идут с 1970 года)
+ * */
+#ifndef CONFIG_SHUTTER_SCHEDULER_TIME_VALID
+#define CONFIG_SHUTTER_SCHEDULER_TIME_VALID 1600000000
+#endif // CONFIG_SHUTTER_SCHEDULER_TIME_VALID
+
+#define SHUTTER_SCHED_EVERY_DAY  0x7F   // Все дни недели; бит 0 - воскресенье, бит 6 - суббота (как tm_wday)
+#define SHUTTER_SCHED_WORKDAYS   0x3E
+#define SHUTTER_SCHED_WEEKENDS   0x41
+#define SHUTTER_SCHED_NO_LIMIT   -1     // Ограничение не изменяется
+#define SHUTTER_SCHED_CLEAR      -2     // Ограничение снимается
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+class rShutterScheduler;
+
+/**
+ * Функция обратного вызова после выполнения задания расписания
+ * @brief Функция обратного вызова после выполнения задания расписания
+ * @param scheduler Указатель на расписание
+ * @param id Идентификатор задания
+ * @param shutter Указатель на привод
+ * @param result Результат выполнения команды привода
+ * */
+typedef void (*cb_shutter_sched_t) (rShutterScheduler *scheduler, int16_t id, rShutter *shutter, bool result);
+
+/**
+ * Вид задания
+ * */
+typedef enum {
+  SHUTTER_SCHED_ONCE = 0,         // Однократно в заданный момент календарного времени
+  SHUTTER_SCHED_DAILY             // Ежедневно в заданное время суток в выбранные дни недели
+} shutter_sched_kind_t;
+
+/**
+ * Команда, выполняемая заданием
+ * */
+typedef enum {
+  SHUTTER_SCHED_STEP = 0,         // MoveTo(value)
+  SHUTTER_SCHED_PERCENT,          // MoveToPercent(value)
+  SHUTTER_SCHED_OPEN,             // OpenFull()
+  SHUTTER_SCHED_CLOSE,            // CloseFull()
+  SHUTTER_SCHED_LIMITS            // Только изменение ограничений
+} shutter_sched_target_t;
+
+typedef struct {
+  rShutter* shutter;
+  shutter_sched_kind_t kind;
+  shutter_sched_target_t target;
+  float value;
+  time_t time;                    // SHUTTER_SCHED_ONCE: момент выполнения
+  uint16_t minutes;               // SHUTTER_SCHED_DAILY: время суток в минутах от полуночи
+  uint8_t weekdays;               // SHUTTER_SCHED_DAILY: маска дней недели
+  int8_t limit_min;               // Ограничение или SHUTTER_SCHED_NO_LIMIT / SHUTTER_SCHED_CLEAR
+  int8_t limit_max;
+  bool publish;
+  bool used;
+  time_t next;                    // Ближайший срок выполнения
+  int16_t index;                  // Позиция в куче или -1, если задание не запланировано
+} shutter_sched_item_t;
+
+class rShutterScheduler {
+  public:
+    /**
+     * Создание расписания. Все задания всех приводов хранятся в одной двоичной куче, упорядоченной по ближайшему сроку,
+     * и обслуживаются одним таймером, который просыпается только к ближайшему сроку (но не реже, чем раз в
+     * CONFIG_SHUTTER_SCHEDULER_MAX_SLEEP секунд)
+     * @brief Создание расписания
+     * @param capacity Максимальное количество заданий
+     * @param cb_done Callback, вызываемый после выполнения каждого задания (может быть nullptr)
+     * */
+    rShutterScheduler(uint16_t capacity, cb_shutter_sched_t cb_done);
+
+    /**
+     * Уничтожение расписания
+     * @brief Уничтожение расписания
+     * */
+    ~rShutterScheduler();
+
+    /**
+     * Добавить однократное задание. Выполненное задание удаляется из расписания
+     * @brief Добавить однократное задание
+     * @param shutter Указатель на привод
+     * @param time Момент выполнения (календарное время)
+     * @param target Команда
+     * @param value Положение в шагах или процентах (для SHUTTER_SCHED_STEP и SHUTTER_SCHED_PERCENT)
+     * @param publish Опубликовать состояние привода после выполнения
+     * @return Идентификатор задания или -1, если задание не добавлено
+     * */
+    int16_t addOnce(rShutter* shutter, time_t time, shutter_sched_target_t target, float value, bool publish);
+
+    /**
+     * Добавить ежедневное задание
+     * @brief Добавить ежедневное задание
+     * @param shutter Указатель на привод
+     * @param hour Час
+     * @param minute Минута
+     * @param weekdays Маска дней недели (SHUTTER_SCHED_EVERY_DAY, SHUTTER_SCHED_WORKDAYS, ...)
+     * @param target Команда
+     * @param value Положение в шагах или процентах (для SHUTTER_SCHED_STEP и SHUTTER_SCHED_PERCENT)
+     * @param publish Опубликовать состояние привода после выполнения
+     * @return Идентификатор задания или -1, если задание не добавлено
+     * */
+    int16_t addDaily(rShutter* shutter, uint8_t hour, uint8_t minute, uint8_t weekdays, shutter_sched_target_t target, float value, bool publish);
+
+    /**
+     * Задать ограничения, которые будут установлены перед выполнением команды задания
+     * @brief Задать ограничения для задания
+     * @param id Идентификатор задания
+     * @param limit_min Минимальное ограничение, SHUTTER_SCHED_NO_LIMIT или SHUTTER_SCHED_CLEAR
+     * @param limit_max Максимальное ограничение, SHUTTER_SCHED_NO_LIMIT или SHUTTER_SCHED_CLEAR
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool setLimits(int16_t id, int8_t limit_min, int8_t limit_max);
+
+    /**
+     * Удалить задание
+     * @brief Удалить задание
+     * @param id Идентификатор задания
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool remove(int16_t id);
+
+    /**
+     * Удалить все задания привода (например, перед удалением самого привода)
+     * @brief Удалить все задания привода
+     * @param shutter Указатель на привод
+     * @return Количество удаленных заданий
+     * */
+    uint16_t removeAll(rShutter* shutter);
+
+    /**
+     * Пересчитать сроки всех заданий, например после синхронизации времени или смены часового пояса
+     * @brief Пересчитать сроки всех заданий
+     * */
+    void resync();
+
+    /**
+     * Получить количество заданий в расписании
+     * @brief Получить количество заданий
+     * */
+    uint16_t getCount();
+
+    /**
+     * Получить ближайший срок выполнения
+     * @brief Получить ближайший срок выполнения
+     * @return Календарное время или 0, если запланированных заданий нет
+     * */
+    time_t getNext();
+
+    // -------------------------------------------------------------------------------------------------------------------
+    // Обработка таймера расписания !!! Не вызывайте напрямую - эта функция только для callback-а
+    // -------------------------------------------------------------------------------------------------------------------
+    void DoTimer();
+  protected:
+    shutter_sched_item_t*   _items = nullptr;
+    uint16_t*               _heap = nullptr;
+    uint16_t                _capacity = 0;
+    uint16_t                _count = 0;
+    uint16_t                _heap_count = 0;
+    shutter_timer_handle_t  _timer = nullptr;
+    cb_shutter_sched_t      _on_done = nullptr;
+
+    int16_t add(rShutter* shutter, shutter_sched_kind_t kind, shutter_sched_target_t target, float value, bool publish);
+    bool execute(shutter_sched_item_t* item);
+    time_t calcNext(const shutter_sched_item_t* item, time_t now);
+    void schedule(shutter_sched_item_t* item, time_t next);
+    void reschedule(int16_t id, time_t now);
+    void rearm();
+
+    void heapSwap(uint16_t a, uint16_t b);
+    void heapUp(uint16_t i);
+    void heapDown(uint16_t i);
+    void heapPush(shutter_sched_item_t* item);
+    void heapRemove(uint16_t i);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RE_SHUTTER_SCHEDULER_H__
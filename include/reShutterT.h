@@ -0,0 +1,438 @@
+/*
+   EN: Compile-time specialized shutter: pins, steps and timings are known at build time
+   RU: Привод, полностью настраиваемый при компиляции: выводы, количество шагов и временные параметры известны заранее
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+#ifndef __RE_SHUTTER_T_H__
+#define __RE_SHUTTER_T_H__
+
+#if !defined(__cplusplus) || (__cplusplus < 201402L)
+#error "reShutterT.h requires C++14 or later"
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "project_config.h"
+#include "reShutterPort.h"
+#include "reShutterTimers.h"
+#if defined(ESP_PLATFORM)
+#include <driver/gpio.h>
+#endif // ESP_PLATFORM
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Конфигурация ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Базовая структура конфигурации. Конфигурация конкретного привода наследуется от неё и задает параметры в виде
+ * static constexpr членов с теми же именами, что и параметры конструктора rShutter:
+ *
+ * struct WindowConfig: rShutterConfig {
+ *   static constexpr uint8_t  pin_open = 16;
+ *   static constexpr bool     level_open = true;
+ *   static constexpr uint8_t  pin_close = 17;
+ *   static constexpr bool     level_close = true;
+ *   static constexpr int8_t   min_steps = 0;
+ *   static constexpr int8_t   max_steps = 5;
+ *   static constexpr uint32_t full_time = 60000;
+ *   static constexpr uint32_t step_time = 10000;
+ * };
+ *
+ * Функции обратного вызова (hooks) также задаются в конфигурации как статические функции. По умолчанию они пустые и
+ * полностью исчезают при компиляции, в отличие от проверок указателей на callback-и в rShutter
+ * */
+struct rShutterConfig {
+  static constexpr float    step_time_adj = 1.0f;
+  static constexpr uint32_t step_time_fin = 0;
+
+  // Вызывается перед изменением состояния GPIO
+  template <class S> static inline void gpioBefore(S*, uint8_t) {};
+  // Вызывается после изменения состояния GPIO
+  template <class S> static inline void gpioAfter(S*, uint8_t) {};
+  // Вызывается при включении и выключении привода
+  template <class S> static inline void timer(S*, uint8_t, bool) {};
+  // Вызывается при изменении состояния привода
+  template <class S> static inline void changed(S*, uint8_t, uint8_t, uint8_t) {};
+};
+
+/**
+ * Таблица накопленного времени, вычисляемая при компиляции: value[i] - время перемещения из min_steps в min_steps + i.
+ * Длительность каждого следующего шага увеличивается в step_time_adj раз последовательным умножением во float - так же,
+ * как это делает rShutter::calcTimeTable(), поэтому длительности перемещений обоих классов совпадают
+ * */
+template <class Config>
+struct rShutterTimeTable {
+  static constexpr int16_t count = (int16_t)Config::max_steps - (int16_t)Config::min_steps + 1;
+  uint32_t value[count];
+  uint64_t total;
+
+  constexpr rShutterTimeTable(): value(), total(0)
+  {
+    float step = (float)Config::step_time;
+    uint64_t sum = 0;
+    value[0] = 0;
+    for (int16_t i = 1; i < count; i++) {
+      if (i > 1) {
+        step = step * Config::step_time_adj;
+      };
+      sum = sum + (uint64_t)(uint32_t)step;
+      value[i] = (uint32_t)sum;
+    };
+    total = sum;
+  }
+};
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Политики GPIO --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if defined(ESP_PLATFORM)
+
+/**
+ * Встроенные GPIO микроконтроллера. Класс не содержит данных и не увеличивает размер экземпляра привода
+ * */
+class rShutterGpioEsp {
+  public:
+    inline bool gpioInit(uint8_t pin, bool physical_level)
+    {
+      gpio_reset_pin((gpio_num_t)pin);
+      return (gpio_set_level((gpio_num_t)pin, (uint32_t)physical_level) == ESP_OK)
+          && (gpio_set_direction((gpio_num_t)pin, GPIO_MODE_OUTPUT) == ESP_OK);
+    };
+
+    inline bool gpioSetLevel(uint8_t pin, bool physical_level)
+    {
+      return gpio_set_level((gpio_num_t)pin, (uint32_t)physical_level) == ESP_OK;
+    };
+};
+
+#endif // ESP_PLATFORM
+
+/**
+ * Виртуальные GPIO (номера 0..63) - для отладки, моделирования и нагрузочных тестов на ПК
+ * */
+class rShutterGpioVirtual {
+  public:
+    inline bool gpioInit(uint8_t pin, bool physical_level)
+    {
+      return gpioSetLevel(pin, physical_level);
+    };
+
+    inline bool gpioSetLevel(uint8_t pin, bool physical_level)
+    {
+      if (pin >= 64) return false;
+      if (physical_level) {
+        _levels |= (1ULL << pin);
+      } else {
+        _levels &= ~(1ULL << pin);
+      };
+      return true;
+    };
+
+    /**
+     * Получить текущий физический уровень виртуального GPIO
+     * @brief Получить текущий физический уровень виртуального GPIO
+     * @param pin Номер вывода
+     * @return Физический уровень на выводе
+     * */
+    inline bool gpioGetLevel(uint8_t pin)
+    {
+      return (pin < 64) && ((_levels >> pin) & 1);
+    };
+  private:
+    uint64_t _levels = 0;
+};
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- rShutterT -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Привод с параметрами, заданными при компиляции. В отличие от rShutter здесь нет виртуальных функций, таблица времени
+ * шагов хранится во flash, а экземпляр занимает в RAM несколько десятков байт. Очереди команд и публикации на MQTT нет:
+ * команды, поступившие во время работы привода, отклоняются
+ * @param Config Структура конфигурации, унаследованная от rShutterConfig
+ * @param Gpio Политика управления выводами (rShutterGpioEsp, rShutterGpioVirtual или собственная)
+ * */
+template <class Config, class Gpio>
+class rShutterT: public Gpio {
+  static_assert(Config::min_steps >= 0, "min_steps must not be negative");
+  static_assert(Config::max_steps > Config::min_steps, "max_steps must be greater than min_steps");
+  static_assert(Config::step_time > 0, "step_time must be greater than zero");
+  static_assert(Config::step_time_adj > 0.0f, "step_time_adj must be greater than zero");
+  static_assert(Config::pin_open != Config::pin_close, "pin_open and pin_close must be different");
+
+  public:
+    typedef rShutterTimeTable<Config> table_t;
+    static constexpr table_t _table = table_t();
+
+    static_assert(_table.total <= UINT32_MAX, "Total step time does not fit into 32 bits");
+    static_assert(Config::full_time >= _table.total, "full_time is shorter than the sum of all steps");
+
+    rShutterT() {};
+
+    ~rShutterT()
+    {
+      if (_timer != nullptr) {
+        shutterTimerDelete(_timer);
+        _timer = nullptr;
+      };
+      stopAll();
+    };
+
+    /**
+     * Инициализация GPIO и таймера. Привод не перемещается, для установки в начальное положение вызовите CloseFull(true)
+     * @brief Инициализация GPIO и таймера
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool Init()
+    {
+      _state = Config::min_steps;
+      _active = 0;
+      _homed = false;
+      _move_active = false;
+      if (!this->gpioInit(Config::pin_open, !Config::level_open) || !this->gpioInit(Config::pin_close, !Config::level_close)) {
+        return false;
+      };
+      if (_timer == nullptr) {
+        return shutterTimerCreate(&_timer, "shutter", timerEnd, this);
+      };
+      return true;
+    };
+
+    /**
+     * Время перемещения между двумя положениями, вычисляется по таблице без циклов
+     * @brief Время перемещения между двумя положениями
+     * @param from Исходное положение в шагах
+     * @param to Конечное положение в шагах
+     * @return Время в миллисекундах
+     * */
+    static constexpr uint32_t calcMoveTime(int8_t from, int8_t to)
+    {
+      from = from < Config::min_steps ? Config::min_steps : (from > Config::max_steps ? Config::max_steps : from);
+      to = to < Config::min_steps ? Config::min_steps : (to > Config::max_steps ? Config::max_steps : to);
+      return to > from ? _table.value[to - Config::min_steps] - _table.value[from - Config::min_steps]
+        : (to < from ? _table.value[from - Config::min_steps] - _table.value[to - Config::min_steps]
+          + (to == Config::min_steps ? Config::step_time_fin : 0) : 0);
+    };
+
+    /**
+     * Изменить состояние привода на заданное количество шагов
+     * @brief Изменить состояние привода на заданное количество шагов
+     * @param steps Количество шагов: положительное значение - открыть, отрицательное - закрыть
+     * @return Вернет true, если привод был запущен
+     * */
+    bool Change(int8_t steps)
+    {
+      int16_t target = (int16_t)_state + steps;
+      if (target < Config::min_steps) target = Config::min_steps;
+      if (target > Config::max_steps) target = Config::max_steps;
+      if ((target == _state) || isBusy()) {
+        return false;
+      };
+      uint32_t duration = calcMoveTime(_state, (int8_t)target);
+      if (!activate(target > _state, duration)) {
+        return false;
+      };
+      moveStart((int8_t)target, duration, false);
+      uint8_t from = _state;
+      _state = (uint8_t)target;
+      Config::changed(this, from, _state, (uint8_t)Config::max_steps);
+      return true;
+    };
+
+    /**
+     * Открыть привод полностью
+     * @brief Открыть привод полностью
+     * @return Вернет true, если привод был запущен
+     * */
+    bool OpenFull()
+    {
+      return Change(Config::max_steps - (int8_t)_state);
+    };
+
+    /**
+     * Закрыть привод полностью на время full_time (до срабатывания встроенных концевых выключателей)
+     * @brief Закрыть привод полностью
+     * @param forced Закрыть, даже если привод уже находится в положении min_steps
+     * @return Вернет true, если привод был запущен
+     * */
+    bool CloseFull(bool forced)
+    {
+      if (!forced && (_state <= Config::min_steps)) {
+        return false;
+      };
+      Break();
+      if (!activate(false, Config::full_time)) {
+        return false;
+      };
+      moveStart(Config::min_steps, Config::full_time, true);
+      uint8_t from = _state;
+      _state = Config::min_steps;
+      Config::changed(this, from, _state, (uint8_t)Config::max_steps);
+      return true;
+    };
+
+    /**
+     * Прервать перемещение с пересчетом фактически достигнутого положения
+     * @brief Прервать перемещение
+     * @return Вернет true в случае успешного выполнения операции
+     * */
+    bool Break()
+    {
+      if (!isBusy()) {
+        return true;
+      };
+      float position = getPositionNow();
+      shutterTimerStop(_timer);
+      bool ret = stopAll();
+      if (_move_active) {
+        _move_active = false;
+        uint8_t reached = (uint8_t)(position + 0.5f);
+        if (reached != _state) {
+          uint8_t target = _state;
+          _state = reached;
+          Config::changed(this, target, _state, (uint8_t)Config::max_steps);
+        };
+      };
+      return ret;
+    };
+
+    /**
+     * Текущее положение привода с дробной частью с учетом времени, прошедшего с начала перемещения
+     * @brief Текущее положение привода с дробной частью
+     * */
+    float getPositionNow()
+    {
+      if (!_move_active) {
+        return _state;
+      };
+      int64_t elapsed = (shutterPortTimeUs() - _move_start) / 1000;
+      if (elapsed >= _move_duration) {
+        return _move_to;
+      };
+      uint32_t base = _table.value[_move_from - Config::min_steps];
+      float ret;
+      if (_move_to > _move_from) {
+        ret = calcPosition(base + (uint32_t)elapsed);
+        if (ret > _move_to) ret = _move_to;
+      } else {
+        ret = (uint32_t)elapsed < base ? calcPosition(base - (uint32_t)elapsed) : (float)Config::min_steps;
+        if (ret < _move_to) ret = _move_to;
+      };
+      return ret;
+    };
+
+    // Текущее (целевое) состояние привода
+    inline uint8_t getState() { return _state; };
+    inline float getPercent() { return (float)_state / Config::max_steps * 100.0; };
+    inline bool isFullOpen() { return _state >= Config::max_steps; };
+    inline bool isFullClose() { return _state <= Config::min_steps; };
+    inline bool isBusy() { return (_timer != nullptr) && shutterTimerIsActive(_timer); };
+    // Положение достоверно известно: полное закрытие на время full_time завершено без прерывания
+    inline bool isHomed() { return _homed; };
+
+    static constexpr uint8_t getMaxSteps() { return Config::max_steps; };
+    static constexpr uint32_t getFullTime() { return Config::full_time; };
+  private:
+    shutter_timer_handle_t _timer = nullptr;
+    int64_t  _move_start = 0;
+    uint32_t _move_duration = 0;
+    uint8_t  _state = Config::min_steps;
+    int8_t   _move_from = 0;
+    int8_t   _move_to = 0;
+    uint8_t  _active = 0;                     // 0 - привод выключен, иначе номер активного вывода + 1
+    bool     _move_active = false;
+    bool     _move_homing = false;
+    bool     _homed = false;
+
+    static void timerEnd(void* arg)
+    {
+      rShutterT* shutter = (rShutterT*)arg;
+      if (shutter->_move_active && shutter->_move_homing) {
+        shutter->_homed = true;
+      };
+      shutter->_move_active = false;
+      shutter->stopAll();
+    };
+
+    inline void moveStart(int8_t target, uint32_t duration, bool homing)
+    {
+      _move_from = _state;
+      _move_to = target;
+      _move_start = shutterPortTimeUs();
+      _move_duration = duration;
+      _move_homing = homing;
+      _move_active = true;
+    };
+
+    // Обратное преобразование по таблице: время перемещения из min_steps -> положение в шагах (с дробной частью)
+    static float calcPosition(uint32_t travel)
+    {
+      const int16_t count = table_t::count - 1;
+      if (travel >= _table.value[count]) return Config::max_steps;
+      int16_t lo = 0;
+      int16_t hi = count;
+      while (hi - lo > 1) {
+        int16_t mid = (lo + hi) / 2;
+        if (_table.value[mid] <= travel) {
+          lo = mid;
+        } else {
+          hi = mid;
+        };
+      };
+      uint32_t step = _table.value[hi] - _table.value[lo];
+      float frac = step > 0 ? (float)(travel - _table.value[lo]) / step : 0.0f;
+      return (float)(Config::min_steps + lo) + frac;
+    };
+
+    // Включение привода: сначала таймер, затем вывод - как в rShutter::timerActivate()
+    inline bool activate(bool open, uint32_t duration_ms)
+    {
+      const uint8_t pin = open ? Config::pin_open : Config::pin_close;
+      const bool level = open ? Config::level_open : Config::level_close;
+      if ((_timer == nullptr) || !shutterTimerStart(_timer, (uint64_t)duration_ms * 1000)) {
+        return false;
+      };
+      _active = pin + 1;
+      Config::timer(this, pin, true);
+      Config::gpioBefore(this, pin);
+      bool ret = this->gpioSetLevel(pin, level);
+      Config::gpioAfter(this, pin);
+      if (!ret) {
+        shutterTimerStop(_timer);
+        stopAll();
+      };
+      return ret;
+    };
+
+    // Отключение активного вывода (активность определяется по состоянию привода, а не по физическому уровню)
+    inline bool stopAll()
+    {
+      if (_active == 0) {
+        return true;
+      };
+      const uint8_t pin = _active - 1;
+      const bool level = (pin == Config::pin_open) ? !Config::level_open : !Config::level_close;
+      Config::gpioBefore(this, pin);
+      bool ret = this->gpioSetLevel(pin, level);
+      Config::gpioAfter(this, pin);
+      if (ret) {
+        _active = 0;
+        Config::timer(this, pin, false);
+      };
+      return ret;
+    };
+};
+
+// Определение статической таблицы (требуется до C++17 при ODR-использовании)
+template <class Config, class Gpio>
+constexpr typename rShutterT<Config, Gpio>::table_t rShutterT<Config, Gpio>::_table;
+
+#endif // __RE_SHUTTER_T_H__
@@ -0,0 +1,123 @@
+/*
+   EN: Timer service for reShutter: one timer per client or one shared hardware timer with a min-heap of deadlines
+   RU: Сервис таймеров для reShutter: отдельный таймер на каждого клиента или один общий аппаратный таймер с кучей сроков
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+#ifndef __RE_SHUTTER_TIMERS_H__
+#define __RE_SHUTTER_TIMERS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "project_config.h"
+#include "reShutterPort.h"
+
+/**
+ * Использовать один общий таймер для всех приводов вместо отдельного esp_timer на каждый экземпляр.
+ * Сроки хранятся в двоичной куче (запуск и остановка за O(log n)), все таймеры, срок которых наступил в пределах
+ * одного тика, обрабатываются одним пакетом
+ * */
+#ifndef CONFIG_SHUTTER_SHARED_TIMER
+#define CONFIG_SHUTTER_SHARED_TIMER 0
+#endif // CONFIG_SHUTTER_SHARED_TIMER
+
+/**
+ * Максимальное количество таймеров в общем сервисе. Каждый привод использует до трех таймеров: таймер перемещения,
+ * таймер публикаций (создается при первой неудачной публикации или при заданном интервале публикаций) и таймер
+ * автоматической установки в начальное положение; каждая группа и каждое расписание используют еще по одному.
+ * Значение по умолчанию рассчитано на 32 привода со всеми функциями и 32 группы или расписания
+ * */
+#ifndef CONFIG_SHUTTER_SHARED_TIMER_SLOTS
+#define CONFIG_SHUTTER_SHARED_TIMER_SLOTS 128
+#endif // CONFIG_SHUTTER_SHARED_TIMER_SLOTS
+
+/**
+ * Тик общего таймера в микросекундах: сроки, отстоящие друг от друга меньше чем на тик, обрабатываются вместе
+ * */
+#ifndef CONFIG_SHUTTER_SHARED_TIMER_TICK
+#define CONFIG_SHUTTER_SHARED_TIMER_TICK 1000
+#endif // CONFIG_SHUTTER_SHARED_TIMER_TICK
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if CONFIG_SHUTTER_SHARED_TIMER
+typedef struct shutter_timer_t* shutter_timer_handle_t;
+#else
+typedef shutter_port_timer_t shutter_timer_handle_t;
+#endif // CONFIG_SHUTTER_SHARED_TIMER
+
+/**
+ * Создать однократный таймер
+ * @brief Создать однократный таймер
+ * @param timer Указатель на переменную, в которую будет записан дескриптор таймера
+ * @param name Имя таймера (для отладки)
+ * @param cb Callback, вызываемый при срабатывании таймера
+ * @param arg Аргумент, передаваемый в callback
+ * @return Вернет true в случае успешного выполнения операции
+ * */
+bool shutterTimerCreate(shutter_timer_handle_t* timer, const char* name, cb_shutter_port_timer_t cb, void* arg);
+
+/**
+ * Удалить таймер (предварительно остановив его)
+ * @brief Удалить таймер
+ * @param timer Дескриптор таймера
+ * @return Вернет true в случае успешного выполнения операции
+ * */
+bool shutterTimerDelete(shutter_timer_handle_t timer);
+
+/**
+ * Запустить таймер однократно
+ * @brief Запустить таймер однократно
+ * @param timer Дескриптор таймера
+ * @param timeout_us Время до срабатывания в микросекундах
+ * @return Вернет true в случае успешного выполнения операции
+ * */
+bool shutterTimerStart(shutter_timer_handle_t timer, uint64_t timeout_us);
+
+/**
+ * Остановить таймер
+ * @brief Остановить таймер
+ * @param timer Дескриптор таймера
+ * @return Вернет true в случае успешного выполнения операции
+ * */
+bool shutterTimerStop(shutter_timer_handle_t timer);
+
+/**
+ * Проверить, запущен ли таймер
+ * @brief Проверить, запущен ли таймер
+ * @param timer Дескриптор таймера
+ * @return Вернет true, если таймер запущен и еще не сработал
+ * */
+bool shutterTimerIsActive(shutter_timer_handle_t timer);
+
+/**
+ * Задать функции, вызываемые до и после пакетной обработки сработавших таймеров (только для общего таймера). 
+ * Например, rIoExpPort::BeginAll() и rIoExpPort::EndAll() позволяют записать изменения всех выходов расширителей, 
+ * сделанные при одновременной остановке нескольких приводов, одной транзакцией на каждый расширитель
+ * @brief Задать функции, вызываемые до и после пакетной обработки сработавших таймеров
+ * @param cb_begin Callback, вызываемый перед обработкой пакета
+ * @param cb_end Callback, вызываемый после обработки пакета
+ * @param arg Аргумент, передаваемый в callback-и
+ * */
+void shutterTimerSetBatchHooks(cb_shutter_port_timer_t cb_begin, cb_shutter_port_timer_t cb_end, void* arg);
+
+/**
+ * Получить количество неудачных попыток создания таймеров (например, из-за нехватки CONFIG_SHUTTER_SHARED_TIMER_SLOTS).
+ * Ненулевое значение означает, что часть функций (повтор публикаций, автоматическая установка в начальное положение,
+ * интервал между запусками приводов группы) не работает
+ * @brief Получить количество неудачных попыток создания таймеров
+ * @return Количество неудачных попыток с момента запуска
+ * */
+uint32_t shutterTimerGetErrors();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RE_SHUTTER_TIMERS_H__
@@ -1,10 +1,14 @@
 #include "reShutter.h"
+#include "reShutterJournal.h"
+#include "reShutterRecorder.h"
 #include <string.h>
+#include "rLog.h"
+#include "rStrings.h"
+#if defined(ESP_PLATFORM)
 #include "reEvents.h"
 #include "reMqtt.h"
 #include "reEsp32.h"
-#include "rLog.h"
-#include "rStrings.h"
+#endif // ESP_PLATFORM
 
 #if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
 static const char* logTAG = "SHTR";
@@ -12,6 +16,25 @@ static const char* logTAG = "SHTR";
 
 #define ERR_SHUTTER_CHECK(err, str) if (err != ESP_OK) { rlog_e(logTAG, "%s: #%d %s", str, err, esp_err_to_name(err)); return false; };
 #define ERR_GPIO_SET_LEVEL "Failed to change GPIO level"
+
+#if CONFIG_SHUTTER_HISTOGRAMS
+  #define SHUTTER_HIST_BEGIN(var) int64_t var = shutterPortTimeUs()
+  #define SHUTTER_HIST_END(hist, var) histAdd(hist, var)
+#else
+  #define SHUTTER_HIST_BEGIN(var)
+  #define SHUTTER_HIST_END(hist, var)
+#endif // CONFIG_SHUTTER_HISTOGRAMS
+
+// Запись команды в журнал: вложенные вызовы для того же привода не записываются
+#if CONFIG_SHUTTER_RECORDER
+  #define SHUTTER_RECORD(type, flags, steps, value) \
+    rShutterRecordScope _rec_scope(this); \
+    if (_recorder && !_rec_scope.isNested()) _recorder->add(type, flags, steps, (uint8_t)_state, value)
+#else
+  #define SHUTTER_RECORD(type, flags, steps, value)
+#endif // CONFIG_SHUTTER_RECORDER
+#define SHUTTER_REC_FLAGS(call_cb, publish, arg) \
+  (((call_cb) ? SHUTTER_REC_CALL_CB : 0) | ((publish) ? SHUTTER_REC_PUBLISH : 0) | ((arg) ? SHUTTER_REC_ARG : 0))
 #define ERR_GPIO_SET_MODE "Failed to set GPIO mode"
 
 // -----------------------------------------------------------------------------------------------------------------------
@@ -40,21 +63,74 @@ rShutter::rShutter(uint8_t pin_open, bool level_open, uint8_t pin_close, bool le
   _on_timer = cb_timer;
   _on_changed = cb_state_changed;
   _mqtt_publish = cb_mqtt_publish;
+  _mqtt_publish_bin = nullptr;
+  _mqtt_format = SHUTTER_FORMAT_JSON;
+  memset(&_mqtt_published, 0, sizeof(shutter_published_t));
+  _mqtt_cmd_hash = 0;
+  _on_idle = nullptr;
+  _on_idle_arg = nullptr;
 
   _state = 0;
+  _travel = 0;
   _last_changed = 0;
   _last_open = 0;
   _last_close = 0;
   _last_max_state = 0;
   _mqtt_topic = nullptr;
   _timer = nullptr;
+  _time_table = nullptr;
+  _publish_timer = nullptr;
+  _publish_interval = CONFIG_SHUTTER_PUBLISH_INTERVAL;
+  _publish_last = 0;
+  _publish_dirty = false;
+  _queue_head = 0;
+  _queue_count = 0;
+  _calib = nullptr;
+  _calib_head = 0;
+  _calib_count = 0;
+  _drift = 0;
+  _drift_dir = 0;
+  _rehome_threshold = 0;
+  _rehome_begin = 0;
+  _rehome_end = 0;
+  _rehome_timer = nullptr;
+  _retarget = false;
+  _dead_time = CONFIG_SHUTTER_REVERSE_DEAD_TIME;
+  _journal = nullptr;
+  _recorder = nullptr;
+  for (uint8_t i = 0; i < SHUTTER_STAT_MAX; i++) {
+    _stats[i].store(0);
+  };
+  _stat_on = -1;
+  _stat_dir = 0;
+  resetHistograms();
+  memset(&_time_str_changed, 0, sizeof(shutter_timestr_t));
+  memset(&_time_str_open, 0, sizeof(shutter_timestr_t));
+  memset(&_time_str_close, 0, sizeof(shutter_timestr_t));
+  memset(&_snap, 0, sizeof(shutter_snapshot_t));
+
+  calcTimeTable();
 }
 
 rShutter::~rShutter()
 {
   timerFree();
+  if (_rehome_timer != nullptr) {
+    shutterTimerDelete(_rehome_timer);
+    _rehome_timer = nullptr;
+  };
+  if (_publish_timer != nullptr) {
+    shutterTimerDelete(_publish_timer);
+    _publish_timer = nullptr;
+  };
   if (_mqtt_topic) free(_mqtt_topic);
   _mqtt_topic = nullptr;
+  if (_time_table) free(_time_table);
+  _time_table = nullptr;
+  if (_time_spare) free(_time_spare);
+  _time_spare = nullptr;
+  _recorder = nullptr;
+  calibrationStop();
 }
 
 // -----------------------------------------------------------------------------------------------------------------------
@@ -69,33 +145,87 @@ bool rShutter::Init()
   _last_max_state = 0;
   _pin_open_state = 0;
   _pin_close_state = 0;
+  _homed = false;
+  _drift = 0;
+  _drift_dir = 0;
+  if ((_time_table == nullptr) && !calcTimeTable()) {
+    rlog_e(logTAG, "Failed to allocate step time table");
+    return false;
+  };
+  _travel = calcTravel(_state);
+  _motion.store(SHUTTER_MOTION_IDLE);
+  journalRestore();
+  snapshotUpdate();
   return gpioInit() && timerCreate() && StopAll();
 }
 
 bool rShutter::gpioSetLevelPriv(uint8_t pin, bool physical_level)
 {
+  // Активность выхода определяется по уровню активации вывода, а не по физическому уровню
+  bool active = (pin == _pin_open) ? (physical_level == _level_open) : (physical_level == _level_close);
+
   // При активации привода (запуске таймера)
-  if (physical_level) {
+  if (active) {
     if (pin == _pin_open) {
       _pin_open_state = true;
     } else if (pin == _pin_close) {
       _pin_close_state = true;
     };
-    if (_on_timer) _on_timer(this, pin, true);
+    if (_on_timer) {
+      SHUTTER_HIST_BEGIN(cb_begin);
+      _on_timer(this, pin, true);
+      SHUTTER_HIST_END(SHUTTER_HIST_CALLBACK, cb_begin);
+    };
   };
 
-  if (_on_before) _on_before(this, pin);
+  if (_on_before) {
+    SHUTTER_HIST_BEGIN(cb_begin);
+    _on_before(this, pin);
+    SHUTTER_HIST_END(SHUTTER_HIST_CALLBACK, cb_begin);
+  };
+  SHUTTER_HIST_BEGIN(gpio_begin);
   bool ret = gpioSetLevel(pin, physical_level);
-  if (_on_after) _on_after(this, pin);
+  SHUTTER_HIST_END(SHUTTER_HIST_GPIO, gpio_begin);
+  if (_on_after) {
+    SHUTTER_HIST_BEGIN(cb_begin);
+    _on_after(this, pin);
+    SHUTTER_HIST_END(SHUTTER_HIST_CALLBACK, cb_begin);
+  };
+  #if CONFIG_SHUTTER_HISTOGRAMS
+    if (ret && active && (_hist_command >= 0)) {
+      histAdd(SHUTTER_HIST_COMMAND, _hist_command);
+      _hist_command = -1;
+    };
+  #endif // CONFIG_SHUTTER_HISTOGRAMS
   
+  // Статистика: время работы двигателя отсчитывается от фактического включения выхода
+  if (!ret) {
+    statInc(SHUTTER_STAT_GPIO_ERRORS);
+  } else if (active) {
+    int8_t dir = (pin == _pin_open) ? 1 : -1;
+    statInc(SHUTTER_STAT_MOVES);
+    if ((_stat_dir != 0) && (_stat_dir != dir)) {
+      statInc(SHUTTER_STAT_REVERSALS);
+    };
+    _stat_dir = dir;
+    _stat_on = shutterPortTimeUs();
+  } else if (_stat_on >= 0) {
+    statInc(SHUTTER_STAT_MOTOR_MS, (uint32_t)((shutterPortTimeUs() - _stat_on) / 1000));
+    _stat_on = -1;
+  };
+
   // При дактивации привода (окончании таймера)
-  if (ret && !physical_level) {
+  if (ret && !active) {
     if (pin == _pin_open) {
       _pin_open_state = false;
     } else if (pin == _pin_close) {
       _pin_close_state = false;
     };
-    if (_on_timer) _on_timer(this, pin, false);
+    if (_on_timer) {
+      SHUTTER_HIST_BEGIN(cb_begin);
+      _on_timer(this, pin, false);
+      SHUTTER_HIST_END(SHUTTER_HIST_CALLBACK, cb_begin);
+    };
   };
   return ret;
 }
@@ -104,12 +234,24 @@ bool rShutter::gpioSetLevelPriv(uint8_t pin, bool physical_level)
 bool rShutter::StopAll()
 {
   bool ret = true;
+  // В пакете выходы только отмечаются в теневом регистре, а запись на шину происходит в gpioBatchEnd(), поэтому
+  // состояние выходов запоминается, чтобы вернуть его, если запись не удалась и выходы остались включенными
+  uint8_t open_state = _pin_open_state;
+  uint8_t close_state = _pin_close_state;
+  gpioBatchBegin();
   if (_pin_open_state) {
     ret = gpioSetLevelPriv(_pin_open, !_level_open);
   };
   if (ret && _pin_close_state) {
     ret = gpioSetLevelPriv(_pin_close, !_level_close);
   };
+  if (!gpioBatchEnd()) {
+    rlog_e(logTAG, ERR_GPIO_SET_LEVEL);
+    statInc(SHUTTER_STAT_GPIO_ERRORS);
+    _pin_open_state = open_state;
+    _pin_close_state = close_state;
+    ret = false;
+  };
   return ret;
 }
 
@@ -124,26 +266,133 @@ uint8_t rShutter::getMaxSteps()
   return _max_steps;
 }
 
+int8_t rShutter::getMinSteps()
+{
+  return _min_steps;
+}
+
+uint32_t rShutter::getFullTime()
+{
+  return _full_time;
+}
+
+uint32_t rShutter::getStepTime()
+{
+  return _step_time;
+}
+
+float rShutter::getStepTimeAdj()
+{
+  return _step_time_adj;
+}
+
+bool rShutter::isHomed()
+{
+  return _homed;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Журнал положения --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+void rShutter::setJournal(rShutterJournal* journal)
+{
+  _journal = journal;
+}
+
+bool rShutter::setRecorder(rShutterRecorder* recorder)
+{
+  #if CONFIG_SHUTTER_RECORDER
+    if (recorder) {
+      shutter_rec_header_t header;
+      memset(&header, 0, sizeof(shutter_rec_header_t));
+      header.magic = SHUTTER_REC_MAGIC;
+      header.version = SHUTTER_REC_VERSION;
+      header.min_steps = _min_steps;
+      header.max_steps = _max_steps;
+      // Запись может начаться во время перемещения - сохраняется фактическое положение
+      float position = calcPositionNow();
+      header.state = (int8_t)(position + (position >= 0 ? 0.5 : -0.5));
+      header.full_time = _full_time;
+      header.step_time = _step_time;
+      header.step_time_adj = _step_time_adj;
+      header.step_time_fin = _step_time_fin;
+      header.travel = calcTravel(position);
+      header.limit_min = _limit_min;
+      header.limit_max = _limit_max;
+      header.homed = _homed;
+      header.flags = (_calib != nullptr ? SHUTTER_REC_CALIBRATE : 0) | (_retarget ? SHUTTER_REC_RETARGET : 0);
+      header.drift = _drift;
+      header.rehome_threshold = _rehome_threshold;
+      header.dead_time = _dead_time;
+      if (!recorder->begin(&header)) {
+        return false;
+      };
+    };
+    _recorder = recorder;
+    return true;
+  #else
+    rlog_w(logTAG, "Command recorder is disabled (CONFIG_SHUTTER_RECORDER)");
+    (void)recorder;
+    return false;
+  #endif // CONFIG_SHUTTER_RECORDER
+}
+
+bool rShutter::journalRestore()
+{
+  shutter_journal_rec_t rec;
+  if ((_journal == nullptr) || !_journal->load(&rec)) {
+    return false;
+  };
+  // Перезапуск во время работы двигателя: положение привода неизвестно
+  if (rec.flags & SHUTTER_JOURNAL_MOVING) {
+    rlog_w(logTAG, "Shutter was moving at shutdown, position not restored");
+    return false;
+  };
+  if ((rec.state < _min_steps) || (rec.state > _max_steps)) {
+    rlog_w(logTAG, "Shutter journal does not match current configuration, position not restored");
+    return false;
+  };
+  _state = rec.state;
+  _travel = rec.travel;
+  // Таблица времени могла измениться после записи журнала
+  if ((_travel > calcTravel(_max_steps)) || (calcPosition(_travel) + 0.5 < _state) || (calcPosition(_travel) - 0.5 > _state)) {
+    _travel = calcTravel(_state);
+  };
+  _limit_min = rec.limit_min;
+  _limit_max = rec.limit_max;
+  _last_changed = (time_t)rec.last_changed;
+  _last_open = (time_t)rec.last_open;
+  _last_close = (time_t)rec.last_close;
+  _last_max_state = rec.last_max_state;
+  _homed = rec.flags & SHUTTER_JOURNAL_HOMED;
+  _drift = rec.drift;
+  rlog_i(logTAG, "Shutter position restored from journal: %d (%d ms)", _state, _travel);
+  return true;
+}
+
 float rShutter::getPercent()
 {
-  return (float)_state / _max_steps * 100.0;
+  return calcPosition(_travel) / _max_steps * 100.0;
 }
 
+// Крайние положения определяются по времени перемещения: после остановки между шагами _state округлен до ближайшего
+// шага и может совпадать с крайним, хотя привод до него не дошел
 bool rShutter::isFullOpen()
 {
   if (_limit_max < _max_steps) {
-    return _state >= _limit_max;
+    return _travel >= calcTravel(_limit_max);
   } else {
-    return _state >= _max_steps;
+    return _travel >= calcTravel(_max_steps);
   };
 }
 
 bool rShutter::isFullClose()
 {
   if (_limit_min > _min_steps) {
-    return _state <= _limit_min;
+    return _travel <= calcTravel(_limit_min);
   } else {
-    return _state <= _min_steps;
+    return _travel == 0;
   };
 }
 
@@ -152,117 +401,307 @@ time_t rShutter::getLastChange()
   return _last_changed;
 }
 
-uint32_t rShutter::calcStepTimeout(int8_t step)
+// Таблица накопленного времени: _time_table[i] - время перемещения из _min_steps в _min_steps + i
+bool rShutter::calcTimeTable()
+{
+  int16_t count = (int16_t)_max_steps - (int16_t)_min_steps + 1;
+  if (count < 1) count = 1;
+  // Новая таблица заполняется в запасном буфере и подменяет текущую только целиком, поэтому задачи, читающие таблицу
+  // во время пересчета (например, после калибровки), никогда не видят ее частично измененной
+  uint32_t* table = _time_spare;
+  if (table == nullptr) {
+    table = (uint32_t*)malloc(count * sizeof(uint32_t));
+    if (table == nullptr) {
+      return false;
+    };
+  };
+  // Длительность каждого следующего шага увеличивается в _step_time_adj раз, как и раньше - последовательным умножением во float
+  float step = (float)_step_time;
+  table[0] = 0;
+  for (int16_t i = 1; i < count; i++) {
+    if (i > 1) {
+      step = step * _step_time_adj;
+    };
+    table[i] = table[i-1] + (uint32_t)step;
+  };
+  shutterPortEnterCritical();
+  _time_spare = _time_table;
+  _time_table = table;
+  shutterPortExitCritical();
+  return true;
+}
+
+uint32_t rShutter::calcMoveTime(int8_t from, int8_t to)
 {
-  float ret = (float)_step_time;
-  if (step > (_min_steps + 1)) {
-    for (uint8_t i = _min_steps + 2; i <= step; i++) {
-      ret = ret * _step_time_adj;
+  if (_time_table == nullptr) return 0;
+  if (from < _min_steps) from = _min_steps;
+  if (from > _max_steps) from = _max_steps;
+  if (to < _min_steps) to = _min_steps;
+  if (to > _max_steps) to = _max_steps;
+  if (to > from) {
+    return _time_table[to - _min_steps] - _time_table[from - _min_steps];
+  } else if (to < from) {
+    uint32_t ret = _time_table[from - _min_steps] - _time_table[to - _min_steps];
+    if (to == _min_steps) {
+      ret = ret + _step_time_fin;
     };
+    return ret;
   };
-  return (uint32_t)ret;
+  return 0;
 }
 
-// Изменение состояния привода
+void rShutter::setTiming(uint32_t full_time, uint32_t step_time, float step_time_adj, uint32_t step_time_fin)
+{
+  _full_time = full_time;
+  _step_time = step_time;
+  _step_time_adj = step_time_adj;
+  _step_time_fin = step_time_fin;
+  // Положение привода в шагах сохраняется, а время перемещения пересчитывается по новой таблице
+  float position = calcPosition(_travel);
+  calcTimeTable();
+  _travel = calcTravel(position);
+}
+
+// Изменение состояния привода на заданное количество шагов
 bool rShutter::DoChange(int8_t steps, bool call_cb, bool publish)
 {
-  if (steps != 0) {
-    if (timerIsActive()) {
-      rlog_w(logTAG, "Drive is busy, operation canceled");
-    } else {
-      // Вычисляем время работы привода
-      uint32_t _duration = 0;
-      if (steps > 0) {
-        for (int8_t i = 1; i <= steps; i++) {
-          _duration = _duration + calcStepTimeout(_state + i);
-        };
+  if ((steps != 0) && (_time_table != nullptr)) {
+    return DoMove(calcChangeTravel(steps), call_cb, publish);
+  };
+  return false;
+}
+
+// Перемещение в заданное положение, выраженное временем перемещения из _min_steps: время работы двигателя 
+// вычисляется точно, в том числе для дробных положений между шагами
+bool rShutter::DoMove(uint32_t travel, bool call_cb, bool publish)
+{
+  if (_time_table == nullptr) return false;
+  if (travel > _time_table[_max_steps - _min_steps]) {
+    travel = _time_table[_max_steps - _min_steps];
+  };
+  if (travel == _travel) return false;
+  bool open = travel > _travel;
+
+  // Привод и так закрывается - если погрешность положения превысила порог, закрываем его полностью на время full_time
+  if ((travel == 0) && rehomeNeeded()) {
+    rlog_i(logTAG, "Accumulated error %d ms exceeded the threshold, shutter will be closed completely", _drift);
+    return DoCloseFull(true, call_cb, publish);
+  };
+
+  if (!motionBegin()) {
+    // Другая задача успела запустить привод после проверки isBusy() - команда выполняется после его остановки
+    return queueCommand(SHUTTER_CMD_MOVE_TO, 0, travel, call_cb, publish, false, false);
+  };
+  // Пока привод не был захвачен, другая задача могла завершить перемещение и изменить _travel - проверки повторяются,
+  // иначе устаревшее направление дало бы переполнение длительности и включение не того выхода
+  if (travel == _travel) {
+    motionEnd();
+    return false;
+  };
+  if ((travel == 0) && rehomeNeeded()) {
+    motionEnd();
+    rlog_i(logTAG, "Accumulated error %d ms exceeded the threshold, shutter will be closed completely", _drift);
+    return DoCloseFull(true, call_cb, publish);
+  };
+  open = travel > _travel;
+  #if CONFIG_SHUTTER_HISTOGRAMS
+    _hist_command = shutterPortTimeUs();
+  #endif // CONFIG_SHUTTER_HISTOGRAMS
+
+  // Вычисляем время работы привода
+  int8_t from = _state;
+  uint32_t from_travel = _travel;
+  float position = calcPosition(travel);
+  int8_t to = (int8_t)(position + (position >= 0 ? 0.5 : -0.5));
+  uint32_t _duration = open ? travel - _travel : _travel - travel;
+  if (travel == 0) {
+    _duration = _duration + _step_time_fin;
+  };
+  // В режиме калибровки привод в крайнее положение перемещается с запасом, но не меньше full_time - до события 
+  // limitReached(), иначе при заниженных параметрах привод никогда не дойдет до выключателя и ошибка не будет замечена
+  if ((_calib != nullptr) && ((travel == 0) || (travel == _time_table[_max_steps - _min_steps]))) {
+    _duration = _duration + _duration * CONFIG_SHUTTER_CALIBRATION_MARGIN / 100;
+    if (_duration < _full_time) {
+      _duration = _full_time;
+    };
+  };
+
+  // Целевое положение фиксируется до включения привода, так как таймер может сработать раньше, чем мы вернемся сюда
+  moveStart(to, travel, _duration, false);
+  _state = to;
+  _travel = travel;
+
+  // Включаем привод на заданное время
+  bool ret = false;
+  if (open) {
+    ret = timerActivate(_pin_open, _level_open, _duration);
+    if (ret) {
+      if (to != from) {
+        rlog_i(logTAG, "Open shutter %d steps ( %d milliseconds )", to - from, _duration);
       } else {
-        for (int8_t i = steps; i < 0 ; i++) {
-          _duration = _duration + calcStepTimeout(_state + i + 1);
-          if (_state + i == _min_steps) {
-            _duration = _duration + _step_time_fin;
-          }
-        };
+        rlog_i(logTAG, "Open shutter to %.2f steps ( %d milliseconds )", position, _duration);
       };
-
-      // Включаем привод на заданное время
-      bool ret = false;
-      if (steps > 0) {
-        ret = timerActivate(_pin_open, _level_open, _duration);
-        if (ret) {
-          rlog_i(logTAG, "Open shutter %d steps ( %d milliseconds )", steps, _duration);
-        };
+    };
+  } else {
+    ret = timerActivate(_pin_close, _level_close, _duration);
+    if (ret) {
+      if (to != from) {
+        rlog_i(logTAG, "Close shutter %d steps ( %d milliseconds )", to - from, _duration);
       } else {
-        ret = timerActivate(_pin_close, _level_close, _duration);
-        if (ret) {
-          rlog_i(logTAG, "Close shutter %d steps ( %d milliseconds )", steps, _duration);
-        };
+        rlog_i(logTAG, "Close shutter to %.2f steps ( %d milliseconds )", position, _duration);
       };
+    };
+  };
 
-      // Post обработка
-      if (ret) {
-        _last_changed = time(nullptr);
-        if ((_state == _min_steps) && (steps > 0)) {
-          _last_max_state = 0;
-          _last_open = time(nullptr);
-        };
-        _state = _state + steps;
-        if (_state == _min_steps) {
-          _last_close = time(nullptr);
-        } else if (_state > _last_max_state) {
-          _last_max_state = _state;
-        };
+  // Остановка, запрошенная другой задачей во время запуска, выполняется здесь
+  if (ret && !motionRun(open ? SHUTTER_MOTION_OPENING : SHUTTER_MOTION_CLOSING)) {
+    rlog_i(logTAG, "Shutter start canceled");
+    motionAbort(call_cb);
+    return false;
+  };
 
-        // Вызываем обработчики
-        if (call_cb && (_on_changed)) {
-          _on_changed(this, _state - steps, _state, _max_steps);
-        };
-        if (publish) {
-          mqttPublish();
-        };
-      } else {
-        rlog_e(logTAG, "Failed to activate shutter");
-      };
-      return ret;
+  // Post обработка
+  if (ret) {
+    _last_changed = shutterPortTime();
+    if ((from_travel == 0) && open) {
+      _last_max_state = 0;
+      _last_open = shutterPortTime();
+    };
+    if (travel == 0) {
+      _last_close = shutterPortTime();
+    } else if (to > _last_max_state) {
+      _last_max_state = to;
     };
+    snapshotUpdate();
+    driftAdd(CONFIG_SHUTTER_DRIFT_MOVE + _duration * CONFIG_SHUTTER_DRIFT_RATE / 100 
+      + ((_drift_dir != 0) && (_drift_dir != (open ? 1 : -1)) ? CONFIG_SHUTTER_DRIFT_REVERSAL : 0));
+    _drift_dir = open ? 1 : -1;
+
+    // Вызываем обработчики
+    if (call_cb && (_on_changed)) {
+      _on_changed(this, from, to, _max_steps);
+    };
+    if (publish) {
+      publishState();
+    };
+  } else {
+    _move_active = false;
+    _state = from;
+    _travel = from_travel;
+    motionEnd();
+    rlog_e(logTAG, "Failed to activate shutter");
   };
-  return false;
+  return ret;
+}
+
+bool rShutter::ChangeEx(int8_t steps, bool call_cb, bool publish)
+{
+  SHUTTER_RECORD(SHUTTER_REC_CHANGE, SHUTTER_REC_FLAGS(call_cb, publish, false), steps, 0);
+  // Пока привод занят, команда ставится в очередь и будет выполнена после его остановки
+  if ((steps != 0) && isBusy()) {
+    if (_retarget && (_time_table != nullptr)
+     && moveRetarget(calcChangeTravel(checkLimits(steps)), call_cb, publish)) {
+      return true;
+    };
+    return queueCommand(SHUTTER_CMD_CHANGE, steps, 0, call_cb, publish, false, false);
+  };
+  return DoChange(checkLimits(steps), call_cb, publish);
 }
 
 bool rShutter::Change(int8_t steps, bool publish)
 {
-  return DoChange(checkLimits(steps), true, publish);
+  return ChangeEx(steps, true, publish);
 }
 
 bool rShutter::OpenFull(bool publish)
 {
-  if (_state < _max_steps) {
-    return Change(_max_steps - _state, publish);
+  SHUTTER_RECORD(SHUTTER_REC_OPEN_FULL, SHUTTER_REC_FLAGS(true, publish, false), 0, 0);
+  if (isBusy() && !_retarget) {
+    return queueCommand(SHUTTER_CMD_OPEN_FULL, 0, 0, true, publish, false, false);
   };
-  return false;
+  return MoveTo(_max_steps, publish);
+}
+
+bool rShutter::MoveTo(float step, bool publish)
+{
+  #if CONFIG_SHUTTER_RECORDER
+    uint32_t rec_value;
+    memcpy(&rec_value, &step, sizeof(rec_value));
+    SHUTTER_RECORD(SHUTTER_REC_MOVE_TO, SHUTTER_REC_FLAGS(true, publish, false), 0, rec_value);
+  #endif // CONFIG_SHUTTER_RECORDER
+  // Проверяем постоянные и временные ограничения
+  if (step < _min_steps) step = _min_steps;
+  if (step > _max_steps) step = _max_steps;
+  if (step < _limit_min) step = _limit_min;
+  if (step > _limit_max) step = _limit_max;
+  uint32_t travel = calcTravel(step);
+  if (isBusy()) {
+    if (moveRetarget(travel, true, publish)) {
+      return true;
+    };
+    return queueCommand(SHUTTER_CMD_MOVE_TO, 0, travel, true, publish, false, false);
+  };
+  return DoMove(travel, true, publish);
+}
+
+bool rShutter::MoveToPercent(float percent, bool publish)
+{
+  return MoveTo(percent * _max_steps / 100.0, publish);
 }
 
 // Полное закрытие без учета шагов (до срабатывания внутренних концевых выключателей привода)
 bool rShutter::CloseFullEx(bool forced, bool call_cb, bool publish)
 {
-  if (forced || (_state > _min_steps)) {
+  SHUTTER_RECORD(SHUTTER_REC_CLOSE_FULL, SHUTTER_REC_FLAGS(call_cb, publish, forced), 0, 0);
+  // Закрытие имеет приоритет: оно отменяет все ранее поставленные в очередь команды
+  queueClear();
+  return DoCloseFull(forced, call_cb, publish);
+}
+
+bool rShutter::DoCloseFull(bool forced, bool call_cb, bool publish)
+{
+  if (forced || (_travel > 0)) {
     if (_limit_min <= _min_steps) {
-      Break();
+      moveBreak(call_cb);
+      // Если привод успела запустить другая задача, закрытие выполняется первым после его остановки
+      if (!motionBegin()) {
+        return queueCommand(SHUTTER_CMD_CLOSE_FULL, 0, 0, call_cb, publish, forced, true);
+      };
+      #if CONFIG_SHUTTER_HISTOGRAMS
+        _hist_command = shutterPortTimeUs();
+      #endif // CONFIG_SHUTTER_HISTOGRAMS
+      int8_t from = _state;
+      uint32_t from_travel = _travel;
+      moveStart(_min_steps, 0, _full_time, true);
+      _state = _min_steps;
+      _travel = 0;
       if (timerActivate(_pin_close, _level_close, _full_time)) {
+        if (!motionRun(SHUTTER_MOTION_CLOSING)) {
+          rlog_i(logTAG, "Shutter start canceled");
+          motionAbort(call_cb);
+          return false;
+        };
         rlog_i(logTAG, "Сlose shutter completely");
-        _last_changed = time(nullptr);
-        _last_close = time(nullptr);
+        _last_changed = shutterPortTime();
+        _last_close = shutterPortTime();
+        snapshotUpdate();
         if (call_cb && (_on_changed)) {
-          _on_changed(this, _state, _min_steps, _max_steps);
+          _on_changed(this, from, _min_steps, _max_steps);
         };
-        _state = _min_steps;
         if (publish) {
-          mqttPublish();
+          publishState();
         };
         return true;
       };
+      _move_active = false;
+      _state = from;
+      _travel = from_travel;
+      motionEnd();
     } else {
-      Change(_limit_min - _state, publish);
+      if (isBusy()) {
+        return queueCommand(SHUTTER_CMD_CLOSE_FULL, 0, 0, call_cb, publish, forced, true);
+      };
+      return MoveTo(_limit_min, publish);
     };
   };
   return false;
@@ -275,17 +714,312 @@ bool rShutter::CloseFull(bool forced, bool publish)
 
 bool rShutter::isBusy()
 {
-  return timerIsActive();
+  return _motion.load() != SHUTTER_MOTION_IDLE;
 }
 
 bool rShutter::Break()
 {
-  if (timerIsActive()) {
-    return timerStop();
+  SHUTTER_RECORD(SHUTTER_REC_BREAK, 0, 0, 0);
+  queueClear();
+  bool ret = moveBreak(true);
+  if (_on_idle) {
+    _on_idle(this, _on_idle_arg);
+  };
+  return ret;
+}
+
+void rShutter::setIdleCallback(cb_shutter_idle_t cb_idle, void* arg)
+{
+  _on_idle = cb_idle;
+  _on_idle_arg = arg;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Отслеживание положения -----------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+void rShutter::moveStart(int8_t target, uint32_t travel, uint32_t duration, bool homing)
+{
+  _move_base = _travel;
+  _move_target = travel;
+  _move_to = target;
+  _move_start = shutterPortTimeUs();
+  _move_duration = duration;
+  _move_max_state = _last_max_state;
+  _move_homing = homing;
+  _move_known = _homed;
+  _move_active = true;
+}
+
+// Обратное преобразование по таблице: время перемещения из _min_steps -> положение в шагах (с дробной частью)
+float rShutter::calcPosition(uint32_t travel)
+{
+  int16_t count = (int16_t)_max_steps - (int16_t)_min_steps;
+  if ((_time_table == nullptr) || (count < 1)) return _state;
+  if (travel >= _time_table[count]) return _max_steps;
+  int16_t lo = 0;
+  int16_t hi = count;
+  while (hi - lo > 1) {
+    int16_t mid = (lo + hi) / 2;
+    if (_time_table[mid] <= travel) {
+      lo = mid;
+    } else {
+      hi = mid;
+    };
+  };
+  uint32_t step = _time_table[hi] - _time_table[lo];
+  float frac = step > 0 ? (float)(travel - _time_table[lo]) / step : 0.0;
+  return (float)(_min_steps + lo) + frac;
+}
+
+// Прямое преобразование: положение в шагах (с дробной частью) -> время перемещения из _min_steps
+uint32_t rShutter::calcTravel(float position)
+{
+  int16_t count = (int16_t)_max_steps - (int16_t)_min_steps;
+  if ((_time_table == nullptr) || (count < 1) || (position <= _min_steps)) return 0;
+  if (position >= _max_steps) return _time_table[count];
+  int16_t lo = (int16_t)(position - _min_steps);
+  float frac = position - _min_steps - lo;
+  return _time_table[lo] + (uint32_t)(frac * (_time_table[lo + 1] - _time_table[lo]) + 0.5);
+}
+
+// Цель относительного перемещения: отсчитывается от фактического положения (во время перемещения - от его цели),
+// а не от округленного до шага _state, и ограничивается так же, как абсолютные цели
+uint32_t rShutter::calcChangeTravel(int8_t steps)
+{
+  float position = calcPosition(_travel) + steps;
+  if (position < _min_steps) position = _min_steps;
+  if (position > _max_steps) position = _max_steps;
+  if (position < _limit_min) position = _limit_min;
+  if (position > _limit_max) position = _limit_max;
+  return calcTravel(position);
+}
+
+// Положение привода в данный момент в единицах времени перемещения
+uint32_t rShutter::calcTravelNow()
+{
+  if (!_move_active) {
+    return _travel;
+  };
+  int64_t elapsed = (shutterPortTimeUs() - _move_start) / 1000;
+  if (elapsed >= _move_duration) {
+    return _move_target;
+  };
+  if (_move_target > _move_base) {
+    uint32_t ret = _move_base + (uint32_t)elapsed;
+    return ret > _move_target ? _move_target : ret;
+  } else {
+    uint32_t ret = (uint32_t)elapsed < _move_base ? _move_base - (uint32_t)elapsed : 0;
+    return ret < _move_target ? _move_target : ret;
+  };
+}
+
+float rShutter::calcPositionNow()
+{
+  return calcPosition(calcTravelNow());
+}
+
+float rShutter::getPositionNow()
+{
+  return calcPositionNow();
+}
+
+// Остановка привода с пересчетом фактически достигнутого положения
+bool rShutter::moveBreak(bool call_cb)
+{
+  // Привод останавливает только одна задача; если он уже останавливается по таймеру, делать ничего не нужно, 
+  // а если только запускается - его остановит запускающая задача
+  if (motionStop()) {
+    return moveHalt(call_cb);
+  };
+  return true;
+}
+
+// Остановка привода, захваченного для остановки (SHUTTER_MOTION_STOPPING)
+bool rShutter::moveHalt(bool call_cb)
+{
+  _reverse_pending = false;
+  uint32_t travel = calcTravelNow();
+  float position = calcPosition(travel);
+  bool ret = timerStop();
+  int8_t target = _state;
+  if (_move_active) {
+    _move_active = false;
+    _travel = travel;
+    int8_t reached = (int8_t)(position + (position >= 0 ? 0.5 : -0.5));
+    if (reached != _state) {
+      _state = reached;
+      _last_max_state = _move_max_state > _state ? _move_max_state : _state;
+      _last_changed = shutterPortTime();
+      if (_travel == 0) {
+        _last_close = shutterPortTime();
+      };
+      rlog_i(logTAG, "Shutter stopped at step %d instead of %d", _state, target);
+    };
+    driftAdd(CONFIG_SHUTTER_DRIFT_BREAK);
+  };
+  motionEnd();
+  if (target != _state) {
+    if (call_cb && (_on_changed)) {
+      _on_changed(this, target, _state, _max_steps);
+    };
+    // Опубликованное при запуске состояние было целью перемещения, поэтому фактическое положение публикуется заново
+    publishState();
+  };
+  return ret;
+}
+
+void rShutter::setRetarget(bool enabled, uint32_t dead_time_ms)
+{
+  _retarget = enabled;
+  _dead_time = dead_time_ms;
+}
+
+// Смена цели во время перемещения. Вернет false, если сменить цель нельзя - тогда команда ставится в очередь
+bool rShutter::moveRetarget(uint32_t travel, bool call_cb, bool publish)
+{
+  if (!_retarget || (_time_table == nullptr) || (_calib != nullptr) || (_queue_count > 0)) {
+    return false;
+  };
+  if (travel > _time_table[_max_steps - _min_steps]) {
+    travel = _time_table[_max_steps - _min_steps];
+  };
+  // Полное закрытие на время full_time не прерывается; на время смены цели привод захватывается так же, как при запуске: 
+  // остановка из другой задачи только запрашивается и выполняется здесь
+  uint8_t motion = _motion.load();
+  if (((motion != SHUTTER_MOTION_OPENING) && (motion != SHUTTER_MOTION_CLOSING)) || !_move_active || _move_homing) {
+    return false;
+  };
+  if (travel == _move_target) {
+    return true;
+  };
+  if (!_motion.compare_exchange_strong(motion, (uint8_t)SHUTTER_MOTION_RETARGETING)) {
+    return false;
+  };
+  if ((_timer == nullptr) || !shutterTimerStop(_timer)) {
+    // Таймер уже сработал: текущее перемещение завершается, новая цель будет выполнена после остановки
+    if (!motionRun((shutter_motion_t)motion)) {
+      motionAbort(call_cb);
+    };
+    return false;
+  };
+
+  bool open = (motion == SHUTTER_MOTION_OPENING);
+  int8_t from = _state;
+  uint32_t travel_now = calcTravelNow();
+  float position = calcPosition(travel);
+  int8_t to = (int8_t)(position + (position >= 0 ? 0.5 : -0.5));
+
+  if (open ? travel > travel_now : travel < travel_now) {
+    // Цель в том же направлении: двигатель не выключается, изменяется только оставшееся время
+    uint32_t remaining = open ? _move_target - travel_now : travel_now - _move_target;
+    uint32_t duration = open ? travel - travel_now : travel_now - travel;
+    if (travel == 0) {
+      duration = duration + _step_time_fin;
+    };
+    int8_t max_state = _move_max_state;
+    _travel = travel_now;
+    moveStart(to, travel, duration, false);
+    _move_max_state = max_state;
+    _state = to;
+    _travel = travel;
+    #if CONFIG_SHUTTER_HISTOGRAMS
+      _hist_deadline = shutterPortTimeUs() + (int64_t)duration * 1000;
+    #endif // CONFIG_SHUTTER_HISTOGRAMS
+    if (!shutterTimerStart(_timer, (uint64_t)duration * 1000)) {
+      statInc(SHUTTER_STAT_TIMER_ERRORS);
+      rlog_e(logTAG, "Failed to restart shutter timer, shutter stopped");
+      _motion.store(SHUTTER_MOTION_STOPPING);
+      moveHalt(call_cb);
+      return true;
+    };
+    // Остановка, запрошенная во время смены цели, выполняется сразу после перезапуска таймера
+    if (!motionRun((shutter_motion_t)motion)) {
+      motionAbort(call_cb);
+      return true;
+    };
+    rlog_i(logTAG, "Shutter target changed to %.2f steps ( %d milliseconds remaining )", position, duration);
+    statInc(SHUTTER_STAT_RETARGETS);
+    _last_changed = shutterPortTime();
+    if (travel == 0) {
+      _last_close = shutterPortTime();
+    };
+    _last_max_state = _move_max_state > to ? _move_max_state : to;
+    snapshotUpdate();
+    if (duration > remaining) {
+      driftAdd((duration - remaining) * CONFIG_SHUTTER_DRIFT_RATE / 100);
+    };
+    if (call_cb && (from != to) && (_on_changed)) {
+      _on_changed(this, from, to, _max_steps);
+    };
+    if (publish) {
+      publishState();
+    };
+    return true;
+  };
+
+  // Цель в обратном направлении: двигатель останавливается, перемещение из достигнутого положения выполняется после 
+  // паузы, необходимой для безопасной смены направления, раньше команд из очереди (и не зависит от ее размера)
+  StopAll();
+  _move_active = false;
+  _travel = travel_now;
+  float reached = calcPosition(travel_now);
+  _state = (int8_t)(reached + (reached >= 0 ? 0.5 : -0.5));
+  _last_max_state = _move_max_state > _state ? _move_max_state : _state;
+  driftAdd(CONFIG_SHUTTER_DRIFT_BREAK);
+  if (call_cb && (from != _state) && (_on_changed)) {
+    _on_changed(this, from, _state, _max_steps);
+  };
+  if (travel == travel_now) {
+    motionEnd();
+    if (publish) {
+      publishState();
+    };
+    mqttFlush();
+    return true;
+  };
+  rlog_i(logTAG, "Shutter stopped at %.2f steps, reverse in %d milliseconds", reached, _dead_time);
+  _reverse_travel = travel;
+  _reverse_cb = call_cb;
+  _reverse_publish = publish;
+  _reverse_pending = true;
+  // Остановка, запрошенная во время смены цели, отменяет реверс (двигатель уже выключен). После перехода в 
+  // SHUTTER_MOTION_DEAD_TIME остановка отменяет реверс в moveHalt(), поэтому таймер паузы запускается уже после него
+  if (!motionRun(_dead_time > 0 ? SHUTTER_MOTION_DEAD_TIME : SHUTTER_MOTION_STOPPING)) {
+    motionAbort(call_cb);
+    return true;
+  };
+  if (_dead_time > 0) {
+    snapshotUpdate();
+    #if CONFIG_SHUTTER_HISTOGRAMS
+      _hist_deadline = shutterPortTimeUs() + (int64_t)_dead_time * 1000;
+    #endif // CONFIG_SHUTTER_HISTOGRAMS
+    if (shutterTimerStart(_timer, (uint64_t)_dead_time * 1000)) {
+      return true;
+    };
+    statInc(SHUTTER_STAT_TIMER_ERRORS);
+    rlog_w(logTAG, "Failed to start dead time timer, reverse without pause");
+    if (!motionStop()) {
+      return true;
+    };
+  };
+  motionEnd();
+  if (!moveReverse()) {
+    queueProcess();
   };
   return true;
 }
 
+// Реверс, отложенный на время паузы перед сменой направления. Вызывается задачей, остановившей привод
+bool rShutter::moveReverse()
+{
+  if (_reverse_pending) {
+    _reverse_pending = false;
+    return DoMove(_reverse_travel, _reverse_cb, _reverse_publish);
+  };
+  return false;
+}
+
 int8_t rShutter::checkLimits(int8_t steps)
 {
   int8_t ret = steps;
@@ -309,10 +1043,22 @@ int8_t rShutter::checkLimits(int8_t steps)
   return ret;
 }
 
+int8_t rShutter::checkTarget(int8_t step)
+{
+  int8_t ret = step;
+  if (ret < _min_steps) ret = _min_steps;
+  if (ret > _max_steps) ret = _max_steps;
+  if (ret < _limit_min) ret = _limit_min;
+  if (ret > _limit_max) ret = _limit_max;
+  return ret;
+}
+
 bool rShutter::setMinLimit(uint8_t limit, bool publish)
 {
+  SHUTTER_RECORD(SHUTTER_REC_MIN_LIMIT, SHUTTER_REC_FLAGS(false, publish, false), 0, limit);
   if (limit != _limit_min) {
     _limit_min = limit;
+    snapshotUpdate();
     if (_state < _limit_min) {
       return Change(_limit_min - _state, publish);
     };
@@ -322,12 +1068,14 @@ bool rShutter::setMinLimit(uint8_t limit, bool publish)
 
 bool rShutter::setMaxLimit(uint8_t limit, bool publish)
 {
+  SHUTTER_RECORD(SHUTTER_REC_MAX_LIMIT, SHUTTER_REC_FLAGS(false, publish, false), 0, limit);
   if (limit != _limit_max) {
     if (limit <= _max_steps) {
       _limit_max = limit;
     } else {
       _limit_max = _max_steps;
     };
+    snapshotUpdate();
     if (_state > _limit_max) {
       return Change(_limit_max - _state, publish);
     };
@@ -346,26 +1094,585 @@ bool rShutter::clearMaxLimit(bool publish)
 }
 
 // -----------------------------------------------------------------------------------------------------------------------
-// -------------------------------------------------------- Timer --------------------------------------------------------
+// ------------------------------------------- Конечные выключатели и калибровка -----------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-static void shutterTimerEnd(void* arg)
+bool rShutter::limitReached(bool open)
 {
-  if (arg) {
-    rShutter* shutter = (rShutter*)arg;
-    shutter->StopAll();
+  SHUTTER_RECORD(SHUTTER_REC_LIMIT, SHUTTER_REC_FLAGS(false, false, open), 0, 0);
+  if (_time_table == nullptr) return false;
+  uint8_t motion = _motion.load();
+  // Событие от выключателя, который привод покидает, или привод уже останавливается другой задачей
+  if (motion == (open ? SHUTTER_MOTION_CLOSING : SHUTTER_MOTION_OPENING)) {
+    return false;
+  };
+  // Во время запуска двигатель еще не включен - событие выключателя к этому перемещению не относится
+  if ((motion == SHUTTER_MOTION_STARTING) || (motion == SHUTTER_MOTION_STOP_REQUESTED)) {
+    return false;
+  };
+  // Во время паузы перед реверсом двигатель уже выключен: положение уточняется, а таймер паузы продолжает работать,
+  // и реверс начнется в DoTimerEnd() только по ее окончании
+  bool moving = (motion != SHUTTER_MOTION_IDLE) && (motion != SHUTTER_MOTION_DEAD_TIME);
+  if (moving && !motionStop()) {
+    return false;
   };
+
+  int8_t from = _state;
+  bool observed = false;
+  uint32_t elapsed = 0;
+  if (moving) {
+    elapsed = (uint32_t)((shutterPortTimeUs() - _move_start) / 1000);
+    // Для калибровки годится только ход от выключателя до выключателя: начальное положение из середины хода само 
+    // вычислено по еще не уточненной модели
+    observed = _move_active && _move_known && (_move_base == 0);
+    timerStop();
+    _move_active = false;
+  };
+
+  // Положение привода теперь известно точно
+  _travel = open ? _time_table[_max_steps - _min_steps] : 0;
+  _state = open ? _max_steps : _min_steps;
+  _homed = true;
+  driftReset();
+  statInc(SHUTTER_STAT_HOMINGS);
+  if (open) {
+    _last_max_state = _max_steps;
+  } else if (from != _min_steps) {
+    _last_close = shutterPortTime();
+  };
+  if (moving) {
+    rlog_i(logTAG, "Shutter reached the %s limit in %d milliseconds", open ? "open" : "close", elapsed);
+    // Параметры уточняются, пока привод еще захвачен этой задачей, - другие задачи не могут запустить его по старой таблице
+    if (observed && open && (_calib != nullptr)) {
+      calibrationAdd(elapsed);
+    };
+    motionEnd();
+  } else {
+    snapshotUpdate();
+  };
+
+  if ((from != _state) && (_on_changed)) {
+    _on_changed(this, from, _state, _max_steps);
+  };
+  if (moving) {
+    mqttFlush();
+    if (!moveReverse() && !queueProcess() && !isBusy() && _on_idle) {
+      _on_idle(this, _on_idle_arg);
+    };
+  };
+  return true;
 }
 
-bool rShutter::timerCreate()
+bool rShutter::calibrationStart()
 {
-  if (_timer == nullptr) {
-    esp_timer_create_args_t cfg;
-    memset(&cfg, 0, sizeof(esp_timer_create_args_t));
-    cfg.name = "shutter";
-    cfg.callback = shutterTimerEnd;
-    cfg.arg = this;
-    RE_OK_CHECK(esp_timer_create(&cfg, &_timer), return false);
+  SHUTTER_RECORD(SHUTTER_REC_CALIB_START, 0, 0, 0);
+  if (_calib == nullptr) {
+    _calib = (shutter_calib_obs_t*)calloc(CONFIG_SHUTTER_CALIBRATION_SIZE, sizeof(shutter_calib_obs_t));
+    if (_calib == nullptr) {
+      rlog_e(logTAG, "Failed to allocate calibration buffer");
+      return false;
+    };
+    _calib_head = 0;
+    _calib_count = 0;
+  };
+  return true;
+}
+
+void rShutter::calibrationStop()
+{
+  SHUTTER_RECORD(SHUTTER_REC_CALIB_STOP, 0, 0, 0);
+  if (_calib) free(_calib);
+  _calib = nullptr;
+  _calib_head = 0;
+  _calib_count = 0;
+}
+
+uint8_t rShutter::calibrationCount()
+{
+  return _calib_count;
+}
+
+void rShutter::calibrationAdd(uint32_t time)
+{
+  // Кольцевой буфер: новое наблюдение вытесняет самое старое
+  if (_calib_count < CONFIG_SHUTTER_CALIBRATION_SIZE) {
+    _calib_count++;
+  } else {
+    _calib_head = (_calib_head + 1) % CONFIG_SHUTTER_CALIBRATION_SIZE;
+  };
+  shutter_calib_obs_t* item = &_calib[(_calib_head + _calib_count - 1) % CONFIG_SHUTTER_CALIBRATION_SIZE];
+  item->time = time;
+  calibrationFit();
+}
+
+// Полное время хода в единицах step_time при текущем коэффициенте step_time_adj
+float rShutter::calibrationUnits()
+{
+  float ret = 0.0;
+  float step = 1.0;
+  for (int16_t i = 0; i < (int16_t)_max_steps - (int16_t)_min_steps; i++) {
+    ret = ret + step;
+    step = step * _step_time_adj;
+  };
+  return ret;
+}
+
+// Положения привода сами вычисляются по времени работы двигателя, поэтому по времени хода до выключателей 
+// наблюдаем только масштаб модели, а не форму (step_time_adj): при фиксированном step_time_adj модель линейна 
+// по step_time, и оптимальное по методу наименьших квадратов значение находится в явном виде
+float rShutter::calibrationFitStep()
+{
+  float units = calibrationUnits();
+  float num = 0.0;
+  float den = 0.0;
+  for (uint8_t i = 0; i < _calib_count; i++) {
+    shutter_calib_obs_t* item = &_calib[(_calib_head + i) % CONFIG_SHUTTER_CALIBRATION_SIZE];
+    num = num + units * item->time;
+    den = den + units * units;
+  };
+  return den > 0 ? num / den : 0.0;
+}
+
+void rShutter::calibrationFit()
+{
+  if ((_calib == nullptr) || (_calib_count < CONFIG_SHUTTER_CALIBRATION_MIN)) return;
+  float step = calibrationFitStep();
+  if (step < 1.0) return;
+  uint32_t full_time = (uint32_t)(step * calibrationUnits() * (100 + CONFIG_SHUTTER_CALIBRATION_MARGIN) / 100);
+  rlog_i(logTAG, "Calibration (%d observations): step_time = %d, full_time = %d", _calib_count, (uint32_t)(step + 0.5), full_time);
+  setTiming(full_time, (uint32_t)(step + 0.5), _step_time_adj, _step_time_fin);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------- Накопленная погрешность положения ----------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static void shutterRehomeTimerEnd(void* arg)
+{
+  if (arg) {
+    rShutter* shutter = (rShutter*)arg;
+    shutter->DoRehomeCheck();
+  };
+}
+
+uint32_t rShutter::getDrift()
+{
+  return _drift;
+}
+
+void rShutter::setRehome(uint32_t threshold_ms)
+{
+  _rehome_threshold = threshold_ms;
+  driftAdd(0);
+}
+
+bool rShutter::setRehomeWindow(uint16_t begin, uint16_t end)
+{
+  _rehome_begin = begin % 1440;
+  _rehome_end = end % 1440;
+  if ((_rehome_begin != _rehome_end) && (_rehome_timer == nullptr)) {
+    if (!shutterTimerCreate(&_rehome_timer, "shutter_home", shutterRehomeTimerEnd, this)) {
+      statInc(SHUTTER_STAT_TIMER_ERRORS);
+      _rehome_begin = _rehome_end = 0;
+      return false;
+    };
+  };
+  driftAdd(0);
+  return true;
+}
+
+// Установка в начальное положение возможна, только если не задано минимальное ограничение
+bool rShutter::rehomeNeeded()
+{
+  return (_rehome_threshold > 0) && (_drift >= _rehome_threshold) && (_limit_min <= _min_steps);
+}
+
+bool rShutter::rehomeInWindow()
+{
+  if (_rehome_begin == _rehome_end) return false;
+  time_t now = shutterPortTime();
+  struct tm ti;
+  localtime_r(&now, &ti);
+  uint16_t minutes = ti.tm_hour * 60 + ti.tm_min;
+  if (_rehome_begin < _rehome_end) {
+    return (minutes >= _rehome_begin) && (minutes < _rehome_end);
+  };
+  return (minutes >= _rehome_begin) || (minutes < _rehome_end);
+}
+
+void rShutter::driftAdd(uint32_t drift)
+{
+  _drift = _drift + drift;
+  // Если порог превышен и задано окно простоя, первая проверка выполняется сразу после остановки привода;
+  // если привод уже стоит, _move_duration относится к прошлому перемещению и проверка назначается через обычный интервал
+  if (rehomeNeeded() && (_rehome_timer != nullptr) && !shutterTimerIsActive(_rehome_timer)) {
+    if (isBusy()) {
+      shutterTimerStart(_rehome_timer, (uint64_t)_move_duration * 1000 + 1000000);
+    } else {
+      shutterTimerStart(_rehome_timer, (uint64_t)CONFIG_SHUTTER_REHOME_CHECK * 1000000);
+    };
+  };
+}
+
+void rShutter::driftReset()
+{
+  _drift = 0;
+  _drift_dir = -1;
+  if ((_rehome_timer != nullptr) && shutterTimerIsActive(_rehome_timer)) {
+    shutterTimerStop(_rehome_timer);
+  };
+}
+
+void rShutter::DoRehomeCheck()
+{
+  if (!rehomeNeeded()) return;
+  if (isBusy() || !rehomeInWindow()) {
+    shutterTimerStart(_rehome_timer, (uint64_t)CONFIG_SHUTTER_REHOME_CHECK * 1000000);
+    return;
+  };
+  rlog_i(logTAG, "Accumulated error %d ms exceeded the threshold, shutter will be rehomed", _drift);
+  rehomeNow();
+}
+
+// Закрываем привод на время full_time и возвращаем в прежнее положение
+void rShutter::rehomeNow()
+{
+  SHUTTER_RECORD(SHUTTER_REC_REHOME, 0, 0, 0);
+  uint32_t travel = _travel;
+  if (DoCloseFull(true, false, false) && (travel > 0)) {
+    queueCommand(SHUTTER_CMD_MOVE_TO, 0, travel, false, false, false, false);
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Очередь команд ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+uint8_t rShutter::getQueued()
+{
+  return _queue_count;
+}
+
+void rShutter::queueClear()
+{
+  shutterPortEnterCritical();
+  uint8_t count = _queue_count;
+  _queue_head = 0;
+  _queue_count = 0;
+  shutterPortExitCritical();
+  if (count > 0) {
+    rlog_d(logTAG, "Command queue cleared, %d commands canceled", count);
+  };
+}
+
+// Очередь изменяется из разных задач, поэтому вся работа с ней выполняется в критической секции
+bool rShutter::queuePush(shutter_cmd_type_t type, int8_t steps, uint32_t travel, bool call_cb, bool publish, bool forced, bool priority)
+{
+  #if CONFIG_SHUTTER_QUEUE_SIZE > 0
+    bool ret = true;
+    shutterPortEnterCritical();
+    if (priority) {
+      // Приоритетная команда ставится в начало очереди
+      if (_queue_count >= CONFIG_SHUTTER_QUEUE_SIZE) {
+        _queue_count--;
+      };
+      _queue_head = (_queue_head + CONFIG_SHUTTER_QUEUE_SIZE - 1) % CONFIG_SHUTTER_QUEUE_SIZE;
+      _queue[_queue_head].type = type;
+      _queue[_queue_head].steps = steps;
+      _queue[_queue_head].travel = travel;
+      _queue[_queue_head].call_cb = call_cb;
+      _queue[_queue_head].publish = publish;
+      _queue[_queue_head].forced = forced;
+      _queue_count++;
+      shutterPortExitCritical();
+      return true;
+    };
+
+    if (_queue_count > 0) {
+      shutter_cmd_t* tail = &_queue[(_queue_head + _queue_count - 1) % CONFIG_SHUTTER_QUEUE_SIZE];
+      if (type == SHUTTER_CMD_CHANGE) {
+        // Последовательные относительные перемещения объединяются в одно результирующее
+        if ((tail->type == SHUTTER_CMD_CHANGE) && (tail->call_cb == call_cb)) {
+          int16_t sum = (int16_t)tail->steps + steps;
+          if (sum > INT8_MAX) sum = INT8_MAX;
+          if (sum < INT8_MIN) sum = INT8_MIN;
+          tail->publish = tail->publish || publish;
+          if (sum == 0) {
+            _queue_count--;
+          } else {
+            tail->steps = (int8_t)sum;
+          };
+          shutterPortExitCritical();
+          return true;
+        };
+      } else {
+        // Абсолютная команда делает бессмысленными предшествующие ей относительные перемещения
+        while ((_queue_count > 0) && (tail->type == SHUTTER_CMD_CHANGE)) {
+          publish = publish || tail->publish;
+          _queue_count--;
+          tail = &_queue[(_queue_head + _queue_count + CONFIG_SHUTTER_QUEUE_SIZE - 1) % CONFIG_SHUTTER_QUEUE_SIZE];
+        };
+        if ((_queue_count > 0) && (tail->type == type)) {
+          // Для перемещения в заданное положение действует последняя цель
+          tail->travel = travel;
+          tail->call_cb = tail->call_cb || call_cb;
+          tail->publish = tail->publish || publish;
+          tail->forced = tail->forced || forced;
+          shutterPortExitCritical();
+          return true;
+        };
+      };
+    };
+
+    if (_queue_count < CONFIG_SHUTTER_QUEUE_SIZE) {
+      shutter_cmd_t* item = &_queue[(_queue_head + _queue_count) % CONFIG_SHUTTER_QUEUE_SIZE];
+      item->type = type;
+      item->steps = steps;
+      item->travel = travel;
+      item->call_cb = call_cb;
+      item->publish = publish;
+      item->forced = forced;
+      _queue_count++;
+    } else {
+      ret = false;
+    };
+    shutterPortExitCritical();
+    if (!ret) {
+      rlog_w(logTAG, "Command queue is full, operation canceled");
+    };
+    return ret;
+  #else
+    rlog_w(logTAG, "Drive is busy, operation canceled");
+  #endif // CONFIG_SHUTTER_QUEUE_SIZE
+  return false;
+}
+
+// Постановка команды в очередь. Если привод успел остановиться, пока команда ставилась в очередь, обработчик таймера 
+// мог уже проверить пустую очередь - в этом случае очередь обрабатывается здесь же, иначе команда была бы потеряна
+bool rShutter::queueCommand(shutter_cmd_type_t type, int8_t steps, uint32_t travel, bool call_cb, bool publish, bool forced, bool priority)
+{
+  bool ret = queuePush(type, steps, travel, call_cb, publish, forced, priority);
+  statInc(ret ? SHUTTER_STAT_QUEUED : SHUTTER_STAT_BUSY);
+  if (ret && !isBusy()) {
+    queueProcess();
+  };
+  return ret;
+}
+
+bool rShutter::DoTimerEnd()
+{
+  SHUTTER_RECORD(SHUTTER_REC_TIMER, 0, 0, 0);
+  // Если привод уже останавливается по команде из другой задачи, таймер ничего не делает; если привод еще запускается, 
+  // его остановит запускающая задача
+  if (!motionStop()) {
+    // Таймер сработал у остановленного привода: выходы все равно отключаются, захватив привод, чтобы не помешать запуску
+    uint8_t expected = SHUTTER_MOTION_IDLE;
+    if (_motion.compare_exchange_strong(expected, (uint8_t)SHUTTER_MOTION_STOPPING)) {
+      StopAll();
+      _motion.store(SHUTTER_MOTION_IDLE);
+    };
+    return false;
+  };
+  // Полное закрытие на время _full_time завершено без прерывания - положение привода достоверно известно
+  if (_move_active && _move_homing) {
+    _homed = true;
+    driftReset();
+    statInc(SHUTTER_STAT_HOMINGS);
+  };
+  _move_active = false;
+  StopAll();
+  #if CONFIG_SHUTTER_HISTOGRAMS
+    if (_hist_deadline >= 0) {
+      histAdd(SHUTTER_HIST_TIMER, _hist_deadline);
+      _hist_deadline = -1;
+    };
+  #endif // CONFIG_SHUTTER_HISTOGRAMS
+  motionEnd();
+  // Отложенные публикации отправляются сразу после остановки привода
+  mqttFlush();
+  bool ret = moveReverse() || queueProcess();
+  if (!ret && !isBusy() && _on_idle) {
+    _on_idle(this, _on_idle_arg);
+  };
+  return ret;
+}
+
+bool rShutter::queueProcess()
+{
+  #if CONFIG_SHUTTER_QUEUE_SIZE > 0
+    while (!isBusy()) {
+      shutter_cmd_t cmd;
+      shutterPortEnterCritical();
+      if (_queue_count == 0) {
+        shutterPortExitCritical();
+        break;
+      };
+      cmd = _queue[_queue_head];
+      _queue_head = (_queue_head + 1) % CONFIG_SHUTTER_QUEUE_SIZE;
+      _queue_count--;
+      shutterPortExitCritical();
+      bool ret = false;
+      switch (cmd.type) {
+        case SHUTTER_CMD_CHANGE:
+          ret = ChangeEx(cmd.steps, cmd.call_cb, cmd.publish);
+          break;
+        case SHUTTER_CMD_OPEN_FULL:
+          ret = OpenFull(cmd.publish);
+          break;
+        case SHUTTER_CMD_MOVE_TO:
+          ret = DoMove(cmd.travel, cmd.call_cb, cmd.publish);
+          break;
+        case SHUTTER_CMD_CLOSE_FULL:
+          // Оставшиеся команды сохраняются, поэтому вызывается DoCloseFull(), а не CloseFullEx()
+          ret = DoCloseFull(cmd.forced, cmd.call_cb, cmd.publish);
+          break;
+      };
+      if (ret) {
+        return true;
+      };
+    };
+  #endif // CONFIG_SHUTTER_QUEUE_SIZE
+  return false;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------- Состояние и снимок состояния ------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Захват привода для запуска: успешен, только если двигатель выключен и никакая другая задача не успела его запустить
+bool rShutter::motionBegin()
+{
+  uint8_t expected = SHUTTER_MOTION_IDLE;
+  if (_motion.compare_exchange_strong(expected, (uint8_t)SHUTTER_MOTION_STARTING)) {
+    snapshotUpdate();
+    return true;
+  };
+  return false;
+}
+
+// Выход включен и таймер запущен - с этого момента привод может остановить любая задача. Вернет false, если во время 
+// запуска или смены цели была запрошена остановка: тогда привод должна остановить вызывающая задача (motionAbort())
+bool rShutter::motionRun(shutter_motion_t motion)
+{
+  uint8_t expected = _motion.load();
+  return ((expected == SHUTTER_MOTION_STARTING) || (expected == SHUTTER_MOTION_RETARGETING))
+    && _motion.compare_exchange_strong(expected, (uint8_t)motion);
+}
+
+// Захват привода для остановки (или для окончания паузы перед сменой направления): успешен только для одной задачи
+// из нескольких, пытающихся остановить привод одновременно. Если привод запускается, остановка только запрашивается
+bool rShutter::motionStop()
+{
+  uint8_t expected = _motion.load();
+  while ((expected == SHUTTER_MOTION_OPENING) || (expected == SHUTTER_MOTION_CLOSING) 
+      || (expected == SHUTTER_MOTION_DEAD_TIME) || (expected == SHUTTER_MOTION_STARTING) 
+      || (expected == SHUTTER_MOTION_RETARGETING)) {
+    uint8_t desired = ((expected == SHUTTER_MOTION_STARTING) || (expected == SHUTTER_MOTION_RETARGETING)) 
+      ? SHUTTER_MOTION_STOP_REQUESTED : SHUTTER_MOTION_STOPPING;
+    if (_motion.compare_exchange_weak(expected, desired)) {
+      return desired == SHUTTER_MOTION_STOPPING;
+    };
+  };
+  return false;
+}
+
+// Выполнение остановки, запрошенной другой задачей во время запуска привода или смены цели
+void rShutter::motionAbort(bool call_cb)
+{
+  _motion.store(SHUTTER_MOTION_STOPPING);
+  moveHalt(call_cb);
+  mqttFlush();
+  if (!queueProcess() && !isBusy() && _on_idle) {
+    _on_idle(this, _on_idle_arg);
+  };
+}
+
+void rShutter::motionEnd()
+{
+  _motion.store(SHUTTER_MOTION_IDLE);
+  snapshotUpdate();
+}
+
+shutter_motion_t rShutter::getMotion()
+{
+  return (shutter_motion_t)_motion.load();
+}
+
+// Запись снимка: нечетное значение счетчика означает, что снимок изменяется. Писатели упорядочиваются критической 
+// секцией (она очень короткая и не содержит блокирующих вызовов), читатели никогда не блокируются
+void rShutter::snapshotUpdate()
+{
+  bool journal = false;
+  shutter_journal_rec_t rec;
+  shutterPortEnterCritical();
+  uint32_t seq = _snap_seq.load(std::memory_order_relaxed);
+  _snap_seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  _snap.motion = (shutter_motion_t)_motion.load(std::memory_order_relaxed);
+  _snap.state = (uint8_t)_state;
+  _snap.travel = _travel;
+  _snap.max_steps = (uint8_t)_max_steps;
+  _snap.last_max_state = (uint8_t)_last_max_state;
+  _snap.limit_min = _limit_min;
+  _snap.limit_max = _limit_max;
+  _snap.homed = _homed;
+  _snap.last_changed = _last_changed;
+  _snap.last_open = _last_open;
+  _snap.last_close = _last_close;
+  _snap_seq.store(seq + 2, std::memory_order_release);
+  // Запись копируется здесь, а во flash пишется в фоновой задаче, поэтому запуск двигателя и задача таймеров не ждут 
+  // окончания записи. В журнале важно только состояние покоя и сам факт начала перемещения: промежуточные состояния 
+  // (запуск, остановка) не записываются, а журнал сам пропускает записи без изменений
+  if (_journal && ((_snap.motion == SHUTTER_MOTION_IDLE) || (_snap.motion == SHUTTER_MOTION_OPENING) 
+   || (_snap.motion == SHUTTER_MOTION_CLOSING))) {
+    journal = true;
+    memset(&rec, 0, sizeof(shutter_journal_rec_t));
+    rec.travel = _snap.travel;
+    rec.last_changed = _snap.last_changed;
+    rec.last_open = _snap.last_open;
+    rec.last_close = _snap.last_close;
+    rec.drift = _drift;
+    rec.state = (int8_t)_snap.state;
+    rec.last_max_state = (int8_t)_snap.last_max_state;
+    rec.limit_min = _snap.limit_min;
+    rec.limit_max = _snap.limit_max;
+    if (_snap.motion != SHUTTER_MOTION_IDLE) rec.flags |= SHUTTER_JOURNAL_MOVING;
+    if (_snap.homed) rec.flags |= SHUTTER_JOURNAL_HOMED;
+  };
+  shutterPortExitCritical();
+
+  if (journal) {
+    _journal->post(&rec);
+  };
+}
+
+void rShutter::getSnapshot(shutter_snapshot_t* snapshot)
+{
+  uint32_t seq1, seq2;
+  do {
+    seq1 = _snap_seq.load(std::memory_order_acquire);
+    memcpy(snapshot, &_snap, sizeof(shutter_snapshot_t));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    seq2 = _snap_seq.load(std::memory_order_relaxed);
+  } while ((seq1 != seq2) || (seq1 & 1));
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------------- Timer --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static void shutterTimerEnd(void* arg)
+{
+  if (arg) {
+    rShutter* shutter = (rShutter*)arg;
+    shutter->DoTimerEnd();
+  };
+}
+
+bool rShutter::timerCreate()
+{
+  if (_timer == nullptr) {
+    return shutterTimerCreate(&_timer, "shutter", shutterTimerEnd, this);
   };
   return true;
 }
@@ -374,7 +1681,10 @@ bool rShutter::timerFree()
 {
   if (_timer != nullptr) {
     timerStop();
-    RE_OK_CHECK(esp_timer_delete(_timer), return false);
+    if (!shutterTimerDelete(_timer)) {
+      return false;
+    };
+    _timer = nullptr;
   };
   return true;
 }
@@ -385,26 +1695,36 @@ bool rShutter::timerActivate(uint8_t pin, bool level, uint32_t duration_ms)
     timerCreate();
   };
   if (_timer != nullptr) {
-    RE_OK_CHECK(esp_timer_start_once(_timer, (uint64_t)(duration_ms)*1000), return false);
+    #if CONFIG_SHUTTER_HISTOGRAMS
+      _hist_deadline = shutterPortTimeUs() + (int64_t)duration_ms * 1000;
+    #endif // CONFIG_SHUTTER_HISTOGRAMS
+    if (!shutterTimerStart(_timer, (uint64_t)(duration_ms)*1000)) {
+      statInc(SHUTTER_STAT_TIMER_ERRORS);
+      return false;
+    };
     if (gpioSetLevelPriv(pin, level)) {
       return true;
     } else {
       timerStop();
     };
+  } else {
+    statInc(SHUTTER_STAT_TIMER_ERRORS);
   };
   return false;
 }
 
 bool rShutter::timerIsActive()
 {
-  return (_timer != nullptr) && esp_timer_is_active(_timer);
+  return (_timer != nullptr) && shutterTimerIsActive(_timer);
 }
 
 bool rShutter::timerStop()
 {
   if (_timer != nullptr) {
-    if (esp_timer_is_active(_timer)) {
-      RE_OK_CHECK(esp_timer_stop(_timer), return false);
+    if (shutterTimerIsActive(_timer)) {
+      if (!shutterTimerStop(_timer)) {
+        return false;
+      };
     };
   };
   return StopAll();
@@ -419,6 +1739,18 @@ void rShutter::mqttSetCallback(cb_shutter_publish_t cb_publish)
   _mqtt_publish = cb_publish;
 }
 
+bool rShutter::mqttSetFormat(shutter_format_t format, cb_shutter_publish_bin_t cb_publish_bin)
+{
+  if ((format == SHUTTER_FORMAT_CBOR) && (cb_publish_bin == nullptr)) {
+    rlog_e(logTAG, "Binary publish callback is required for CBOR format");
+    return false;
+  };
+  _mqtt_format = format;
+  _mqtt_publish_bin = cb_publish_bin;
+  _mqtt_published.mask = 0;
+  return true;
+}
+
 char* rShutter::mqttTopicGet()
 {
   return _mqtt_topic;
@@ -428,12 +1760,18 @@ bool rShutter::mqttTopicSet(char* topic)
 {
   if (_mqtt_topic) free(_mqtt_topic);
   _mqtt_topic = topic;
+  _mqtt_published.mask = 0;
   return (_mqtt_topic != nullptr);
 }
 
 bool rShutter::mqttTopicCreate(bool primary, bool local, const char* topic1, const char* topic2, const char* topic3)
 {
-  return mqttTopicSet(mqttGetTopicDevice(primary, local, topic1, topic2, topic3));
+  #if defined(ESP_PLATFORM)
+    return mqttTopicSet(mqttGetTopicDevice(primary, local, topic1, topic2, topic3));
+  #else
+    (void)primary; (void)local; (void)topic1; (void)topic2; (void)topic3;
+    return false;
+  #endif // ESP_PLATFORM
 }
 
 void rShutter::mqttTopicFree()
@@ -442,14 +1780,344 @@ void rShutter::mqttTopicFree()
   _mqtt_topic = nullptr;
 }
 
+static void shutterPublishTimerEnd(void* arg)
+{
+  if (arg) {
+    rShutter* shutter = (rShutter*)arg;
+    shutter->mqttFlush();
+  };
+}
+
 bool rShutter::mqttPublish()
 {
-  if ((_mqtt_topic) && (_mqtt_publish)) {
-    return _mqtt_publish(this, _mqtt_topic, getJSON(), false, true);
+  if (_mqtt_topic == nullptr) return false;
+  bool ret = false;
+  if (_mqtt_format == SHUTTER_FORMAT_FIELDS) {
+    if (_mqtt_publish == nullptr) return false;
+    ret = publishFields();
+  } else if (_mqtt_format == SHUTTER_FORMAT_CBOR) {
+    // Двоичный пакет нужен только на время вызова, поэтому формируется в стеке
+    if (_mqtt_publish_bin == nullptr) return false;
+    uint8_t cbor[CONFIG_SHUTTER_JSON_BUF_SIZE];
+    size_t len = getCBOR(cbor, sizeof(cbor));
+    ret = (len > 0) && _mqtt_publish_bin(this, _mqtt_topic, cbor, len);
+  } else {
+    // Функция публикации может отправлять данные асинхронно, поэтому пакет передается ей во владение
+    if (_mqtt_publish == nullptr) return false;
+    char* json = getJSON();
+    ret = (json != nullptr) && _mqtt_publish(this, _mqtt_topic, json, false, true);
+  };
+  if (ret) {
+    _publish_dirty = false;
+    _publish_last = shutterPortTimeUs();
+    if ((_publish_timer != nullptr) && shutterTimerIsActive(_publish_timer)) {
+      shutterTimerStop(_publish_timer);
+    };
+  } else {
+    publishRetry();
+  };
+  return ret;
+}
+
+// Неудачная публикация повторяется по таймеру публикаций с последним состоянием привода
+void rShutter::publishRetry()
+{
+  _publish_dirty = true;
+  if ((_publish_timer == nullptr) && !shutterTimerCreate(&_publish_timer, "shutter_pub", shutterPublishTimerEnd, this)) {
+    statInc(SHUTTER_STAT_TIMER_ERRORS);
+    return;
+  };
+  if (!shutterTimerIsActive(_publish_timer)) {
+    uint32_t delay = _publish_interval > 0 ? _publish_interval : CONFIG_SHUTTER_PUBLISH_RETRY;
+    shutterTimerStart(_publish_timer, (uint64_t)delay * 1000);
+  };
+}
+
+bool rShutter::publishField(const char* field, const char* payload)
+{
+  // Топик и значение передаются функции публикации во владение: она может отправлять данные асинхронно
+  char* topic = malloc_stringf("%s/%s", _mqtt_topic, field);
+  if (topic == nullptr) return false;
+  char* value = malloc_stringf("%s", payload);
+  if (value == nullptr) {
+    free(topic);
+    return false;
+  };
+  return _mqtt_publish(this, topic, value, true, true);
+}
+
+// Публикация только тех полей, значения которых отличаются от последних успешно опубликованных. Поле, которое не удалось 
+// отправить, остается отличающимся и будет отправлено при следующей публикации
+bool rShutter::publishFields()
+{
+  if (_mqtt_publish == nullptr) return false;
+  shutter_snapshot_t snap;
+  getSnapshot(&snap);
+  shutter_published_t* last = &_mqtt_published;
+  int32_t percent = (int32_t)(calcPosition(snap.travel) / snap.max_steps * 1000.0 + 0.5);
+  char value[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
+  bool ret = true;
+
+  if (!(last->mask & SHUTTER_FIELD_VALUE) || (last->state != snap.state)) {
+    snprintf(value, sizeof(value), "%d", snap.state);
+    if (publishField(CONFIG_SHUTTER_VALUE, value)) {
+      last->state = snap.state;
+      last->mask |= SHUTTER_FIELD_VALUE;
+    } else {
+      ret = false;
+    };
+  };
+  if (!(last->mask & SHUTTER_FIELD_PERCENT) || (last->percent != percent)) {
+    snprintf(value, sizeof(value), "%d.%d", (int)(percent / 10), (int)(percent % 10));
+    if (publishField(CONFIG_SHUTTER_PERCENT, value)) {
+      last->percent = percent;
+      last->mask |= SHUTTER_FIELD_PERCENT;
+    } else {
+      ret = false;
+    };
+  };
+  if (!(last->mask & SHUTTER_FIELD_CHANGED) || (last->last_changed != snap.last_changed)) {
+    if (publishField(CONFIG_SHUTTER_CHANGED, getTimestampStr(&_time_str_changed, snap.last_changed, value, sizeof(value)))) {
+      last->last_changed = snap.last_changed;
+      last->mask |= SHUTTER_FIELD_CHANGED;
+    } else {
+      ret = false;
+    };
+  };
+  if (!(last->mask & SHUTTER_FIELD_OPEN) || (last->last_open != snap.last_open)) {
+    if (publishField(CONFIG_SHUTTER_OPEN, getTimestampStr(&_time_str_open, snap.last_open, value, sizeof(value)))) {
+      last->last_open = snap.last_open;
+      last->mask |= SHUTTER_FIELD_OPEN;
+    } else {
+      ret = false;
+    };
+  };
+  if (!(last->mask & SHUTTER_FIELD_CLOSE) || (last->last_close != snap.last_close)) {
+    if (publishField(CONFIG_SHUTTER_CLOSE, getTimestampStr(&_time_str_close, snap.last_close, value, sizeof(value)))) {
+      last->last_close = snap.last_close;
+      last->mask |= SHUTTER_FIELD_CLOSE;
+    } else {
+      ret = false;
+    };
+  };
+  if (!(last->mask & SHUTTER_FIELD_MAXIMUM) || (last->last_max_state != snap.last_max_state)) {
+    snprintf(value, sizeof(value), "%d", snap.last_max_state);
+    if (publishField(CONFIG_SHUTTER_MAXIMUM, value)) {
+      last->last_max_state = snap.last_max_state;
+      last->mask |= SHUTTER_FIELD_MAXIMUM;
+    } else {
+      ret = false;
+    };
+  };
+  return ret;
+}
+
+bool rShutter::mqttSetInterval(uint32_t interval_ms)
+{
+  _publish_interval = interval_ms;
+  if ((_publish_interval > 0) && (_publish_timer == nullptr)) {
+    if (!shutterTimerCreate(&_publish_timer, "shutter_pub", shutterPublishTimerEnd, this)) {
+      statInc(SHUTTER_STAT_TIMER_ERRORS);
+      _publish_interval = 0;
+      return false;
+    };
+  };
+  if (_publish_interval == 0) {
+    mqttFlush();
+  };
+  return true;
+}
+
+bool rShutter::mqttFlush()
+{
+  if (_publish_dirty) {
+    return mqttPublish();
   };
   return false;
 }
 
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Входящие команды -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// FNV-1a 32 bit
+static uint32_t shutterHash(const char* data, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+  };
+  return hash;
+}
+
+static bool shutterCmdEqual(const char* data, size_t len, const char* cmd)
+{
+  size_t cmd_len = strlen(cmd);
+  if (len != cmd_len) return false;
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    if ((c >= 'A') && (c <= 'Z')) c = c - 'A' + 'a';
+    if (c != cmd[i]) return false;
+  };
+  return true;
+}
+
+// Разбор числа со знаком и дробной частью; вернет false, если в буфере есть что-то кроме числа
+static bool shutterCmdNumber(const char* data, size_t len, float* value)
+{
+  size_t pos = 0;
+  bool negative = false;
+  if ((pos < len) && ((data[pos] == '+') || (data[pos] == '-'))) {
+    negative = data[pos] == '-';
+    pos++;
+  };
+  float ret = 0.0;
+  float scale = 0.0;
+  bool digits = false;
+  for (; pos < len; pos++) {
+    char c = data[pos];
+    if ((c >= '0') && (c <= '9')) {
+      digits = true;
+      if (scale > 0.0) {
+        ret = ret + (c - '0') * scale;
+        scale = scale / 10.0;
+      } else {
+        ret = ret * 10.0 + (c - '0');
+      };
+    } else if (((c == '.') || (c == ',')) && (scale == 0.0)) {
+      scale = 0.1;
+    } else {
+      return false;
+    };
+  };
+  *value = negative ? -ret : ret;
+  return digits;
+}
+
+bool rShutter::mqttCommandHandle(const char* topic, size_t topic_len, const char* data, size_t data_len, bool retained)
+{
+  // Топик команд: mqttTopicGet() + CONFIG_SHUTTER_COMMAND_TOPIC
+  if ((_mqtt_topic == nullptr) || (topic == nullptr) || (data == nullptr)) return false;
+  size_t base_len = strlen(_mqtt_topic);
+  size_t suffix_len = strlen(CONFIG_SHUTTER_COMMAND_TOPIC);
+  if ((topic_len != base_len + suffix_len) || (strncmp(topic, _mqtt_topic, base_len) != 0)
+   || (strncmp(topic + base_len, CONFIG_SHUTTER_COMMAND_TOPIC, suffix_len) != 0)) {
+    return false;
+  };
+  // Пробелы и переводы строк по краям игнорируются
+  while ((data_len > 0) && ((*data == ' ') || (*data == '\r') || (*data == '\n') || (*data == '\t'))) {
+    data++;
+    data_len--;
+  };
+  while ((data_len > 0) && ((data[data_len - 1] == ' ') || (data[data_len - 1] == '\r') || (data[data_len - 1] == '\n') || (data[data_len - 1] == '\t'))) {
+    data_len--;
+  };
+  if (data_len == 0) return false;
+
+  // Сохраненное сообщение, совпадающее с последней выполненной командой, - повтор после переподключения
+  uint32_t hash = shutterHash(data, data_len);
+  if (retained && (hash == _mqtt_cmd_hash)) {
+    rlog_d(logTAG, "Retained command \"%.*s\" has already been applied", (int)data_len, data);
+    return false;
+  };
+
+  bool relative = (data[0] == '+') || (data[0] == '-');
+  if (retained && (relative || shutterCmdEqual(data, data_len, "stop"))) {
+    rlog_w(logTAG, "Retained command \"%.*s\" cannot be repeated safely, ignored", (int)data_len, data);
+    return false;
+  };
+
+  bool ret = false;
+  float value;
+  if (shutterCmdEqual(data, data_len, "open")) {
+    ret = OpenFull(true);
+  } else if (shutterCmdEqual(data, data_len, "close")) {
+    ret = CloseFull(false, true);
+  } else if (shutterCmdEqual(data, data_len, "stop")) {
+    return Break();
+  } else if ((data_len >= 4) && ((strncmp(data, "min=", 4) == 0) || (strncmp(data, "max=", 4) == 0))) {
+    bool is_min = data[1] == 'i';
+    if (data_len == 4) {
+      is_min ? clearMinLimit(true) : clearMaxLimit(true);
+      ret = true;
+    } else if (shutterCmdNumber(data + 4, data_len - 4, &value) && (value >= 0)) {
+      // Значение ограничивается диапазоном привода до приведения к uint8_t, иначе "min=300" превратилось бы в 44
+      if (value > _max_steps) value = _max_steps;
+      is_min ? setMinLimit((uint8_t)(value + 0.5), true) : setMaxLimit((uint8_t)(value + 0.5), true);
+      ret = true;
+    };
+  } else if (data[data_len - 1] == '%') {
+    if (shutterCmdNumber(data, data_len - 1, &value) && !relative) {
+      ret = MoveToPercent(value, true);
+    };
+  } else if (shutterCmdNumber(data, data_len, &value)) {
+    if (relative) {
+      // Перемещение больше полного хода все равно будет ограничено, но до приведения к int8_t его нужно сократить
+      float range = (float)_max_steps - (float)_min_steps;
+      if (range > INT8_MAX) range = INT8_MAX;
+      if (value > range) value = range;
+      if (value < -range) value = -range;
+      ret = Change((int8_t)(value + (value >= 0 ? 0.5 : -0.5)), true);
+    } else {
+      ret = MoveTo(value, true);
+    };
+  } else {
+    rlog_w(logTAG, "Unknown shutter command \"%.*s\"", (int)data_len, data);
+    return false;
+  };
+  // Запоминаются только выполненные абсолютные команды: брокер хранит именно их и повторит после переподключения,
+  // а команда, которая не была выполнена, после переподключения должна быть выполнена снова
+  if (ret && !relative) {
+    _mqtt_cmd_hash = hash;
+  };
+  return ret;
+}
+
+// Публикация после изменения состояния: сразу или не чаще одного раза в _publish_interval
+bool rShutter::publishState()
+{
+  if (_publish_interval == 0) {
+    return mqttPublish();
+  };
+  if ((_publish_timer == nullptr) && !shutterTimerCreate(&_publish_timer, "shutter_pub", shutterPublishTimerEnd, this)) {
+    statInc(SHUTTER_STAT_TIMER_ERRORS);
+    return mqttPublish();
+  };
+  _publish_dirty = true;
+  int64_t elapsed = shutterPortTimeUs() - _publish_last;
+  int64_t interval = (int64_t)_publish_interval * 1000;
+  if (elapsed >= interval) {
+    return mqttPublish();
+  };
+  if (!shutterTimerIsActive(_publish_timer)) {
+    shutterTimerStart(_publish_timer, (uint64_t)(interval - elapsed));
+  };
+  return true;
+}
+
+// Публикация может выполняться одновременно из нескольких задач, поэтому строка копируется в буфер вызывающей стороны, 
+// а форматирование (которое может блокировать задачу) выполняется вне критической секции
+const char* rShutter::getTimestampStr(shutter_timestr_t* cache, time_t value, char* buf, size_t size)
+{
+  shutterPortEnterCritical();
+  bool cached = cache->valid && (cache->value == value);
+  if (cached) {
+    strncpy(buf, cache->text, size - 1);
+    buf[size - 1] = 0;
+  };
+  shutterPortExitCritical();
+  if (!cached) {
+    time2str_empty(CONFIG_SHUTTER_TIMESTAMP_FORMAT, &value, buf, size);
+    shutterPortEnterCritical();
+    strncpy(cache->text, buf, sizeof(cache->text) - 1);
+    cache->text[sizeof(cache->text) - 1] = 0;
+    cache->value = value;
+    cache->valid = true;
+    shutterPortExitCritical();
+  };
+  return buf;
+}
+
 char* rShutter::getStateJSON(uint8_t state)
 {
   return malloc_stringf("{\"" CONFIG_SHUTTER_VALUE "\":%d,\"" CONFIG_SHUTTER_PERCENT "\":%.1f}", state, (float)state / _max_steps * 100.0);
@@ -457,36 +2125,222 @@ char* rShutter::getStateJSON(uint8_t state)
 
 char* rShutter::getTimestampsJSON()
 {
-  char _time_changed[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
-  char _time_open[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
-  char _time_close[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
-
-  time2str_empty( CONFIG_SHUTTER_TIMESTAMP_FORMAT, &_last_changed, &_time_changed[0], sizeof(_time_changed));
-  time2str_empty( CONFIG_SHUTTER_TIMESTAMP_FORMAT, &_last_open, &_time_open[0], sizeof(_time_open));
-  time2str_empty( CONFIG_SHUTTER_TIMESTAMP_FORMAT, &_last_close, &_time_close[0], sizeof(_time_close));
+  char str_changed[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
+  char str_open[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
+  char str_close[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
+  return malloc_stringf("{\"" CONFIG_SHUTTER_CHANGED "\":\"%s\",\"" CONFIG_SHUTTER_OPEN "\":\"%s\",\"" CONFIG_SHUTTER_CLOSE "\":\"%s\"}", 
+    getTimestampStr(&_time_str_changed, _last_changed, str_changed, sizeof(str_changed)), 
+    getTimestampStr(&_time_str_open, _last_open, str_open, sizeof(str_open)), 
+    getTimestampStr(&_time_str_close, _last_close, str_close, sizeof(str_close)));
+}
 
-  return malloc_stringf("{\"" CONFIG_SHUTTER_CHANGED "\":\"%s\",\"" CONFIG_SHUTTER_OPEN "\":\"%s\",\"" CONFIG_SHUTTER_CLOSE "\":\"%s\"}", _time_changed, _time_open, _time_close);
+size_t rShutter::getJSON(char* buf, size_t size)
+{
+  if ((buf == nullptr) || (size == 0)) return 0;
+  // Все значения берутся из одного снимка, даже если привод в это время изменяется из другой задачи
+  shutter_snapshot_t snap;
+  getSnapshot(&snap);
+  char str_changed[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
+  char str_open[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
+  char str_close[CONFIG_SHUTTER_TIMESTAMP_BUF_SIZE];
+  int len = snprintf(buf, size, 
+    "{\"" CONFIG_SHUTTER_STATUS "\":{\"" CONFIG_SHUTTER_VALUE "\":%d,\"" CONFIG_SHUTTER_PERCENT "\":%.1f},"
+    "\"" CONFIG_SHUTTER_TIMESTAMP "\":{\"" CONFIG_SHUTTER_CHANGED "\":\"%s\",\"" CONFIG_SHUTTER_OPEN "\":\"%s\",\"" CONFIG_SHUTTER_CLOSE "\":\"%s\"},"
+    "\"" CONFIG_SHUTTER_MAXIMUM "\":{\"" CONFIG_SHUTTER_VALUE "\":%d,\"" CONFIG_SHUTTER_PERCENT "\":%.1f}}",
+    snap.state, calcPosition(snap.travel) / snap.max_steps * 100.0,
+    getTimestampStr(&_time_str_changed, snap.last_changed, str_changed, sizeof(str_changed)), 
+    getTimestampStr(&_time_str_open, snap.last_open, str_open, sizeof(str_open)), 
+    getTimestampStr(&_time_str_close, snap.last_close, str_close, sizeof(str_close)),
+    snap.last_max_state, (float)snap.last_max_state / snap.max_steps * 100.0);
+  if ((len < 0) || ((size_t)len >= size)) {
+    rlog_e(logTAG, "JSON buffer too small (%d bytes required)", len + 1);
+    buf[0] = 0;
+    return 0;
+  };
+  return (size_t)len;
 }
 
 char* rShutter::getJSON()
 {
-  char* _json = nullptr;
-  
-  char* _json_stat = getStateJSON(_state);
-  char* _json_smax = getStateJSON(_last_max_state);
-  char* _json_time = getTimestampsJSON();
+  char _json[CONFIG_SHUTTER_JSON_BUF_SIZE];
+  size_t len = getJSON(_json, sizeof(_json));
+  if (len > 0) {
+    char* ret = (char*)malloc(len + 1);
+    if (ret) memcpy(ret, _json, len + 1);
+    return ret;
+  };
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------------- CBOR ---------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Заголовок элемента CBOR (RFC 8949): старший тип и аргумент в минимальном количестве байт
+static size_t cborHead(uint8_t* buf, size_t size, size_t pos, uint8_t major, uint64_t value)
+{
+  uint8_t len = value < 24 ? 0 : (value <= UINT8_MAX ? 1 : (value <= UINT16_MAX ? 2 : (value <= UINT32_MAX ? 4 : 8)));
+  if (pos + 1 + len > size) return 0;
+  buf[pos++] = (major << 5) | (len == 0 ? (uint8_t)value : (len == 1 ? 24 : (len == 2 ? 25 : (len == 4 ? 26 : 27))));
+  for (int8_t i = len - 1; i >= 0; i--) {
+    buf[pos++] = (uint8_t)(value >> (i * 8));
+  };
+  return pos;
+}
+
+static size_t cborUint(uint8_t* buf, size_t size, size_t pos, uint8_t key, uint64_t value)
+{
+  pos = cborHead(buf, size, pos, 0, key);
+  return pos ? cborHead(buf, size, pos, 0, value) : 0;
+}
+
+static size_t cborFloat(uint8_t* buf, size_t size, size_t pos, uint8_t key, float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  pos = cborHead(buf, size, pos, 0, key);
+  if ((pos == 0) || (pos + 5 > size)) return 0;
+  buf[pos++] = 0xFA;
+  for (int8_t i = 3; i >= 0; i--) {
+    buf[pos++] = (uint8_t)(bits >> (i * 8));
+  };
+  return pos;
+}
+
+size_t rShutter::getCBOR(uint8_t* buf, size_t size)
+{
+  if ((buf == nullptr) || (size == 0)) return 0;
+  shutter_snapshot_t snap;
+  getSnapshot(&snap);
+  size_t pos = cborHead(buf, size, 0, 5, 7);
+  if (pos) pos = cborUint(buf, size, pos, SHUTTER_CBOR_VALUE, snap.state);
+  if (pos) pos = cborFloat(buf, size, pos, SHUTTER_CBOR_PERCENT, calcPosition(snap.travel) / snap.max_steps * 100.0);
+  if (pos) pos = cborUint(buf, size, pos, SHUTTER_CBOR_MAX_VALUE, snap.last_max_state);
+  if (pos) pos = cborFloat(buf, size, pos, SHUTTER_CBOR_MAX_PERCENT, (float)snap.last_max_state / snap.max_steps * 100.0);
+  if (pos) pos = cborUint(buf, size, pos, SHUTTER_CBOR_CHANGED, snap.last_changed > 0 ? (uint64_t)snap.last_changed : 0);
+  if (pos) pos = cborUint(buf, size, pos, SHUTTER_CBOR_OPEN, snap.last_open > 0 ? (uint64_t)snap.last_open : 0);
+  if (pos) pos = cborUint(buf, size, pos, SHUTTER_CBOR_CLOSE, snap.last_close > 0 ? (uint64_t)snap.last_close : 0);
+  if (pos == 0) {
+    rlog_e(logTAG, "CBOR buffer too small");
+  };
+  return pos;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Статистика работы привода --------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+void rShutter::statInc(shutter_stat_t stat, uint32_t value)
+{
+  _stats[stat].fetch_add(value, std::memory_order_relaxed);
+}
+
+uint32_t rShutter::getStat(shutter_stat_t stat)
+{
+  return stat < SHUTTER_STAT_MAX ? _stats[stat].load(std::memory_order_relaxed) : 0;
+}
+
+void rShutter::getStats(shutter_stats_t* stats)
+{
+  for (uint8_t i = 0; i < SHUTTER_STAT_MAX; i++) {
+    stats->value[i] = _stats[i].load(std::memory_order_relaxed);
+  };
+}
+
+void rShutter::resetStats(shutter_stats_t* stats)
+{
+  // Счетчики сбрасываются по одному: приращение, выполненное другой задачей во время сброса, не теряется
+  for (uint8_t i = 0; i < SHUTTER_STAT_MAX; i++) {
+    uint32_t value = _stats[i].exchange(0, std::memory_order_relaxed);
+    if (stats) stats->value[i] = value;
+  };
+}
+
+size_t rShutter::getStatsJSON(char* buf, size_t size)
+{
+  if ((buf == nullptr) || (size == 0)) return 0;
+  shutter_stats_t stats;
+  getStats(&stats);
+  int len = snprintf(buf, size, 
+    "{\"moves\":%u,\"reversals\":%u,\"motor_ms\":%u,\"homings\":%u,\"queued\":%u,\"busy\":%u,\"timer_errors\":%u,\"gpio_errors\":%u,\"retargets\":%u}",
+    (unsigned)stats.value[SHUTTER_STAT_MOVES], (unsigned)stats.value[SHUTTER_STAT_REVERSALS], 
+    (unsigned)stats.value[SHUTTER_STAT_MOTOR_MS], (unsigned)stats.value[SHUTTER_STAT_HOMINGS], 
+    (unsigned)stats.value[SHUTTER_STAT_QUEUED], (unsigned)stats.value[SHUTTER_STAT_BUSY], 
+    (unsigned)stats.value[SHUTTER_STAT_TIMER_ERRORS], (unsigned)stats.value[SHUTTER_STAT_GPIO_ERRORS],
+    (unsigned)stats.value[SHUTTER_STAT_RETARGETS]);
+  if ((len < 0) || ((size_t)len >= size)) {
+    rlog_e(logTAG, "JSON buffer too small (%d bytes required)", len + 1);
+    buf[0] = 0;
+    return 0;
+  };
+  return (size_t)len;
+}
 
-  if (_json_stat && _json_smax && _json_time) {
-    _json = malloc_stringf("{\"" CONFIG_SHUTTER_STATUS "\":%s,\"" CONFIG_SHUTTER_TIMESTAMP "\":%s,\"" CONFIG_SHUTTER_MAXIMUM "\":%s}", _json_stat, _json_time, _json_smax);
+char* rShutter::getStatsJSON()
+{
+  char _json[CONFIG_SHUTTER_JSON_BUF_SIZE];
+  size_t len = getStatsJSON(_json, sizeof(_json));
+  if (len > 0) {
+    char* ret = (char*)malloc(len + 1);
+    if (ret) memcpy(ret, _json, len + 1);
+    return ret;
   };
+  return nullptr;
+}
 
-  if (_json_stat) free(_json_stat);
-  if (_json_smax) free(_json_smax);
-  if (_json_time) free(_json_time);
+#if CONFIG_SHUTTER_HISTOGRAMS
 
-  return _json;
+void rShutter::histAdd(shutter_hist_t hist, int64_t begin)
+{
+  int64_t elapsed = shutterPortTimeUs() - begin;
+  uint32_t value = elapsed > 0 ? (elapsed < UINT32_MAX ? (uint32_t)elapsed : UINT32_MAX) : 0;
+  // Логарифмические интервалы: номер интервала - количество значащих битов значения
+  uint8_t index = value > 0 ? 32 - __builtin_clz(value) : 0;
+  if (index >= CONFIG_SHUTTER_HISTOGRAM_BUCKETS) {
+    index = CONFIG_SHUTTER_HISTOGRAM_BUCKETS - 1;
+  };
+  _hist[hist][index].fetch_add(1, std::memory_order_relaxed);
+  _hist_count[hist].fetch_add(1, std::memory_order_relaxed);
+  uint32_t max = _hist_max[hist].load(std::memory_order_relaxed);
+  while ((value > max) && !_hist_max[hist].compare_exchange_weak(max, value, std::memory_order_relaxed)) {};
 }
 
+#endif // CONFIG_SHUTTER_HISTOGRAMS
+
+bool rShutter::getHistogram(shutter_hist_t hist, shutter_histogram_t* histogram)
+{
+  #if CONFIG_SHUTTER_HISTOGRAMS
+    if ((hist < SHUTTER_HIST_MAX) && (histogram != nullptr)) {
+      for (uint8_t i = 0; i < CONFIG_SHUTTER_HISTOGRAM_BUCKETS; i++) {
+        histogram->bucket[i] = _hist[hist][i].load(std::memory_order_relaxed);
+      };
+      histogram->count = _hist_count[hist].load(std::memory_order_relaxed);
+      histogram->max_us = _hist_max[hist].load(std::memory_order_relaxed);
+      return true;
+    };
+  #else
+    (void)hist; (void)histogram;
+  #endif // CONFIG_SHUTTER_HISTOGRAMS
+  return false;
+}
+
+void rShutter::resetHistograms()
+{
+  #if CONFIG_SHUTTER_HISTOGRAMS
+    for (uint8_t h = 0; h < SHUTTER_HIST_MAX; h++) {
+      for (uint8_t i = 0; i < CONFIG_SHUTTER_HISTOGRAM_BUCKETS; i++) {
+        _hist[h][i].store(0, std::memory_order_relaxed);
+      };
+      _hist_count[h].store(0, std::memory_order_relaxed);
+      _hist_max[h].store(0, std::memory_order_relaxed);
+    };
+    _hist_command = -1;
+    _hist_deadline = -1;
+  #endif // CONFIG_SHUTTER_HISTOGRAMS
+}
+
+#if defined(ESP_PLATFORM)
+
 // -----------------------------------------------------------------------------------------------------------------------
 // ---------------------------------------------------- rGpioShutter -----------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
@@ -519,6 +2373,8 @@ bool rGpioShutter::gpioSetLevel(uint8_t pin, bool physical_level)
   return true;
 }
 
+#endif // ESP_PLATFORM
+
 // -----------------------------------------------------------------------------------------------------------------------
 // ---------------------------------------------------- rIoExtShutter -----------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
@@ -534,12 +2390,32 @@ rIoExpShutter::rIoExpShutter(uint8_t pin_open, bool level_open, uint8_t pin_clos
 {
   _gpio_init = cb_gpio_init;
   _gpio_change = cb_gpio_change;
+  _port = nullptr;
+}
+
+rIoExpShutter::rIoExpShutter(uint8_t pin_open, bool level_open, uint8_t pin_close, bool level_close, 
+  int8_t min_steps, int8_t max_steps, uint32_t full_time, uint32_t step_time, float step_time_adj, uint32_t step_time_fin,
+  rIoExpPort* port,
+  cb_shutter_gpio_wrap_t cb_gpio_before, cb_shutter_gpio_wrap_t cb_gpio_after, cb_shutter_timer_t cb_timer, 
+  cb_shutter_change_t cb_state_changed, cb_shutter_publish_t cb_mqtt_publish)
+:rShutter(pin_open, level_open, pin_close, level_close, 
+  min_steps, max_steps, full_time, step_time, step_time_adj, step_time_fin,
+  cb_gpio_before, cb_gpio_after, cb_timer, cb_state_changed, cb_mqtt_publish)
+{
+  _gpio_init = nullptr;
+  _gpio_change = nullptr;
+  _port = port;
 }
 
 bool rIoExpShutter::gpioInit()
 {
   bool ret = false;
-  if (_gpio_init) {
+  if (_port) {
+    _port->beginUpdate();
+    _port->setLevel(_pin_open, !_level_open);
+    _port->setLevel(_pin_close, !_level_close);
+    ret = _port->endUpdate();
+  } else if (_gpio_init) {
     ret = _gpio_init(this, _pin_open, !_level_open);
     if (ret && (_pin_open != _pin_close)) {
       ret = _gpio_init(this, _pin_close, !_level_close);
@@ -550,8 +2426,197 @@ bool rIoExpShutter::gpioInit()
 
 bool rIoExpShutter::gpioSetLevel(uint8_t pin, bool physical_level)
 {
-  if (_gpio_change) {
+  if (_port) {
+    return _port->setLevel(pin, physical_level);
+  } else if (_gpio_change) {
     return _gpio_change(this, pin, physical_level);
   };
   return true;
 }
+
+void rIoExpShutter::gpioBatchBegin()
+{
+  if (_port) _port->beginUpdate();
+}
+
+bool rIoExpShutter::gpioBatchEnd()
+{
+  if (_port) return _port->endUpdate();
+  return true;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ rIoExpPort -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static rIoExpPort* _ioexp_ports = nullptr;
+
+rIoExpPort::rIoExpPort(uint32_t init_value, cb_shutter_port_write_t cb_write)
+{
+  _value = init_value;
+  _written = init_value;
+  _synced = false;
+  _writing = false;
+  _batch = 0;
+  _write = cb_write;
+  shutterPortEnterCritical();
+  _next = _ioexp_ports;
+  _ioexp_ports = this;
+  shutterPortExitCritical();
+}
+
+rIoExpPort::~rIoExpPort()
+{
+  shutterPortEnterCritical();
+  rIoExpPort** item = &_ioexp_ports;
+  while (*item) {
+    if (*item == this) {
+      *item = _next;
+      break;
+    };
+    item = &(*item)->_next;
+  };
+  shutterPortExitCritical();
+}
+
+bool rIoExpPort::Init()
+{
+  _synced = false;
+  return Commit();
+}
+
+bool rIoExpPort::setLevel(uint8_t pin, bool physical_level)
+{
+  if (pin > 31) return false;
+  bool commit;
+  shutterPortEnterCritical();
+  if (physical_level) {
+    _value |= (1UL << pin);
+  } else {
+    _value &= ~(1UL << pin);
+  };
+  commit = (_batch == 0);
+  shutterPortExitCritical();
+  if (commit) {
+    return Commit();
+  };
+  return true;
+}
+
+bool rIoExpPort::getLevel(uint8_t pin)
+{
+  if (pin > 31) return false;
+  return (_value & (1UL << pin)) != 0;
+}
+
+void rIoExpPort::beginUpdate()
+{
+  shutterPortEnterCritical();
+  _batch++;
+  shutterPortExitCritical();
+}
+
+bool rIoExpPort::endUpdate()
+{
+  bool commit = false;
+  shutterPortEnterCritical();
+  if (_batch > 0) {
+    _batch--;
+    commit = (_batch == 0);
+  };
+  shutterPortExitCritical();
+  if (commit) {
+    return Commit();
+  };
+  return true;
+}
+
+bool rIoExpPort::Commit()
+{
+  // Запись на шину выполняет только одна задача: она повторяет запись, пока в расширителе не окажется последнее значение
+  // теневого регистра. Иначе две задачи, скопировавшие регистр в разное время, могли бы записать его в обратном порядке
+  // и оставить в расширителе устаревшее значение (включенный двигатель остановленного привода)
+  shutterPortEnterCritical();
+  if (_writing) {
+    shutterPortExitCritical();
+    return true;
+  };
+  _writing = true;
+  bool ret = true;
+  while (!_synced || (_value != _written)) {
+    uint32_t value = _value;
+    shutterPortExitCritical();
+    if ((_write == nullptr) || !_write(this, value)) {
+      ret = false;
+      shutterPortEnterCritical();
+      break;
+    };
+    shutterPortEnterCritical();
+    _written = value;
+    _synced = true;
+  };
+  _writing = false;
+  shutterPortExitCritical();
+  return ret;
+}
+
+void rIoExpPort::BeginAll(void* arg)
+{
+  (void)arg;
+  for (rIoExpPort* item = _ioexp_ports; item != nullptr; item = item->_next) {
+    item->beginUpdate();
+  };
+}
+
+void rIoExpPort::EndAll(void* arg)
+{
+  (void)arg;
+  for (rIoExpPort* item = _ioexp_ports; item != nullptr; item = item->_next) {
+    if (!item->endUpdate()) {
+      // Теневой регистр сохраняет несостоявшуюся запись, она будет повторена при следующем Commit()
+      rlog_e(logTAG, ERR_GPIO_SET_LEVEL);
+    };
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- rVirtualShutter ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+rVirtualShutter::rVirtualShutter(uint8_t pin_open, bool level_open, uint8_t pin_close, bool level_close, 
+  int8_t min_steps, int8_t max_steps, uint32_t full_time, uint32_t step_time, float step_time_adj, uint32_t step_time_fin,
+  cb_shutter_timer_t cb_timer, cb_shutter_change_t cb_state_changed, cb_shutter_publish_t cb_mqtt_publish)
+:rShutter(pin_open, level_open, pin_close, level_close, 
+  min_steps, max_steps, full_time, step_time, step_time_adj, step_time_fin,
+  nullptr, nullptr, cb_timer, cb_state_changed, cb_mqtt_publish)
+{
+  _gpio_open = !level_open;
+  _gpio_close = !level_close;
+}
+
+bool rVirtualShutter::gpioInit()
+{
+  _gpio_open = !_level_open;
+  _gpio_close = !_level_close;
+  return true;
+}
+
+bool rVirtualShutter::gpioSetLevel(uint8_t pin, bool physical_level)
+{
+  if (pin == _pin_open) {
+    _gpio_open = physical_level;
+  } else if (pin == _pin_close) {
+    _gpio_close = physical_level;
+  };
+  return true;
+}
+
+bool rVirtualShutter::gpioGetLevel(uint8_t pin)
+{
+  if (pin == _pin_open) {
+    return _gpio_open;
+  } else if (pin == _pin_close) {
+    return _gpio_close;
+  };
+  return false;
+}
@@ -0,0 +1,331 @@
+#include "reShutterGroup.h"
+#include <string.h>
+#include <stdlib.h>
+#include "rLog.h"
+
+#if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
+static const char* logTAG = "SHTR";
+#endif // CONFIG_RLOG_PROJECT_LEVEL
+
+static void shutterGroupIdle(rShutter* shutter, void* arg)
+{
+  if (arg) {
+    rShutterGroup* group = (rShutterGroup*)arg;
+    group->DoIdle(shutter);
+  };
+}
+
+static void shutterGroupTimer(void* arg)
+{
+  if (arg) {
+    rShutterGroup* group = (rShutterGroup*)arg;
+    group->DoTimer();
+  };
+}
+
+rShutterGroup::rShutterGroup(uint8_t capacity, uint8_t max_active, cb_shutter_group_done_t cb_done)
+{
+  _capacity = capacity;
+  _count = 0;
+  _max_active = max_active;
+  _active = 0;
+  _pending = 0;
+  _running = false;
+  _publish = false;
+  _action = SHUTTER_GROUP_MOVE;
+  _stagger = 0;
+  _last_start = 0;
+  _timer = nullptr;
+  _on_done = cb_done;
+  _on_item = nullptr;
+  _items = (shutter_group_item_t*)calloc(capacity, sizeof(shutter_group_item_t));
+  _order = (uint8_t*)calloc(capacity, sizeof(uint8_t));
+  if ((_items == nullptr) || (_order == nullptr)) {
+    rlog_e(logTAG, "Failed to allocate shutter group");
+    _capacity = 0;
+  };
+}
+
+rShutterGroup::~rShutterGroup()
+{
+  if (_timer != nullptr) {
+    shutterTimerDelete(_timer);
+    _timer = nullptr;
+  };
+  for (uint8_t i = 0; i < _count; i++) {
+    _items[i].shutter->setIdleCallback(nullptr, nullptr);
+  };
+  if (_items) free(_items);
+  _items = nullptr;
+  if (_order) free(_order);
+  _order = nullptr;
+}
+
+bool rShutterGroup::add(rShutter* shutter)
+{
+  if ((shutter == nullptr) || (_count >= _capacity) || isBusy()) {
+    return false;
+  };
+  _items[_count].shutter = shutter;
+  _items[_count].target = 0;
+  _items[_count].duration = 0;
+  _items[_count].state = SHUTTER_GROUP_IDLE;
+  _order[_count] = _count;
+  _count++;
+  shutter->setIdleCallback(shutterGroupIdle, this);
+  return true;
+}
+
+uint8_t rShutterGroup::getCount()
+{
+  return _count;
+}
+
+void rShutterGroup::setMaxActive(uint8_t max_active)
+{
+  _max_active = max_active;
+  startNext();
+}
+
+bool rShutterGroup::setStagger(uint32_t stagger_ms)
+{
+  _stagger = stagger_ms;
+  if ((_stagger > 0) && (_timer == nullptr)) {
+    if (!shutterTimerCreate(&_timer, "shutter_grp", shutterGroupTimer, this)) {
+      _stagger = 0;
+      return false;
+    };
+  };
+  return true;
+}
+
+void rShutterGroup::setItemCallback(cb_shutter_group_item_t cb_item)
+{
+  _on_item = cb_item;
+}
+
+bool rShutterGroup::isBusy()
+{
+  return _running;
+}
+
+bool rShutterGroup::MoveTo(int8_t step, bool publish)
+{
+  if (isBusy()) {
+    rlog_w(logTAG, "Shutter group is busy, operation canceled");
+    return false;
+  };
+  for (uint8_t i = 0; i < _count; i++) {
+    _items[i].target = step;
+  };
+  _action = SHUTTER_GROUP_MOVE;
+  _publish = publish;
+  return Start();
+}
+
+bool rShutterGroup::MoveToPercent(float percent, bool publish)
+{
+  if (isBusy()) {
+    rlog_w(logTAG, "Shutter group is busy, operation canceled");
+    return false;
+  };
+  for (uint8_t i = 0; i < _count; i++) {
+    _items[i].target = (int8_t)(percent * _items[i].shutter->getMaxSteps() / 100.0 + 0.5);
+  };
+  _action = SHUTTER_GROUP_MOVE;
+  _publish = publish;
+  return Start();
+}
+
+bool rShutterGroup::Home(bool publish)
+{
+  if (isBusy()) {
+    rlog_w(logTAG, "Shutter group is busy, operation canceled");
+    return false;
+  };
+  _action = SHUTTER_GROUP_HOME;
+  _publish = publish;
+  return Start();
+}
+
+// Сортировка по убыванию длительности перемещения (LPT): длинные перемещения запускаются первыми
+void rShutterGroup::sortByDuration()
+{
+  for (uint8_t i = 1; i < _count; i++) {
+    uint8_t idx = _order[i];
+    int16_t j = i - 1;
+    while ((j >= 0) && (_items[_order[j]].duration < _items[idx].duration)) {
+      _order[j + 1] = _order[j];
+      j--;
+    };
+    _order[j + 1] = idx;
+  };
+}
+
+bool rShutterGroup::Start()
+{
+  uint8_t pending = 0;
+  for (uint8_t i = 0; i < _count; i++) {
+    rShutter* shutter = _items[i].shutter;
+    int8_t state = shutter->getState();
+    // При установленном минимальном ограничении CloseFullEx() перемещает привод только до ограничения
+    if (_action == SHUTTER_GROUP_HOME) {
+      _items[i].target = shutter->checkTarget(shutter->getMinSteps());
+      _items[i].duration = _items[i].target == shutter->getMinSteps() 
+        ? shutter->getFullTime() : shutter->calcMoveTime(state, _items[i].target);
+      _items[i].state = SHUTTER_GROUP_PENDING;
+      pending++;
+      continue;
+    };
+    // Длительность оценивается по положению, которое привод действительно достигнет с учетом ограничений
+    _items[i].target = shutter->checkTarget(_items[i].target);
+    _items[i].duration = shutter->calcMoveTime(state, _items[i].target);
+    if (_items[i].target != state) {
+      _items[i].state = SHUTTER_GROUP_PENDING;
+      pending++;
+    } else {
+      _items[i].state = SHUTTER_GROUP_IDLE;
+    };
+  };
+  sortByDuration();
+
+  shutterPortEnterCritical();
+  _pending = pending;
+  _running = true;
+  // Первый привод запускается без задержки
+  _last_start = shutterPortTimeUs() - (int64_t)_stagger * 1000;
+  shutterPortExitCritical();
+
+  rlog_i(logTAG, "Shutter group: %d drives to move, no more than %d at the same time", pending, _max_active);
+  startNext();
+  return true;
+}
+
+bool rShutterGroup::canStart()
+{
+  return (_pending > 0) && ((_max_active == 0) || (_active < _max_active));
+}
+
+bool rShutterGroup::startItem(shutter_group_item_t* item)
+{
+  bool ret = false;
+  if (_action == SHUTTER_GROUP_HOME) {
+    ret = item->shutter->CloseFullEx(true, false, _publish);
+  } else {
+    int8_t steps = item->target - (int8_t)item->shutter->getState();
+    ret = (steps != 0) && item->shutter->ChangeEx(steps, false, _publish);
+  };
+  // Команда могла запустить привод, даже если не вернула true (например, закрытие до минимального ограничения) - 
+  // тогда привод остается активным до вызова DoIdle()
+  return ret || item->shutter->isBusy();
+}
+
+// Запуск ожидающих приводов, пока не исчерпан лимит одновременно работающих двигателей
+void rShutterGroup::startNext()
+{
+  while (true) {
+    shutter_group_item_t* item = nullptr;
+    shutterPortEnterCritical();
+    // Между включениями двигателей выдерживается интервал _stagger, оставшееся время отсчитывает таймер группы
+    int64_t wait = 0;
+    if ((_stagger > 0) && (_timer != nullptr) && canStart()) {
+      wait = _last_start + (int64_t)_stagger * 1000 - shutterPortTimeUs();
+    };
+    if ((wait <= 0) && canStart()) {
+      for (uint8_t i = 0; i < _count; i++) {
+        if (_items[_order[i]].state == SHUTTER_GROUP_PENDING) {
+          item = &_items[_order[i]];
+          item->state = SHUTTER_GROUP_ACTIVE;
+          _pending--;
+          _active++;
+          break;
+        };
+      };
+    };
+    shutterPortExitCritical();
+    if (wait > 0) {
+      if (!shutterTimerIsActive(_timer)) {
+        shutterTimerStart(_timer, (uint64_t)wait);
+      };
+      break;
+    };
+    if (item == nullptr) break;
+
+    if (startItem(item)) {
+      _last_start = shutterPortTimeUs();
+    } else {
+      // Привод уже в заданном положении или не может быть перемещен (например, из-за ограничений). Если привод успел
+      // остановиться, DoIdle() уже завершил его
+      shutterPortEnterCritical();
+      if (item->state == SHUTTER_GROUP_ACTIVE) {
+        item->state = SHUTTER_GROUP_IDLE;
+        _active--;
+      };
+      shutterPortExitCritical();
+    };
+  };
+
+  // Операция завершена: callback вызывается ровно один раз
+  bool done = false;
+  shutterPortEnterCritical();
+  if (_running && (_active == 0) && (_pending == 0)) {
+    _running = false;
+    done = true;
+  };
+  shutterPortExitCritical();
+  if (done) {
+    rlog_i(logTAG, "Shutter group: operation completed");
+    if (_on_done) _on_done(this);
+  };
+}
+
+void rShutterGroup::DoIdle(rShutter* shutter)
+{
+  bool finished = false;
+  shutterPortEnterCritical();
+  for (uint8_t i = 0; i < _count; i++) {
+    if ((_items[i].shutter == shutter) && (_items[i].state == SHUTTER_GROUP_ACTIVE)) {
+      _items[i].state = SHUTTER_GROUP_IDLE;
+      _active--;
+      finished = true;
+      break;
+    };
+  };
+  shutterPortExitCritical();
+
+  if (finished) {
+    if (_on_item) _on_item(this, shutter);
+    startNext();
+  };
+}
+
+void rShutterGroup::DoTimer()
+{
+  startNext();
+}
+
+bool rShutterGroup::Break()
+{
+  shutterPortEnterCritical();
+  for (uint8_t i = 0; i < _count; i++) {
+    if (_items[i].state == SHUTTER_GROUP_PENDING) {
+      _items[i].state = SHUTTER_GROUP_IDLE;
+    };
+  };
+  _pending = 0;
+  shutterPortExitCritical();
+  if ((_timer != nullptr) && shutterTimerIsActive(_timer)) {
+    shutterTimerStop(_timer);
+  };
+
+  bool ret = true;
+  for (uint8_t i = 0; i < _count; i++) {
+    if (_items[i].state == SHUTTER_GROUP_ACTIVE) {
+      ret = _items[i].shutter->Break() && ret;
+    };
+  };
+  // Если группа только выдерживала интервал между запусками, ни один привод не вызовет DoIdle() - операция
+  // завершается здесь (при активных приводах startNext() уже выполнен из DoIdle() и ничего не сделает)
+  startNext();
+  return ret;
+}
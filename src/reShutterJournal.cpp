@@ -0,0 +1,241 @@
+#include "reShutterJournal.h"
+#include <stddef.h>
+#include <string.h>
+#include "rLog.h"
+#if defined(ESP_PLATFORM)
+#include "reEsp32.h"
+#endif // ESP_PLATFORM
+
+#if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
+static const char* logTAG = "SHTR";
+#endif // CONFIG_RLOG_PROJECT_LEVEL
+
+// CRC-16/CCITT-FALSE
+static uint16_t shutterJournalCrc(const uint8_t* data, size_t size)
+{
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t j = 0; j < 8; j++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    };
+  };
+  return crc;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- rShutterJournal --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+rShutterJournal::rShutterJournal(uint8_t slots)
+{
+  _slots = slots > 0 ? slots : 1;
+  _next = 0;
+  _seq = 0;
+  _writes = 0;
+  _loaded = false;
+  _last_valid = false;
+  memset(&_last, 0, sizeof(shutter_journal_rec_t));
+  _pending_valid = false;
+  _flush_queued = false;
+  memset(&_pending, 0, sizeof(shutter_journal_rec_t));
+}
+
+bool rShutterJournal::load(shutter_journal_rec_t* rec)
+{
+  shutter_journal_rec_t item;
+  _loaded = true;
+  _last_valid = false;
+  _next = 0;
+  _seq = 0;
+  for (uint8_t i = 0; i < _slots; i++) {
+    if (slotRead(i, &item)
+     && (shutterJournalCrc((const uint8_t*)&item, offsetof(shutter_journal_rec_t, crc)) == item.crc)
+     && (!_last_valid || (item.seq > _last.seq))) {
+      memcpy(&_last, &item, sizeof(shutter_journal_rec_t));
+      _last_valid = true;
+      _next = (i + 1) % _slots;
+      _seq = item.seq;
+    };
+  };
+  if (_last_valid && rec) {
+    memcpy(rec, &_last, sizeof(shutter_journal_rec_t));
+  };
+  return _last_valid;
+}
+
+// Сравнение без учета служебных полей seq и crc
+bool rShutterJournal::isSame(const shutter_journal_rec_t* rec)
+{
+  return _last_valid && (memcmp((const uint8_t*)rec + sizeof(rec->seq), (const uint8_t*)&_last + sizeof(rec->seq),
+    offsetof(shutter_journal_rec_t, crc) - sizeof(rec->seq)) == 0);
+}
+
+bool rShutterJournal::append(shutter_journal_rec_t* rec)
+{
+  // Номер следующей записи должен быть больше всех записей, уже находящихся в кольце
+  if (!_loaded) {
+    load(nullptr);
+  };
+  if (isSame(rec) || (_last_valid && (_last.flags & SHUTTER_JOURNAL_MOVING) && (rec->flags & SHUTTER_JOURNAL_MOVING))) {
+    return true;
+  };
+  rec->seq = _seq + 1;
+  rec->reserved = 0;
+  rec->crc = shutterJournalCrc((const uint8_t*)rec, offsetof(shutter_journal_rec_t, crc));
+  if (!slotWrite(_next, rec)) {
+    rlog_e(logTAG, "Failed to write shutter journal");
+    return false;
+  };
+  _seq = rec->seq;
+  _next = (_next + 1) % _slots;
+  _writes++;
+  memcpy(&_last, rec, sizeof(shutter_journal_rec_t));
+  _last_valid = true;
+  return true;
+}
+
+static void shutterJournalFlush(void* arg)
+{
+  if (arg) {
+    ((rShutterJournal*)arg)->flush();
+  };
+}
+
+void rShutterJournal::post(const shutter_journal_rec_t* rec)
+{
+  shutterPortEnterCritical();
+  memcpy(&_pending, rec, sizeof(shutter_journal_rec_t));
+  _pending_valid = true;
+  bool queue = !_flush_queued;
+  _flush_queued = true;
+  shutterPortExitCritical();
+  // Пока запись в очереди, новые данные только заменяют ожидающую запись
+  if (queue && !shutterPortDefer(shutterJournalFlush, this)) {
+    shutterPortEnterCritical();
+    _flush_queued = false;
+    shutterPortExitCritical();
+  };
+}
+
+// Записи выполняются только здесь, по одной: следующий вызов ставится в очередь только после сброса _flush_queued
+void rShutterJournal::flush()
+{
+  shutter_journal_rec_t rec;
+  while (true) {
+    shutterPortEnterCritical();
+    if (!_pending_valid) {
+      _flush_queued = false;
+      shutterPortExitCritical();
+      return;
+    };
+    memcpy(&rec, &_pending, sizeof(shutter_journal_rec_t));
+    _pending_valid = false;
+    shutterPortExitCritical();
+    append(&rec);
+  };
+}
+
+uint32_t rShutterJournal::getWrites()
+{
+  return _writes;
+}
+
+#if defined(ESP_PLATFORM)
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- rShutterJournalNvs -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+rShutterJournalNvs::rShutterJournalNvs(const char* nvs_space, uint8_t slots)
+:rShutterJournal(slots)
+{
+  _nvs_space = nvs_space;
+  _nvs_handle = 0;
+  _nvs_opened = false;
+}
+
+rShutterJournalNvs::~rShutterJournalNvs()
+{
+  if (_nvs_opened) {
+    nvs_close(_nvs_handle);
+    _nvs_opened = false;
+  };
+}
+
+bool rShutterJournalNvs::nvsOpen()
+{
+  if (!_nvs_opened) {
+    RE_OK_CHECK(nvs_open(_nvs_space, NVS_READWRITE, &_nvs_handle), return false);
+    _nvs_opened = true;
+  };
+  return true;
+}
+
+bool rShutterJournalNvs::slotRead(uint8_t index, shutter_journal_rec_t* rec)
+{
+  if (!nvsOpen()) return false;
+  char key[8];
+  snprintf(key, sizeof(key), "j%d", index);
+  size_t size = sizeof(shutter_journal_rec_t);
+  return (nvs_get_blob(_nvs_handle, key, rec, &size) == ESP_OK) && (size == sizeof(shutter_journal_rec_t));
+}
+
+bool rShutterJournalNvs::slotWrite(uint8_t index, const shutter_journal_rec_t* rec)
+{
+  if (!nvsOpen()) return false;
+  char key[8];
+  snprintf(key, sizeof(key), "j%d", index);
+  RE_OK_CHECK(nvs_set_blob(_nvs_handle, key, rec, sizeof(shutter_journal_rec_t)), return false);
+  RE_OK_CHECK(nvs_commit(_nvs_handle), return false);
+  return true;
+}
+
+#endif // ESP_PLATFORM
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- rShutterJournalFile ------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+rShutterJournalFile::rShutterJournalFile(const char* filename, uint8_t slots)
+:rShutterJournal(slots)
+{
+  _filename = filename;
+  _file = nullptr;
+}
+
+rShutterJournalFile::~rShutterJournalFile()
+{
+  if (_file) fclose(_file);
+  _file = nullptr;
+}
+
+bool rShutterJournalFile::fileOpen()
+{
+  if (_file == nullptr) {
+    _file = fopen(_filename, "r+b");
+    if (_file == nullptr) {
+      _file = fopen(_filename, "w+b");
+    };
+    if (_file == nullptr) {
+      rlog_e(logTAG, "Failed to open shutter journal \"%s\"", _filename);
+      return false;
+    };
+  };
+  return true;
+}
+
+bool rShutterJournalFile::slotRead(uint8_t index, shutter_journal_rec_t* rec)
+{
+  if (!fileOpen()) return false;
+  if (fseek(_file, (long)index * sizeof(shutter_journal_rec_t), SEEK_SET) != 0) return false;
+  return fread(rec, sizeof(shutter_journal_rec_t), 1, _file) == 1;
+}
+
+bool rShutterJournalFile::slotWrite(uint8_t index, const shutter_journal_rec_t* rec)
+{
+  if (!fileOpen()) return false;
+  if (fseek(_file, (long)index * sizeof(shutter_journal_rec_t), SEEK_SET) != 0) return false;
+  if (fwrite(rec, sizeof(shutter_journal_rec_t), 1, _file) != 1) return false;
+  return fflush(_file) == 0;
+}
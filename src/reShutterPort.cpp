@@ -0,0 +1,295 @@
+#include "reShutterPort.h"
+#include <string.h>
+#include <stdlib.h>
+#include "rLog.h"
+
+#if !CONFIG_SHUTTER_PORT_VIRTUAL
+
+#include "reEsp32.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- ESP-IDF -------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
+static const char* logTAG = "SHTR";
+#endif // CONFIG_RLOG_PROJECT_LEVEL
+
+bool shutterPortTimerCreate(shutter_port_timer_t* timer, const char* name, cb_shutter_port_timer_t cb, void* arg)
+{
+  esp_timer_create_args_t cfg;
+  memset(&cfg, 0, sizeof(esp_timer_create_args_t));
+  cfg.name = name;
+  cfg.callback = cb;
+  cfg.arg = arg;
+  RE_OK_CHECK(esp_timer_create(&cfg, timer), return false);
+  return true;
+}
+
+bool shutterPortTimerDelete(shutter_port_timer_t timer)
+{
+  RE_OK_CHECK(esp_timer_delete(timer), return false);
+  return true;
+}
+
+bool shutterPortTimerStart(shutter_port_timer_t timer, uint64_t timeout_us)
+{
+  RE_OK_CHECK(esp_timer_start_once(timer, timeout_us), return false);
+  return true;
+}
+
+bool shutterPortTimerStop(shutter_port_timer_t timer)
+{
+  RE_OK_CHECK(esp_timer_stop(timer), return false);
+  return true;
+}
+
+bool shutterPortTimerIsActive(shutter_port_timer_t timer)
+{
+  return esp_timer_is_active(timer);
+}
+
+static void shutterPortDeferred(void* cb, uint32_t arg)
+{
+  // Указатели на ESP32 32-битные, поэтому аргумент передается во втором параметре
+  ((cb_shutter_port_timer_t)cb)((void*)arg);
+}
+
+bool shutterPortDefer(cb_shutter_port_timer_t cb, void* arg)
+{
+  if (xTimerPendFunctionCall(shutterPortDeferred, (void*)cb, (uint32_t)arg, 0) != pdPASS) {
+    rlog_e(logTAG, "Failed to defer function call");
+    return false;
+  };
+  return true;
+}
+
+int64_t shutterPortTimeUs()
+{
+  return esp_timer_get_time();
+}
+
+time_t shutterPortTime()
+{
+  return time(nullptr);
+}
+
+static portMUX_TYPE _shutter_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void shutterPortEnterCritical()
+{
+  portENTER_CRITICAL(&_shutter_mux);
+}
+
+void shutterPortExitCritical()
+{
+  portEXIT_CRITICAL(&_shutter_mux);
+}
+
+#else
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Виртуальное время --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+typedef struct shutter_vtimer_t {
+  cb_shutter_port_timer_t cb;
+  void* arg;
+  bool active;
+  int64_t deadline;
+  uint64_t order;
+  int32_t index;                  // Позиция в куче или -1, если таймер не запущен
+} shutter_vtimer_t;
+
+// Запущенные таймеры хранятся в двоичной куче по сроку, поэтому ближайший таймер находится за O(1), а запуск,
+// остановка и срабатывание выполняются за O(log n) независимо от количества созданных таймеров
+static shutter_vtimer_t** _vtime_heap = nullptr;
+static uint32_t _vtime_heap_size = 0;
+static uint32_t _vtime_count = 0;
+static uint32_t _vtime_timers = 0;
+static int64_t _vtime_now = 0;
+static time_t _vtime_wall = 0;
+static uint64_t _vtime_order = 0;
+
+// При совпадении сроков раньше срабатывает запущенный раньше таймер, чтобы порядок срабатывания был детерминированным
+static bool shutterVirtualTimeLess(shutter_vtimer_t* a, shutter_vtimer_t* b)
+{
+  return (a->deadline < b->deadline) || ((a->deadline == b->deadline) && (a->order < b->order));
+}
+
+static void shutterVirtualTimeSwap(uint32_t a, uint32_t b)
+{
+  shutter_vtimer_t* tmp = _vtime_heap[a];
+  _vtime_heap[a] = _vtime_heap[b];
+  _vtime_heap[b] = tmp;
+  _vtime_heap[a]->index = a;
+  _vtime_heap[b]->index = b;
+}
+
+static void shutterVirtualTimeUp(uint32_t i)
+{
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (!shutterVirtualTimeLess(_vtime_heap[i], _vtime_heap[parent])) break;
+    shutterVirtualTimeSwap(parent, i);
+    i = parent;
+  };
+}
+
+static void shutterVirtualTimeDown(uint32_t i)
+{
+  while (true) {
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    uint32_t min = i;
+    if ((left < _vtime_count) && shutterVirtualTimeLess(_vtime_heap[left], _vtime_heap[min])) min = left;
+    if ((right < _vtime_count) && shutterVirtualTimeLess(_vtime_heap[right], _vtime_heap[min])) min = right;
+    if (min == i) break;
+    shutterVirtualTimeSwap(min, i);
+    i = min;
+  };
+}
+
+static void shutterVirtualTimeRemove(shutter_vtimer_t* timer)
+{
+  uint32_t i = (uint32_t)timer->index;
+  _vtime_count--;
+  if (i != _vtime_count) {
+    shutter_vtimer_t* moved = _vtime_heap[_vtime_count];
+    _vtime_heap[i] = moved;
+    moved->index = i;
+    shutterVirtualTimeUp(i);
+    shutterVirtualTimeDown(moved->index);
+  };
+  timer->index = -1;
+  timer->active = false;
+}
+
+bool shutterPortTimerCreate(shutter_port_timer_t* timer, const char* name, cb_shutter_port_timer_t cb, void* arg)
+{
+  (void)name;
+  // Место в куче резервируется при создании таймера, поэтому запуск таймера не может завершиться ошибкой
+  if (_vtime_timers >= _vtime_heap_size) {
+    uint32_t size = _vtime_heap_size > 0 ? _vtime_heap_size * 2 : 16;
+    shutter_vtimer_t** heap = (shutter_vtimer_t**)realloc(_vtime_heap, size * sizeof(shutter_vtimer_t*));
+    if (heap == nullptr) {
+      return false;
+    };
+    _vtime_heap = heap;
+    _vtime_heap_size = size;
+  };
+  shutter_vtimer_t* item = (shutter_vtimer_t*)calloc(1, sizeof(shutter_vtimer_t));
+  if (item == nullptr) {
+    return false;
+  };
+  item->cb = cb;
+  item->arg = arg;
+  item->index = -1;
+  _vtime_timers++;
+  *timer = item;
+  return true;
+}
+
+bool shutterPortTimerDelete(shutter_port_timer_t timer)
+{
+  if (timer == nullptr) {
+    return false;
+  };
+  if (timer->active) {
+    shutterVirtualTimeRemove(timer);
+  };
+  _vtime_timers--;
+  free(timer);
+  return true;
+}
+
+bool shutterPortTimerStart(shutter_port_timer_t timer, uint64_t timeout_us)
+{
+  // Как и esp_timer_start_once(), повторный запуск активного таймера является ошибкой
+  if ((timer == nullptr) || (timer->active)) {
+    return false;
+  };
+  timer->deadline = _vtime_now + (int64_t)timeout_us;
+  timer->order = _vtime_order++;
+  timer->active = true;
+  timer->index = _vtime_count;
+  _vtime_heap[_vtime_count++] = timer;
+  shutterVirtualTimeUp(timer->index);
+  return true;
+}
+
+bool shutterPortTimerStop(shutter_port_timer_t timer)
+{
+  if ((timer == nullptr) || (!timer->active)) {
+    return false;
+  };
+  shutterVirtualTimeRemove(timer);
+  return true;
+}
+
+bool shutterPortTimerIsActive(shutter_port_timer_t timer)
+{
+  return (timer != nullptr) && timer->active;
+}
+
+// Виртуальное время однопоточное, фоновой задачи нет
+bool shutterPortDefer(cb_shutter_port_timer_t cb, void* arg)
+{
+  cb(arg);
+  return true;
+}
+
+int64_t shutterPortTimeUs()
+{
+  return _vtime_now;
+}
+
+time_t shutterPortTime()
+{
+  return _vtime_wall + (time_t)(_vtime_now / 1000000);
+}
+
+// Виртуальное время однопоточное, блокировка не требуется
+void shutterPortEnterCritical()
+{
+}
+
+void shutterPortExitCritical()
+{
+}
+
+void shutterVirtualTimeReset(time_t wall_time)
+{
+  for (uint32_t i = 0; i < _vtime_count; i++) {
+    _vtime_heap[i]->active = false;
+    _vtime_heap[i]->index = -1;
+  };
+  _vtime_count = 0;
+  _vtime_now = 0;
+  _vtime_wall = wall_time;
+  _vtime_order = 0;
+}
+
+int64_t shutterVirtualTimeNext()
+{
+  return _vtime_count > 0 ? _vtime_heap[0]->deadline : -1;
+}
+
+uint32_t shutterVirtualTimeAdvance(uint64_t delta_us)
+{
+  uint32_t ret = 0;
+  int64_t target = _vtime_now + (int64_t)delta_us;
+  while ((_vtime_count > 0) && (_vtime_heap[0]->deadline <= target)) {
+    shutter_vtimer_t* first = _vtime_heap[0];
+    _vtime_now = first->deadline;
+    shutterVirtualTimeRemove(first);
+    if (first->cb) first->cb(first->arg);
+    ret++;
+  };
+  _vtime_now = target;
+  return ret;
+}
+
+#endif // CONFIG_SHUTTER_PORT_VIRTUAL
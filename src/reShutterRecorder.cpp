@@ -0,0 +1,283 @@
+#include "reShutterRecorder.h"
+#include <string.h>
+#include <stdlib.h>
+#include "rLog.h"
+
+#if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
+static const char* logTAG = "SHTR";
+#endif // CONFIG_RLOG_PROJECT_LEVEL
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- rShutterRecorder --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+rShutterRecorder::rShutterRecorder(uint32_t capacity)
+{
+  _capacity = capacity;
+  _count = 0;
+  _dropped = 0;
+  _last_us = 0;
+  _started = false;
+  _data = (uint8_t*)calloc(1, sizeof(shutter_rec_header_t) + (size_t)capacity * sizeof(shutter_rec_event_t));
+  if (_data == nullptr) {
+    rlog_e(logTAG, "Failed to allocate shutter recorder");
+    _capacity = 0;
+  };
+}
+
+rShutterRecorder::~rShutterRecorder()
+{
+  if (_data) free(_data);
+  _data = nullptr;
+}
+
+bool rShutterRecorder::begin(const shutter_rec_header_t* header)
+{
+  if (_data == nullptr) return false;
+  shutterPortEnterCritical();
+  memcpy(_data, header, sizeof(shutter_rec_header_t));
+  _count = 0;
+  _dropped = 0;
+  _last_us = shutterPortTimeUs();
+  _started = true;
+  shutterPortExitCritical();
+  return true;
+}
+
+bool rShutterRecorder::add(shutter_rec_type_t type, uint8_t flags, int8_t steps, uint8_t state, uint32_t value)
+{
+  bool ret = false;
+  shutterPortEnterCritical();
+  if (_started) {
+    int64_t now = shutterPortTimeUs();
+    uint64_t dt = now > _last_us ? (uint64_t)(now - _last_us) : 0;
+    // Длинная пауза записывается отдельным событием с количеством полных секунд
+    uint8_t need = dt > UINT32_MAX ? 2 : 1;
+    if (_count + need <= _capacity) {
+      shutter_rec_event_t* events = (shutter_rec_event_t*)(_data + sizeof(shutter_rec_header_t));
+      if (need > 1) {
+        shutter_rec_event_t* gap = &events[_count++];
+        memset(gap, 0, sizeof(shutter_rec_event_t));
+        gap->type = SHUTTER_REC_GAP;
+        gap->value = (uint32_t)(dt / 1000000);
+        dt = dt % 1000000;
+      };
+      shutter_rec_event_t* event = &events[_count++];
+      event->dt_us = (uint32_t)dt;
+      event->type = (uint8_t)type;
+      event->flags = flags;
+      event->steps = steps;
+      event->state = state;
+      event->value = value;
+      _last_us = now;
+      ret = true;
+    } else {
+      _dropped++;
+    };
+  };
+  shutterPortExitCritical();
+  return ret;
+}
+
+const uint8_t* rShutterRecorder::getData()
+{
+  return _data;
+}
+
+size_t rShutterRecorder::getSize()
+{
+  return _started ? sizeof(shutter_rec_header_t) + (size_t)_count * sizeof(shutter_rec_event_t) : 0;
+}
+
+uint32_t rShutterRecorder::getCount()
+{
+  return _count;
+}
+
+uint32_t rShutterRecorder::getDropped()
+{
+  return _dropped;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- rShutterRecordScope ------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+thread_local rShutterRecordScope* rShutterRecordScope::_top = nullptr;
+
+rShutterRecordScope::rShutterRecordScope(const void* owner)
+{
+  _owner = owner;
+  _prev = _top;
+  _top = this;
+}
+
+rShutterRecordScope::~rShutterRecordScope()
+{
+  _top = _prev;
+}
+
+bool rShutterRecordScope::isNested()
+{
+  for (rShutterRecordScope* item = _prev; item != nullptr; item = item->_prev) {
+    if (item->_owner == _owner) return true;
+  };
+  return false;
+}
+
+#if CONFIG_SHUTTER_PORT_VIRTUAL
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- rShutterReplayer --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+rShutterReplayer::rShutterReplayer(cb_shutter_replay_t cb_event, void* arg)
+{
+  _on_event = cb_event;
+  _on_event_arg = arg;
+  _events = 0;
+  _divergences = 0;
+  _position = 0.0;
+}
+
+uint32_t rShutterReplayer::getEvents()
+{
+  return _events;
+}
+
+uint32_t rShutterReplayer::getDivergences()
+{
+  return _divergences;
+}
+
+float rShutterReplayer::getPosition()
+{
+  return _position;
+}
+
+void rShutterReplayer::execute(rShutter* shutter, const shutter_rec_event_t* event)
+{
+  bool call_cb = event->flags & SHUTTER_REC_CALL_CB;
+  bool publish = event->flags & SHUTTER_REC_PUBLISH;
+  bool arg = event->flags & SHUTTER_REC_ARG;
+  float step;
+  switch (event->type) {
+    case SHUTTER_REC_CHANGE:
+      shutter->ChangeEx(event->steps, call_cb, publish);
+      break;
+    case SHUTTER_REC_MOVE_TO:
+      memcpy(&step, &event->value, sizeof(float));
+      shutter->MoveTo(step, publish);
+      break;
+    case SHUTTER_REC_OPEN_FULL:
+      shutter->OpenFull(publish);
+      break;
+    case SHUTTER_REC_CLOSE_FULL:
+      shutter->CloseFullEx(arg, call_cb, publish);
+      break;
+    case SHUTTER_REC_BREAK:
+      shutter->Break();
+      break;
+    case SHUTTER_REC_LIMIT:
+      shutter->limitReached(arg);
+      break;
+    case SHUTTER_REC_MIN_LIMIT:
+      shutter->setMinLimit((uint8_t)event->value, publish);
+      break;
+    case SHUTTER_REC_MAX_LIMIT:
+      shutter->setMaxLimit((uint8_t)event->value, publish);
+      break;
+    case SHUTTER_REC_CALIB_START:
+      shutter->calibrationStart();
+      break;
+    case SHUTTER_REC_CALIB_STOP:
+      shutter->calibrationStop();
+      break;
+    case SHUTTER_REC_REHOME:
+      shutter->rehomeNow();
+      break;
+    default:
+      // SHUTTER_REC_TIMER: таймер модели срабатывает сам, событие используется только для сверки
+      break;
+  };
+}
+
+bool rShutterReplayer::run(const uint8_t* data, size_t size)
+{
+  _events = 0;
+  _divergences = 0;
+  if ((data == nullptr) || (size < sizeof(shutter_rec_header_t))
+   || ((size - sizeof(shutter_rec_header_t)) % sizeof(shutter_rec_event_t) != 0)) {
+    rlog_e(logTAG, "Invalid shutter log size");
+    return false;
+  };
+  shutter_rec_header_t header;
+  memcpy(&header, data, sizeof(shutter_rec_header_t));
+  if ((header.magic != SHUTTER_REC_MAGIC) || (header.version != SHUTTER_REC_VERSION)) {
+    rlog_e(logTAG, "Invalid shutter log header");
+    return false;
+  };
+
+  // Модель привода с параметрами и состоянием на момент начала записи
+  rVirtualShutter shutter(0, true, 1, true, header.min_steps, header.max_steps,
+    header.full_time, header.step_time, header.step_time_adj, header.step_time_fin, nullptr, nullptr, nullptr);
+  if (!shutter.Init()) {
+    return false;
+  };
+  shutter._state = header.state;
+  shutter._travel = header.travel;
+  shutter._limit_min = header.limit_min;
+  shutter._limit_max = header.limit_max;
+  shutter._homed = header.homed;
+  shutter._drift = header.drift;
+  shutter._rehome_threshold = header.rehome_threshold;
+  shutter.setRetarget(header.flags & SHUTTER_REC_RETARGET, header.dead_time);
+  if (header.flags & SHUTTER_REC_CALIBRATE) {
+    shutter.calibrationStart();
+  };
+  shutter.snapshotUpdate();
+
+  const shutter_rec_event_t* events = (const shutter_rec_event_t*)(data + sizeof(shutter_rec_header_t));
+  uint32_t count = (size - sizeof(shutter_rec_header_t)) / sizeof(shutter_rec_event_t);
+  int64_t start = shutterPortTimeUs();
+  int64_t time = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    shutter_rec_event_t event;
+    memcpy(&event, &events[i], sizeof(shutter_rec_event_t));
+    if (event.type == SHUTTER_REC_GAP) {
+      time = time + (int64_t)event.value * 1000000;
+      continue;
+    };
+    time = time + event.dt_us;
+    // Таймер модели срабатывает в тот же момент, что и записанный таймер, поэтому состояние сверяется непосредственно 
+    // перед его срабатыванием (по окончании паузы перед сменой направления состояние изменяется)
+    int64_t check = event.type == SHUTTER_REC_TIMER ? time - 1 : time;
+    int64_t now = shutterPortTimeUs() - start;
+    if (check > now) {
+      shutterVirtualTimeAdvance((uint64_t)(check - now));
+    };
+    bool diverged = shutter.getState() != event.state;
+    if (diverged) _divergences++;
+    now = shutterPortTimeUs() - start;
+    if (time > now) {
+      shutterVirtualTimeAdvance((uint64_t)(time - now));
+    };
+    _events++;
+    execute(&shutter, &event);
+    if (_on_event) _on_event(&shutter, &event, time, diverged, _on_event_arg);
+  };
+
+  // Дожидаемся окончания последнего перемещения
+  while (shutter.isBusy() && (shutterVirtualTimeNext() >= 0)) {
+    shutterVirtualTimeAdvance((uint64_t)(shutterVirtualTimeNext() - shutterPortTimeUs()));
+  };
+  _position = shutter.getPositionNow();
+  if (_divergences > 0) {
+    rlog_w(logTAG, "Shutter log replayed: %d events, %d divergences", _events, _divergences);
+  } else {
+    rlog_i(logTAG, "Shutter log replayed: %d events", _events);
+  };
+  return true;
+}
+
+#endif // CONFIG_SHUTTER_PORT_VIRTUAL
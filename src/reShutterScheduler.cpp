@@ -0,0 +1,404 @@
+#include "reShutterScheduler.h"
+#include <string.h>
+#include <stdlib.h>
+#include "rLog.h"
+
+#if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
+static const char* logTAG = "SHTR";
+#endif // CONFIG_RLOG_PROJECT_LEVEL
+
+static void shutterSchedulerTimer(void* arg)
+{
+  if (arg) {
+    rShutterScheduler* scheduler = (rShutterScheduler*)arg;
+    scheduler->DoTimer();
+  };
+}
+
+static bool shutterSchedulerTimeValid(time_t now)
+{
+  return now > CONFIG_SHUTTER_SCHEDULER_TIME_VALID;
+}
+
+rShutterScheduler::rShutterScheduler(uint16_t capacity, cb_shutter_sched_t cb_done)
+{
+  _capacity = capacity;
+  _count = 0;
+  _heap_count = 0;
+  _timer = nullptr;
+  _on_done = cb_done;
+  _items = (shutter_sched_item_t*)calloc(capacity, sizeof(shutter_sched_item_t));
+  _heap = (uint16_t*)calloc(capacity, sizeof(uint16_t));
+  if ((_items == nullptr) || (_heap == nullptr)) {
+    rlog_e(logTAG, "Failed to allocate shutter scheduler");
+    _capacity = 0;
+  };
+}
+
+rShutterScheduler::~rShutterScheduler()
+{
+  if (_timer != nullptr) {
+    shutterTimerDelete(_timer);
+    _timer = nullptr;
+  };
+  if (_items) free(_items);
+  _items = nullptr;
+  if (_heap) free(_heap);
+  _heap = nullptr;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Куча сроков -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+void rShutterScheduler::heapSwap(uint16_t a, uint16_t b)
+{
+  uint16_t tmp = _heap[a];
+  _heap[a] = _heap[b];
+  _heap[b] = tmp;
+  _items[_heap[a]].index = a;
+  _items[_heap[b]].index = b;
+}
+
+void rShutterScheduler::heapUp(uint16_t i)
+{
+  while (i > 0) {
+    uint16_t parent = (i - 1) / 2;
+    if (_items[_heap[parent]].next <= _items[_heap[i]].next) break;
+    heapSwap(parent, i);
+    i = parent;
+  };
+}
+
+void rShutterScheduler::heapDown(uint16_t i)
+{
+  while (true) {
+    uint16_t left = 2 * i + 1;
+    uint16_t right = left + 1;
+    uint16_t min = i;
+    if ((left < _heap_count) && (_items[_heap[left]].next < _items[_heap[min]].next)) min = left;
+    if ((right < _heap_count) && (_items[_heap[right]].next < _items[_heap[min]].next)) min = right;
+    if (min == i) break;
+    heapSwap(min, i);
+    i = min;
+  };
+}
+
+void rShutterScheduler::heapPush(shutter_sched_item_t* item)
+{
+  item->index = _heap_count;
+  _heap[_heap_count++] = (uint16_t)(item - _items);
+  heapUp(item->index);
+}
+
+void rShutterScheduler::heapRemove(uint16_t i)
+{
+  shutter_sched_item_t* item = &_items[_heap[i]];
+  _heap_count--;
+  if (i != _heap_count) {
+    uint16_t moved = _heap[_heap_count];
+    _heap[i] = moved;
+    _items[moved].index = i;
+    heapUp(i);
+    heapDown(_items[moved].index);
+  };
+  item->index = -1;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- Сроки ---------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Ближайший срок строго после now; 0 - срок не может быть определен (время не установлено или задание уже выполнено).
+// localtime_r() и mktime() захватывают блокировки библиотеки, поэтому вызывается только вне критической секции
+time_t rShutterScheduler::calcNext(const shutter_sched_item_t* item, time_t now)
+{
+  if (!shutterSchedulerTimeValid(now)) return 0;
+  if (item->kind == SHUTTER_SCHED_ONCE) {
+    return item->time;
+  };
+  struct tm today;
+  localtime_r(&now, &today);
+  // mktime() нормализует дату и учитывает переход на летнее время
+  for (uint8_t day = 0; day < 8; day++) {
+    struct tm ti = today;
+    ti.tm_mday = today.tm_mday + day;
+    ti.tm_hour = item->minutes / 60;
+    ti.tm_min = item->minutes % 60;
+    ti.tm_sec = 0;
+    ti.tm_isdst = -1;
+    time_t ret = mktime(&ti);
+    if ((ret > now) && (item->weekdays & (1 << ti.tm_wday))) {
+      return ret;
+    };
+  };
+  return 0;
+}
+
+// Вызывается в критической секции
+void rShutterScheduler::schedule(shutter_sched_item_t* item, time_t next)
+{
+  if (item->index >= 0) {
+    heapRemove(item->index);
+  };
+  item->next = next;
+  if (item->next > 0) {
+    heapPush(item);
+  };
+}
+
+// Срок вычисляется по копии задания вне критической секции; если за это время задание было удалено или заменено
+// другим, срок отбрасывается
+void rShutterScheduler::reschedule(int16_t id, time_t now)
+{
+  shutterPortEnterCritical();
+  if (!_items[id].used) {
+    shutterPortExitCritical();
+    return;
+  };
+  shutter_sched_item_t item = _items[id];
+  shutterPortExitCritical();
+
+  time_t next = calcNext(&item, now);
+
+  shutterPortEnterCritical();
+  if (_items[id].used && (_items[id].shutter == item.shutter) && (_items[id].kind == item.kind)
+   && (_items[id].time == item.time) && (_items[id].minutes == item.minutes) && (_items[id].weekdays == item.weekdays)) {
+    schedule(&_items[id], next);
+  };
+  shutterPortExitCritical();
+}
+
+// Таймер всегда запускается заново: сроки заданы по календарю и могут сдвинуться при переводе часов
+void rShutterScheduler::rearm()
+{
+  if (_timer == nullptr) return;
+  time_t now = shutterPortTime();
+  shutterPortEnterCritical();
+  bool waiting = _heap_count < _count;
+  time_t next = _heap_count > 0 ? _items[_heap[0]].next : 0;
+  shutterPortExitCritical();
+
+  if (shutterTimerIsActive(_timer)) {
+    shutterTimerStop(_timer);
+  };
+  if ((next > 0) || waiting) {
+    int64_t timeout = CONFIG_SHUTTER_SCHEDULER_MAX_SLEEP;
+    if ((next > 0) && (next - now < timeout)) {
+      timeout = next > now ? next - now : 0;
+    };
+    if (!shutterTimerStart(_timer, (uint64_t)timeout * 1000000)) {
+      rlog_e(logTAG, "Failed to start scheduler timer");
+    };
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Задания --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+int16_t rShutterScheduler::add(rShutter* shutter, shutter_sched_kind_t kind, shutter_sched_target_t target, float value, bool publish)
+{
+  if ((shutter == nullptr) || (_items == nullptr)) return -1;
+  if (_timer == nullptr) {
+    if (!shutterTimerCreate(&_timer, "scheduler", shutterSchedulerTimer, this)) {
+      rlog_e(logTAG, "Failed to create scheduler timer");
+      return -1;
+    };
+  };
+  int16_t id = -1;
+  shutterPortEnterCritical();
+  for (uint16_t i = 0; i < _capacity; i++) {
+    if (!_items[i].used) {
+      memset(&_items[i], 0, sizeof(shutter_sched_item_t));
+      _items[i].used = true;
+      _items[i].shutter = shutter;
+      _items[i].kind = kind;
+      _items[i].target = target;
+      _items[i].value = value;
+      _items[i].publish = publish;
+      _items[i].limit_min = SHUTTER_SCHED_NO_LIMIT;
+      _items[i].limit_max = SHUTTER_SCHED_NO_LIMIT;
+      _items[i].index = -1;
+      _count++;
+      id = i;
+      break;
+    };
+  };
+  shutterPortExitCritical();
+  if (id < 0) {
+    rlog_e(logTAG, "Failed to add scheduler entry: no free slots");
+  };
+  return id;
+}
+
+int16_t rShutterScheduler::addOnce(rShutter* shutter, time_t time, shutter_sched_target_t target, float value, bool publish)
+{
+  int16_t id = add(shutter, SHUTTER_SCHED_ONCE, target, value, publish);
+  if (id >= 0) {
+    shutterPortEnterCritical();
+    _items[id].time = time;
+    shutterPortExitCritical();
+    reschedule(id, shutterPortTime());
+    rearm();
+  };
+  return id;
+}
+
+int16_t rShutterScheduler::addDaily(rShutter* shutter, uint8_t hour, uint8_t minute, uint8_t weekdays, shutter_sched_target_t target, float value, bool publish)
+{
+  if ((hour > 23) || (minute > 59)) return -1;
+  int16_t id = add(shutter, SHUTTER_SCHED_DAILY, target, value, publish);
+  if (id >= 0) {
+    shutterPortEnterCritical();
+    _items[id].minutes = hour * 60 + minute;
+    _items[id].weekdays = (weekdays & SHUTTER_SCHED_EVERY_DAY) ? (weekdays & SHUTTER_SCHED_EVERY_DAY) : SHUTTER_SCHED_EVERY_DAY;
+    shutterPortExitCritical();
+    reschedule(id, shutterPortTime());
+    rearm();
+  };
+  return id;
+}
+
+bool rShutterScheduler::setLimits(int16_t id, int8_t limit_min, int8_t limit_max)
+{
+  if ((id < 0) || (id >= _capacity) || !_items[id].used) return false;
+  _items[id].limit_min = limit_min;
+  _items[id].limit_max = limit_max;
+  return true;
+}
+
+bool rShutterScheduler::remove(int16_t id)
+{
+  if ((id < 0) || (id >= _capacity)) return false;
+  bool ret = false;
+  shutterPortEnterCritical();
+  if (_items[id].used) {
+    if (_items[id].index >= 0) {
+      heapRemove(_items[id].index);
+    };
+    _items[id].used = false;
+    _count--;
+    ret = true;
+  };
+  shutterPortExitCritical();
+  if (ret) rearm();
+  return ret;
+}
+
+uint16_t rShutterScheduler::removeAll(rShutter* shutter)
+{
+  uint16_t ret = 0;
+  for (uint16_t i = 0; i < _capacity; i++) {
+    if (_items[i].used && (_items[i].shutter == shutter) && remove(i)) {
+      ret++;
+    };
+  };
+  return ret;
+}
+
+void rShutterScheduler::resync()
+{
+  time_t now = shutterPortTime();
+  for (uint16_t i = 0; i < _capacity; i++) {
+    reschedule(i, now);
+  };
+  rearm();
+}
+
+uint16_t rShutterScheduler::getCount()
+{
+  return _count;
+}
+
+time_t rShutterScheduler::getNext()
+{
+  shutterPortEnterCritical();
+  time_t ret = _heap_count > 0 ? _items[_heap[0]].next : 0;
+  shutterPortExitCritical();
+  return ret;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Выполнение ------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+bool rShutterScheduler::execute(shutter_sched_item_t* item)
+{
+  rShutter* shutter = item->shutter;
+  // Ограничения публикуются вместе с результатом команды, отдельная публикация нужна только для SHUTTER_SCHED_LIMITS
+  bool publish_limits = item->publish && (item->target == SHUTTER_SCHED_LIMITS);
+  if (item->limit_min == SHUTTER_SCHED_CLEAR) {
+    shutter->clearMinLimit(publish_limits);
+  } else if (item->limit_min >= 0) {
+    shutter->setMinLimit((uint8_t)item->limit_min, publish_limits);
+  };
+  if (item->limit_max == SHUTTER_SCHED_CLEAR) {
+    shutter->clearMaxLimit(publish_limits);
+  } else if (item->limit_max >= 0) {
+    shutter->setMaxLimit((uint8_t)item->limit_max, publish_limits);
+  };
+  switch (item->target) {
+    case SHUTTER_SCHED_STEP:
+      return shutter->MoveTo(item->value, item->publish);
+    case SHUTTER_SCHED_PERCENT:
+      return shutter->MoveToPercent(item->value, item->publish);
+    case SHUTTER_SCHED_OPEN:
+      return shutter->OpenFull(item->publish);
+    case SHUTTER_SCHED_CLOSE:
+      return shutter->CloseFull(false, item->publish);
+    default:
+      return true;
+  };
+}
+
+void rShutterScheduler::DoTimer()
+{
+  time_t now = shutterPortTime();
+  if (!shutterSchedulerTimeValid(now)) {
+    rearm();
+    return;
+  };
+  // Часы были установлены после добавления заданий - планируем отложенные
+  if (_heap_count < _count) {
+    resync();
+  };
+
+  // Задания извлекаются по одному: команда привода выполняется вне критической секции и может сама изменить расписание
+  while (true) {
+    shutterPortEnterCritical();
+    if ((_heap_count == 0) || (_items[_heap[0]].next > now)) {
+      shutterPortExitCritical();
+      break;
+    };
+    int16_t id = _heap[0];
+    shutter_sched_item_t* item = &_items[id];
+    time_t due = item->next;
+    heapRemove(0);
+    shutter_sched_item_t job = *item;
+    shutterPortExitCritical();
+
+    // Ежедневное задание планируется на следующий день до выполнения команды
+    if (job.kind == SHUTTER_SCHED_DAILY) {
+      reschedule(id, now);
+    };
+
+    if ((job.kind == SHUTTER_SCHED_DAILY) && (now - due > CONFIG_SHUTTER_SCHEDULER_GRACE)) {
+      rlog_w(logTAG, "Scheduler entry %d is %d seconds late, skipped", id, (int)(now - due));
+      continue;
+    };
+    rlog_i(logTAG, "Scheduler entry %d started", id);
+    bool result = execute(&job);
+    if (job.kind == SHUTTER_SCHED_ONCE) {
+      shutterPortEnterCritical();
+      if (item->used && (item->index < 0)) {
+        item->used = false;
+        _count--;
+      };
+      shutterPortExitCritical();
+    };
+    if (_on_done) _on_done(this, id, job.shutter, result);
+  };
+
+  rearm();
+}
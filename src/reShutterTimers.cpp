@@ -0,0 +1,309 @@
+#include "reShutterTimers.h"
+#include <string.h>
+#include "rLog.h"
+
+#if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
+static const char* logTAG = "SHTR";
+#endif // CONFIG_RLOG_PROJECT_LEVEL
+
+// Неудачные попытки создания таймеров: без таймера часть функций приводов молча перестает работать
+static uint32_t _st_errors = 0;
+
+static void shutterTimerError(const char* name)
+{
+  shutterPortEnterCritical();
+  _st_errors++;
+  shutterPortExitCritical();
+  rlog_e(logTAG, "Failed to create timer \"%s\"", name);
+  (void)name;
+}
+
+uint32_t shutterTimerGetErrors()
+{
+  return _st_errors;
+}
+
+#if CONFIG_SHUTTER_SHARED_TIMER
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Общий таймер ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+typedef struct shutter_timer_t {
+  cb_shutter_port_timer_t cb;
+  void* arg;
+  int64_t deadline;
+  int16_t index;          // Позиция в куче или -1, если таймер не запущен
+  uint32_t gen;           // Поколение: увеличивается при каждом запуске, остановке и удалении таймера
+  bool used;
+} shutter_timer_t;
+
+typedef struct {
+  shutter_timer_t* timer;
+  uint32_t gen;
+} shutter_timer_fired_t;
+
+static shutter_timer_t _st_slots[CONFIG_SHUTTER_SHARED_TIMER_SLOTS];
+static shutter_timer_t* _st_heap[CONFIG_SHUTTER_SHARED_TIMER_SLOTS];
+static shutter_timer_fired_t _st_batch[CONFIG_SHUTTER_SHARED_TIMER_SLOTS];
+static uint16_t _st_count = 0;
+static shutter_port_timer_t _st_hw = nullptr;
+static bool _st_rearm_busy = false;
+static bool _st_rearm_pending = false;
+static cb_shutter_port_timer_t _st_batch_begin = nullptr;
+static cb_shutter_port_timer_t _st_batch_end = nullptr;
+static void* _st_batch_arg = nullptr;
+
+static void shutterHeapSwap(uint16_t a, uint16_t b)
+{
+  shutter_timer_t* tmp = _st_heap[a];
+  _st_heap[a] = _st_heap[b];
+  _st_heap[b] = tmp;
+  _st_heap[a]->index = a;
+  _st_heap[b]->index = b;
+}
+
+static void shutterHeapUp(uint16_t i)
+{
+  while (i > 0) {
+    uint16_t parent = (i - 1) / 2;
+    if (_st_heap[parent]->deadline <= _st_heap[i]->deadline) break;
+    shutterHeapSwap(parent, i);
+    i = parent;
+  };
+}
+
+static void shutterHeapDown(uint16_t i)
+{
+  while (true) {
+    uint16_t left = 2 * i + 1;
+    uint16_t right = left + 1;
+    uint16_t min = i;
+    if ((left < _st_count) && (_st_heap[left]->deadline < _st_heap[min]->deadline)) min = left;
+    if ((right < _st_count) && (_st_heap[right]->deadline < _st_heap[min]->deadline)) min = right;
+    if (min == i) break;
+    shutterHeapSwap(min, i);
+    i = min;
+  };
+}
+
+static void shutterHeapRemove(uint16_t i)
+{
+  shutter_timer_t* item = _st_heap[i];
+  _st_count--;
+  if (i != _st_count) {
+    shutter_timer_t* moved = _st_heap[_st_count];
+    _st_heap[i] = moved;
+    moved->index = i;
+    shutterHeapUp(i);
+    shutterHeapDown(moved->index);
+  };
+  item->index = -1;
+}
+
+// Перезапуск аппаратного таймера на ближайший срок. Если перезапуск уже выполняется в другой задаче, она повторит его
+// с актуальным сроком, поэтому аппаратный таймер никогда не остается настроенным на устаревший (более поздний) срок
+static void shutterTimersRearm()
+{
+  shutterPortEnterCritical();
+  _st_rearm_pending = true;
+  if (_st_rearm_busy) {
+    shutterPortExitCritical();
+    return;
+  };
+  _st_rearm_busy = true;
+  while (_st_rearm_pending) {
+    _st_rearm_pending = false;
+    int64_t deadline = _st_count > 0 ? _st_heap[0]->deadline : -1;
+    shutterPortExitCritical();
+    if (shutterPortTimerIsActive(_st_hw)) {
+      shutterPortTimerStop(_st_hw);
+    };
+    if (deadline >= 0) {
+      int64_t timeout = deadline - shutterPortTimeUs();
+      if (timeout < 0) timeout = 0;
+      shutterPortTimerStart(_st_hw, (uint64_t)timeout);
+    };
+    shutterPortEnterCritical();
+  };
+  _st_rearm_busy = false;
+  shutterPortExitCritical();
+}
+
+// Таймер из пакета не был перезапущен, остановлен или удален после извлечения из кучи (например, callback-ом другого
+// таймера того же пакета) - иначе его callback вызывать нельзя
+static bool shutterTimerFired(shutter_timer_fired_t* fired)
+{
+  shutterPortEnterCritical();
+  bool ret = fired->timer->used && (fired->timer->index < 0) && (fired->timer->gen == fired->gen);
+  shutterPortExitCritical();
+  return ret;
+}
+
+// Обработка всех таймеров, срок которых наступил в пределах текущего тика, одним пакетом
+static void shutterTimersExpired(void* arg)
+{
+  (void)arg;
+  uint16_t count = 0;
+  shutterPortEnterCritical();
+  int64_t limit = shutterPortTimeUs() + CONFIG_SHUTTER_SHARED_TIMER_TICK;
+  while ((_st_count > 0) && (_st_heap[0]->deadline <= limit)) {
+    _st_batch[count].timer = _st_heap[0];
+    _st_batch[count].gen = _st_heap[0]->gen;
+    count++;
+    shutterHeapRemove(0);
+  };
+  shutterPortExitCritical();
+
+  if (count > 0) {
+    if (_st_batch_begin) _st_batch_begin(_st_batch_arg);
+    for (uint16_t i = 0; i < count; i++) {
+      if (shutterTimerFired(&_st_batch[i]) && _st_batch[i].timer->cb) {
+        _st_batch[i].timer->cb(_st_batch[i].timer->arg);
+      };
+    };
+    if (_st_batch_end) _st_batch_end(_st_batch_arg);
+  };
+
+  shutterTimersRearm();
+}
+
+bool shutterTimerCreate(shutter_timer_handle_t* timer, const char* name, cb_shutter_port_timer_t cb, void* arg)
+{
+  if (_st_hw == nullptr) {
+    if (!shutterPortTimerCreate(&_st_hw, "shutters", shutterTimersExpired, nullptr)) {
+      shutterTimerError(name);
+      return false;
+    };
+  };
+  shutter_timer_t* item = nullptr;
+  shutterPortEnterCritical();
+  for (uint16_t i = 0; i < CONFIG_SHUTTER_SHARED_TIMER_SLOTS; i++) {
+    if (!_st_slots[i].used) {
+      item = &_st_slots[i];
+      item->used = true;
+      item->cb = cb;
+      item->arg = arg;
+      item->deadline = 0;
+      item->index = -1;
+      break;
+    };
+  };
+  shutterPortExitCritical();
+  if (item == nullptr) {
+    rlog_e(logTAG, "No free slots in shared timer, increase CONFIG_SHUTTER_SHARED_TIMER_SLOTS (%d)", CONFIG_SHUTTER_SHARED_TIMER_SLOTS);
+    shutterTimerError(name);
+    return false;
+  };
+  *timer = item;
+  return true;
+}
+
+bool shutterTimerDelete(shutter_timer_handle_t timer)
+{
+  if (timer == nullptr) return false;
+  shutterPortEnterCritical();
+  if (timer->index >= 0) {
+    shutterHeapRemove(timer->index);
+  };
+  timer->gen++;
+  timer->used = false;
+  shutterPortExitCritical();
+  return true;
+}
+
+bool shutterTimerStart(shutter_timer_handle_t timer, uint64_t timeout_us)
+{
+  if (timer == nullptr) return false;
+  shutterPortEnterCritical();
+  // Как и esp_timer_start_once(), повторный запуск активного таймера является ошибкой
+  if (timer->index >= 0) {
+    shutterPortExitCritical();
+    return false;
+  };
+  timer->deadline = shutterPortTimeUs() + (int64_t)timeout_us;
+  timer->gen++;
+  timer->index = _st_count;
+  _st_heap[_st_count++] = timer;
+  shutterHeapUp(timer->index);
+  bool first = (timer->index == 0);
+  shutterPortExitCritical();
+  // Аппаратный таймер перезапускается, только если новый срок стал ближайшим; остановка таймера его не перезапускает -
+  // холостое срабатывание просто перенастроит его на следующий срок
+  if (first) {
+    shutterTimersRearm();
+  };
+  return true;
+}
+
+bool shutterTimerStop(shutter_timer_handle_t timer)
+{
+  if (timer == nullptr) return false;
+  bool ret = false;
+  shutterPortEnterCritical();
+  if (timer->index >= 0) {
+    shutterHeapRemove(timer->index);
+    ret = true;
+  };
+  timer->gen++;
+  shutterPortExitCritical();
+  return ret;
+}
+
+bool shutterTimerIsActive(shutter_timer_handle_t timer)
+{
+  return (timer != nullptr) && (timer->index >= 0);
+}
+
+void shutterTimerSetBatchHooks(cb_shutter_port_timer_t cb_begin, cb_shutter_port_timer_t cb_end, void* arg)
+{
+  _st_batch_begin = cb_begin;
+  _st_batch_end = cb_end;
+  _st_batch_arg = arg;
+}
+
+#else
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Отдельные таймеры ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+bool shutterTimerCreate(shutter_timer_handle_t* timer, const char* name, cb_shutter_port_timer_t cb, void* arg)
+{
+  if (!shutterPortTimerCreate(timer, name, cb, arg)) {
+    shutterTimerError(name);
+    return false;
+  };
+  return true;
+}
+
+bool shutterTimerDelete(shutter_timer_handle_t timer)
+{
+  if (shutterPortTimerIsActive(timer)) {
+    shutterPortTimerStop(timer);
+  };
+  return shutterPortTimerDelete(timer);
+}
+
+bool shutterTimerStart(shutter_timer_handle_t timer, uint64_t timeout_us)
+{
+  return shutterPortTimerStart(timer, timeout_us);
+}
+
+bool shutterTimerStop(shutter_timer_handle_t timer)
+{
+  return shutterPortTimerStop(timer);
+}
+
+bool shutterTimerIsActive(shutter_timer_handle_t timer)
+{
+  return shutterPortTimerIsActive(timer);
+}
+
+// Каждый таймер срабатывает отдельно, пакетной обработки нет
+void shutterTimerSetBatchHooks(cb_shutter_port_timer_t cb_begin, cb_shutter_port_timer_t cb_end, void* arg)
+{
+  (void)cb_begin; (void)cb_end; (void)arg;
+}
+
+#endif // CONFIG_SHUTTER_SHARED_TIMER
@@ -0,0 +1,506 @@
+/*
+   EN: Host tests of reShutter on the virtual-time port (virtual time, virtual GPIO)
+   RU: Тесты reShutter на ПК с виртуальным временем (виртуальное время, виртуальные GPIO)
+   --------------------------
+   (с) 2023-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+   --------------------------
+   Страница проекта: https://github.com/kotyara12/reShutter
+*/
+
+// Сборка (Linux): нужны заголовочные файлы зависимостей библиотеки (rLog.h, rStrings.h, reEsp32.h, reEvents.h,
+// reMqtt.h, def_consts.h, project_config.h) - из соответствующих библиотек или их заглушки для ПК:
+//
+//   g++ -std=gnu++17 -I include -I <каталог зависимостей> test/shutter_test.cpp src/*.cpp -o shutter_test
+//   ./shutter_test
+//
+// Тесты стоит запускать и с общим таймером (-DCONFIG_SHUTTER_SHARED_TIMER=1). Время полностью виртуальное, поэтому
+// результаты детерминированы и не зависят от загрузки машины. Программа возвращает 0, если все проверки выполнены.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "reShutter.h"
+#include "reShutterGroup.h"
+#include "reShutterJournal.h"
+#include "reShutterScheduler.h"
+
+static uint32_t _checks = 0;
+static uint32_t _failed = 0;
+
+#define CHECK(cond) do { \
+  _checks++; \
+  if (!(cond)) { \
+    _failed++; \
+    printf("  FAILED line %d: %s\n", __LINE__, #cond); \
+  }; \
+} while (0)
+
+#define CHECK_NEAR(value, expected) CHECK(((value) > (expected) - 0.01) && ((value) < (expected) + 0.01))
+
+// Время в миллисекундах для удобства записи ожидаемых значений
+static void advance(uint32_t ms)
+{
+  shutterVirtualTimeAdvance((uint64_t)ms * 1000);
+}
+
+static int64_t nowMs()
+{
+  return shutterPortTimeUs() / 1000;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------- Журнал включения выходов ----------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+typedef struct {
+  int64_t time;
+  uint8_t pin;
+  bool state;
+} relay_event_t;
+
+#define RELAY_EVENTS 32
+
+static relay_event_t _events[RELAY_EVENTS];
+static uint8_t _events_count = 0;
+
+static void relayReset()
+{
+  _events_count = 0;
+}
+
+static void relayEvent(rShutter* shutter, uint8_t pin, bool state)
+{
+  (void)shutter;
+  if (_events_count < RELAY_EVENTS) {
+    _events[_events_count].time = nowMs();
+    _events[_events_count].pin = pin;
+    _events[_events_count].state = state;
+    _events_count++;
+  };
+}
+
+// Момент n-го включения или отключения выхода или -1, если такого события не было
+static int64_t relayTime(uint8_t pin, bool state, uint8_t n = 0)
+{
+  for (uint8_t i = 0; i < _events_count; i++) {
+    if ((_events[i].pin == pin) && (_events[i].state == state)) {
+      if (n == 0) return _events[i].time;
+      n--;
+    };
+  };
+  return -1;
+}
+
+static uint8_t relayStarts()
+{
+  uint8_t ret = 0;
+  for (uint8_t i = 0; i < _events_count; i++) {
+    if (_events[i].state) ret++;
+  };
+  return ret;
+}
+
+// Привод по умолчанию: 10 шагов по 1 секунде, выход 1 - открытие, выход 2 - закрытие
+#define TEST_SHUTTER(name) rVirtualShutter name(1, true, 2, true, 0, 10, 15000, 1000, 1.0f, 0, relayEvent, nullptr, nullptr)
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------- Смена цели и пауза перед реверсом -----------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static void testRetarget()
+{
+  printf("retarget and dead time\n");
+
+  // Цель в том же направлении: оставшееся время изменяется без повторного включения двигателя
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    TEST_SHUTTER(s);
+    s.Init();
+    s.setRetarget(true, 1000);
+    s.MoveTo(8, false);
+    advance(3000);
+    CHECK(s.MoveTo(9, false));
+    advance(20000);
+    CHECK(relayStarts() == 1);
+    CHECK(relayTime(1, false) == 9000);
+    CHECK(s.getState() == 9);
+  }
+
+  // Цель в обратном направлении: остановка, пауза dead_time и перемещение из фактически достигнутого положения
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    TEST_SHUTTER(s);
+    s.Init();
+    s.setRetarget(true, 1000);
+    s.MoveTo(8, false);
+    advance(3000);
+    CHECK(s.MoveTo(1, false));
+    advance(20000);
+    CHECK(relayTime(1, false) == 3000);
+    CHECK(relayTime(2, true) == 4000);
+    CHECK(relayTime(2, false) == 6000);
+    CHECK(s.getState() == 1);
+    CHECK(!s.isBusy());
+  }
+
+  // Событие концевого выключателя во время паузы уточняет положение, но не сокращает паузу
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    TEST_SHUTTER(s);
+    s.Init();
+    s.setRetarget(true, 1000);
+    s.MoveTo(8, false);
+    advance(3000);
+    s.MoveTo(1, false);
+    advance(100);
+    s.limitReached(true);
+    advance(20000);
+    CHECK(relayTime(1, false) == 3000);
+    CHECK(relayTime(2, true) == 4000);
+    CHECK(relayTime(2, false) == 13000);
+    CHECK(s.getState() == 1);
+  }
+
+  // Относительная команда отсчитывается от дробной цели одинаково во время перемещения и после остановки
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    TEST_SHUTTER(s);
+    s.Init();
+    s.setRetarget(true, 0);
+    s.MoveTo(2.5, false);
+    advance(1000);
+    s.Change(1, false);
+    advance(20000);
+    CHECK_NEAR(s.getPositionNow(), 3.5);
+    s.MoveTo(2.5, false);
+    advance(20000);
+    s.Change(1, false);
+    advance(20000);
+    CHECK_NEAR(s.getPositionNow(), 3.5);
+  }
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Очередь команд -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static void testQueue()
+{
+  printf("command queue\n");
+
+  // Относительные перемещения объединяются в одно
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    TEST_SHUTTER(s);
+    s.Init();
+    s.MoveTo(5, false);
+    advance(1000);
+    CHECK(s.Change(1, false));
+    CHECK(s.Change(2, false));
+    CHECK(s.getQueued() == 1);
+    advance(20000);
+    CHECK(s.getState() == 8);
+    CHECK(relayStarts() == 2);
+  }
+
+  // Абсолютная команда отменяет предшествующие относительные, для нескольких абсолютных действует последняя цель
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    TEST_SHUTTER(s);
+    s.Init();
+    s.MoveTo(2, false);
+    advance(500);
+    s.MoveTo(4, false);
+    s.Change(1, false);
+    CHECK(s.getQueued() == 2);
+    s.MoveTo(6, false);
+    CHECK(s.getQueued() == 1);
+    advance(20000);
+    CHECK(s.getState() == 6);
+    CHECK(relayStarts() == 2);
+  }
+
+  // Полное закрытие имеет приоритет: прерывает текущее перемещение и отменяет очередь
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    TEST_SHUTTER(s);
+    s.Init();
+    s.MoveTo(5, false);
+    advance(2000);
+    s.Change(2, false);
+    s.MoveTo(9, false);
+    CHECK(s.getQueued() == 1);
+    CHECK(s.CloseFull(true, false));
+    CHECK(s.getQueued() == 0);
+    CHECK(relayTime(1, false) == 2000);
+    CHECK(relayTime(2, true) == 2000);
+    advance(20000);
+    CHECK(relayTime(2, false) == 17000);
+    CHECK(s.getState() == 0);
+    CHECK(s.isHomed());
+  }
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------------- Группы -------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static uint8_t _group_done = 0;
+
+static void groupDone(rShutterGroup* group)
+{
+  (void)group;
+  _group_done++;
+}
+
+static void testGroup()
+{
+  printf("group and stagger\n");
+
+  // Между включениями двигателей выдерживается интервал, о завершении группы сообщается один раз
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    _group_done = 0;
+    rVirtualShutter a(1, true, 2, true, 0, 10, 15000, 1000, 1.0f, 0, relayEvent, nullptr, nullptr);
+    rVirtualShutter b(3, true, 4, true, 0, 10, 15000, 1000, 1.0f, 0, relayEvent, nullptr, nullptr);
+    a.Init();
+    b.Init();
+    rShutterGroup g(2, 0, groupDone);
+    g.add(&a);
+    g.add(&b);
+    CHECK(g.setStagger(5000));
+    CHECK(g.MoveTo(3, false));
+    advance(30000);
+    CHECK(relayTime(1, true) == 0);
+    CHECK(relayTime(3, true) == 5000);
+    CHECK(a.getState() == 3);
+    CHECK(b.getState() == 3);
+    CHECK(!g.isBusy());
+    CHECK(_group_done == 1);
+  }
+
+  // Не более одного двигателя одновременно: второй привод запускается после остановки первого
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    _group_done = 0;
+    rVirtualShutter a(1, true, 2, true, 0, 10, 15000, 1000, 1.0f, 0, relayEvent, nullptr, nullptr);
+    rVirtualShutter b(3, true, 4, true, 0, 10, 15000, 1000, 1.0f, 0, relayEvent, nullptr, nullptr);
+    a.Init();
+    b.Init();
+    rShutterGroup g(2, 1, groupDone);
+    g.add(&a);
+    g.add(&b);
+    CHECK(g.MoveTo(2, false));
+    advance(30000);
+    CHECK(relayTime(1, true) == 0);
+    CHECK(relayTime(3, true) == relayTime(1, false));
+    CHECK(_group_done == 1);
+  }
+
+  // Break() во время ожидания интервала завершает операцию, и группа снова принимает команды
+  {
+    shutterVirtualTimeReset(1700000000);
+    relayReset();
+    _group_done = 0;
+    rVirtualShutter a(1, true, 2, true, 0, 10, 15000, 1000, 1.0f, 0, relayEvent, nullptr, nullptr);
+    rVirtualShutter b(3, true, 4, true, 0, 10, 15000, 1000, 1.0f, 0, relayEvent, nullptr, nullptr);
+    a.Init();
+    b.Init();
+    rShutterGroup g(2, 0, groupDone);
+    g.add(&a);
+    g.add(&b);
+    g.setStagger(5000);
+    CHECK(g.MoveTo(1, false));
+    advance(1000);
+    g.Break();
+    CHECK(!g.isBusy());
+    CHECK(_group_done == 1);
+    advance(10000);
+    CHECK(relayTime(3, true) == -1);
+    CHECK(g.MoveTo(2, false));
+    advance(30000);
+    CHECK(!g.isBusy());
+    CHECK(_group_done == 2);
+    CHECK(a.getState() == 2);
+    CHECK(b.getState() == 2);
+  }
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Журнал положения -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#define TEST_JOURNAL      "shutter_test_journal.bin"
+#define TEST_JOURNAL_COPY "shutter_test_journal_copy.bin"
+
+static bool fileCopy(const char* from, const char* to)
+{
+  FILE* src = fopen(from, "rb");
+  if (src == nullptr) return false;
+  FILE* dst = fopen(to, "wb");
+  if (dst == nullptr) {
+    fclose(src);
+    return false;
+  };
+  char buf[256];
+  size_t size;
+  while ((size = fread(buf, 1, sizeof(buf), src)) > 0) {
+    fwrite(buf, 1, size, dst);
+  };
+  fclose(src);
+  fclose(dst);
+  return true;
+}
+
+static void testJournal()
+{
+  printf("journal restore\n");
+  remove(TEST_JOURNAL);
+  remove(TEST_JOURNAL_COPY);
+  shutterVirtualTimeReset(1700000000);
+
+  // Положение после штатной остановки
+  {
+    rShutterJournalFile j(TEST_JOURNAL, 4);
+    TEST_SHUTTER(s);
+    s.setJournal(&j);
+    s.Init();
+    for (int i = 0; i < 5; i++) {
+      s.MoveTo(3 + i, false);
+      advance(5000);
+    };
+    s.MoveToPercent(45, false);
+    advance(5000);
+    CHECK(s.getState() == 5);
+  }
+
+  // Восстанавливается без установки в начальное положение; затем журнал копируется посреди перемещения
+  {
+    rShutterJournalFile j(TEST_JOURNAL, 4);
+    TEST_SHUTTER(s);
+    s.setJournal(&j);
+    s.Init();
+    CHECK(s.getState() == 5);
+    CHECK_NEAR(s.getPercent(), 45.0);
+    CHECK(j.getWrites() == 0);
+    s.MoveTo(8, false);
+    advance(500);
+    CHECK(fileCopy(TEST_JOURNAL, TEST_JOURNAL_COPY));
+    advance(5000);
+  }
+
+  // Питание пропало во время перемещения: положение неизвестно, привод требует установки в начальное положение
+  {
+    rShutterJournalFile j(TEST_JOURNAL_COPY, 4);
+    TEST_SHUTTER(s);
+    s.setJournal(&j);
+    s.Init();
+    CHECK(s.getState() == 0);
+    CHECK(!s.isHomed());
+  }
+
+  remove(TEST_JOURNAL);
+  remove(TEST_JOURNAL_COPY);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- Расписание ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+typedef struct {
+  int16_t id;
+  int mday;
+  int minutes;
+} sched_event_t;
+
+#define SCHED_EVENTS 16
+
+static sched_event_t _sched[SCHED_EVENTS];
+static uint8_t _sched_count = 0;
+
+static void schedDone(rShutterScheduler* scheduler, int16_t id, rShutter* shutter, bool result)
+{
+  (void)scheduler; (void)shutter; (void)result;
+  time_t now = shutterPortTime();
+  struct tm ti;
+  gmtime_r(&now, &ti);
+  if (_sched_count < SCHED_EVENTS) {
+    _sched[_sched_count].id = id;
+    _sched[_sched_count].mday = ti.tm_mday;
+    _sched[_sched_count].minutes = ti.tm_hour * 60 + ti.tm_min;
+    _sched_count++;
+  };
+}
+
+static void testScheduler()
+{
+  printf("scheduler\n");
+  setenv("TZ", "UTC", 1);
+  tzset();
+  _sched_count = 0;
+
+  // 9 октября 2025 года, 07:59 UTC
+  time_t start = 1760000000 - 1760000000 % 86400 + 7 * 3600 + 59 * 60;
+  shutterVirtualTimeReset(start);
+  TEST_SHUTTER(a);
+  rVirtualShutter b(3, true, 4, true, 0, 10, 15000, 1000, 1.0f, 0, nullptr, nullptr, nullptr);
+  a.Init();
+  b.Init();
+  rShutterScheduler sc(8, schedDone);
+  int16_t morning = sc.addDaily(&a, 8, 0, SHUTTER_SCHED_EVERY_DAY, SHUTTER_SCHED_STEP, 5, false);
+  int16_t evening = sc.addDaily(&a, 20, 0, SHUTTER_SCHED_EVERY_DAY, SHUTTER_SCHED_CLOSE, 0, false);
+  int16_t once = sc.addOnce(&b, start + 90, SHUTTER_SCHED_PERCENT, 30, false);
+  CHECK(sc.setLimits(once, 1, 8));
+  CHECK(sc.getCount() == 3);
+  CHECK(sc.getNext() == start + 60);
+
+  // Двое суток: ежедневные задания переходят на следующий день, однократное выполняется один раз и удаляется
+  for (int i = 0; i < 48 * 60; i++) {
+    advance(60000);
+  };
+  CHECK(_sched_count == 5);
+  if (_sched_count == 5) {
+    CHECK((_sched[0].id == morning) && (_sched[0].mday == 9) && (_sched[0].minutes == 8 * 60));
+    CHECK((_sched[1].id == once) && (_sched[1].mday == 9) && (_sched[1].minutes == 8 * 60));
+    CHECK((_sched[2].id == evening) && (_sched[2].mday == 9) && (_sched[2].minutes == 20 * 60));
+    CHECK((_sched[3].id == morning) && (_sched[3].mday == 10) && (_sched[3].minutes == 8 * 60));
+    CHECK((_sched[4].id == evening) && (_sched[4].mday == 10) && (_sched[4].minutes == 20 * 60));
+  };
+  CHECK(sc.getCount() == 2);
+  CHECK(a.getState() == 0);
+  CHECK(b.getState() == 3);
+
+  CHECK(sc.remove(morning));
+  CHECK(sc.getCount() == 1);
+  CHECK(sc.removeAll(&a) == 1);
+  CHECK(sc.getCount() == 0);
+  CHECK(sc.getNext() == 0);
+
+  // До синхронизации часов ежедневное задание добавляется, но не планируется
+  shutterVirtualTimeReset(1000);
+  CHECK(sc.addDaily(&b, 0, 30, SHUTTER_SCHED_EVERY_DAY, SHUTTER_SCHED_OPEN, 0, false) >= 0);
+  CHECK(sc.getNext() == 0);
+}
+
+int main()
+{
+  testRetarget();
+  testQueue();
+  testGroup();
+  testJournal();
+  testScheduler();
+  printf("%u checks, %u failed\n", _checks, _failed);
+  return _failed == 0 ? 0 : 1;
+}